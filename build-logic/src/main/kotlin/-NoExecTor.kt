@@ -227,12 +227,54 @@ fun KmpConfigurationExtension.configureNoExecTor(
                         #define __KMP_TOR_H
 
                         #include <kmp_tor.h>
+                        #include <pthread.h>
                         #include <stdlib.h>
 
+                        // Waits are performed in slices so that __kmp_tor_close is never held up
+                        // by a caller blocked on a state which may never come.
+                        #define __KMP_TOR_AWAIT_SLICE_NS 100000000LL
+
+                        // Outlives the kmp_tor_context_t it wraps. __kmp_tor_close frees ctx once
+                        // nothing is using it, after which every call fails as though tor is not
+                        // running. The wrapper itself is freed by __kmp_tor_deinit, which KmpTorApi
+                        // only calls once it is no longer reachable.
                         typedef struct __kmp_tor_context_t {
                           kmp_tor_context_t *ctx;
+                          void (*listener)(int state, void *arg);
+                          void *listener_arg;
+                          pthread_mutex_t lock;
+                          pthread_cond_t cond;
+                          int in_flight;
+                          int is_closed;
                         } __kmp_tor_context_t;
 
+                        static kmp_tor_context_t *
+                        __kmp_tor_enter(__kmp_tor_context_t *__ctx)
+                        {
+                          kmp_tor_context_t *ctx = NULL;
+                          if (!__ctx) {
+                            return NULL;
+                          }
+                          pthread_mutex_lock(&__ctx->lock);
+                            if (!__ctx->is_closed) {
+                              ctx = __ctx->ctx;
+                              __ctx->in_flight++;
+                            }
+                          pthread_mutex_unlock(&__ctx->lock);
+                          return ctx;
+                        }
+
+                        static void
+                        __kmp_tor_exit(__kmp_tor_context_t *__ctx)
+                        {
+                          pthread_mutex_lock(&__ctx->lock);
+                            __ctx->in_flight--;
+                            if (__ctx->in_flight == 0 && __ctx->is_closed) {
+                              pthread_cond_broadcast(&__ctx->cond);
+                            }
+                          pthread_mutex_unlock(&__ctx->lock);
+                        }
+
                         static __kmp_tor_context_t *
                         __kmp_tor_init()
                         {
@@ -241,14 +283,57 @@ fun KmpConfigurationExtension.configureNoExecTor(
                           if (!__ctx) {
                             return NULL;
                           }
+                          if (pthread_mutex_init(&__ctx->lock, NULL) != 0) {
+                            free(__ctx);
+                            return NULL;
+                          }
+                          if (pthread_cond_init(&__ctx->cond, NULL) != 0) {
+                            pthread_mutex_destroy(&__ctx->lock);
+                            free(__ctx);
+                            return NULL;
+                          }
                           __ctx->ctx = kmp_tor_init();
                           if (!__ctx->ctx) {
+                            pthread_cond_destroy(&__ctx->cond);
+                            pthread_mutex_destroy(&__ctx->lock);
                             free(__ctx);
                             return NULL;
                           }
+                          __ctx->listener = NULL;
+                          __ctx->listener_arg = NULL;
+                          __ctx->in_flight = 0;
+                          __ctx->is_closed = 0;
                           return __ctx;
                         }
 
+                        static int
+                        __kmp_tor_close(__kmp_tor_context_t *__ctx)
+                        {
+                          if (!__ctx) {
+                            return -1;
+                          }
+                          pthread_mutex_lock(&__ctx->lock);
+                            if (__ctx->is_closed) {
+                              pthread_mutex_unlock(&__ctx->lock);
+                              return 0;
+                            }
+                            __ctx->is_closed = 1;
+                          pthread_mutex_unlock(&__ctx->lock);
+
+                          // Shutting down tor's controller connection returns any blocked ctrl
+                          // I/O, and waits return within __KMP_TOR_AWAIT_SLICE_NS.
+                          kmp_tor_terminate_and_await_result(__ctx->ctx);
+                          pthread_mutex_lock(&__ctx->lock);
+                            while (__ctx->in_flight > 0) {
+                              pthread_cond_wait(&__ctx->cond, &__ctx->lock);
+                            }
+                          pthread_mutex_unlock(&__ctx->lock);
+
+                          int ret = kmp_tor_deinit(__ctx->ctx);
+                          __ctx->ctx = NULL;
+                          return ret;
+                        }
+
                         static int
                         __kmp_tor_deinit(__kmp_tor_context_t *__ctx)
                         {
@@ -256,8 +341,9 @@ fun KmpConfigurationExtension.configureNoExecTor(
                           if (!__ctx) {
                             return ret;
                           }
-                          ret = kmp_tor_deinit(__ctx->ctx);
-                          __ctx->ctx = NULL;
+                          ret = __kmp_tor_close(__ctx);
+                          pthread_cond_destroy(&__ctx->cond);
+                          pthread_mutex_destroy(&__ctx->lock);
                           free(__ctx);
                           return ret;
                         }
@@ -268,25 +354,182 @@ fun KmpConfigurationExtension.configureNoExecTor(
                           if (!__ctx) {
                             return "__kmp_tor_context_t cannot be NULL";
                           }
-                          return kmp_tor_run_main(__ctx->ctx, lib_tor, argc, argv);
+                          kmp_tor_context_t *ctx = __kmp_tor_enter(__ctx);
+                          if (!ctx) {
+                            return "KmpTorApi is closed";
+                          }
+                          const char *ret = kmp_tor_run_main(ctx, lib_tor, argc, argv);
+                          __kmp_tor_exit(__ctx);
+                          return ret;
+                        }
+
+                        static const char *
+                        __kmp_tor_run_main_with_options(__kmp_tor_context_t *__ctx, const char *lib_tor, int argc, char *argv[], const kmp_tor_thread_options_t *options)
+                        {
+                          if (!__ctx) {
+                            return "__kmp_tor_context_t cannot be NULL";
+                          }
+                          kmp_tor_context_t *ctx = __kmp_tor_enter(__ctx);
+                          if (!ctx) {
+                            return "KmpTorApi is closed";
+                          }
+                          const char *ret = kmp_tor_run_main_with_options(ctx, lib_tor, argc, argv, options);
+                          __kmp_tor_exit(__ctx);
+                          return ret;
                         }
 
                         static int
                         __kmp_tor_state(__kmp_tor_context_t *__ctx)
                         {
-                          if (!__ctx) {
+                          kmp_tor_context_t *ctx = __kmp_tor_enter(__ctx);
+                          if (!ctx) {
                             return -1;
                           }
-                          return kmp_tor_state(__ctx->ctx);
+                          int ret = kmp_tor_state(ctx);
+                          __kmp_tor_exit(__ctx);
+                          return ret;
+                        }
+
+                        static int
+                        __kmp_tor_await_state(__kmp_tor_context_t *__ctx, int state, int64_t timeout_ns)
+                        {
+                          kmp_tor_context_t *ctx = __kmp_tor_enter(__ctx);
+                          if (!ctx) {
+                            return -1;
+                          }
+                          int ret = -1;
+                          int is_closed = 0;
+                          int64_t remaining = timeout_ns;
+                          while (!is_closed) {
+                            int64_t slice = remaining;
+                            if (slice < 0 || slice > __KMP_TOR_AWAIT_SLICE_NS) {
+                              slice = __KMP_TOR_AWAIT_SLICE_NS;
+                            }
+                            ret = kmp_tor_await_state(ctx, state, slice);
+                            if (ret == state || ret < 0 || slice == remaining) {
+                              break;
+                            }
+                            if (remaining > 0) {
+                              remaining -= slice;
+                            }
+                            pthread_mutex_lock(&__ctx->lock);
+                              is_closed = __ctx->is_closed;
+                            pthread_mutex_unlock(&__ctx->lock);
+                          }
+                          __kmp_tor_exit(__ctx);
+                          return ret;
+                        }
+
+                        static int
+                        __kmp_tor_state_fd(__kmp_tor_context_t *__ctx)
+                        {
+                          // The descriptor is closed along with ctx, so it is only
+                          // valid for as long as the KmpTorApi is not closed.
+                          kmp_tor_context_t *ctx = __kmp_tor_enter(__ctx);
+                          if (!ctx) {
+                            return -1;
+                          }
+                          int ret = kmp_tor_state_fd(ctx);
+                          __kmp_tor_exit(__ctx);
+                          return ret;
+                        }
+
+                        static void
+                        __kmp_tor_state_listener_trampoline(kmp_tor_context_t *ctx, int state, void *arg)
+                        {
+                          __kmp_tor_context_t *__ctx = arg;
+                          __ctx->listener(state, __ctx->listener_arg);
+                        }
+
+                        static int
+                        __kmp_tor_state_listener(__kmp_tor_context_t *__ctx, void (*listener)(int state, void *arg), void *arg)
+                        {
+                          kmp_tor_context_t *ctx = __kmp_tor_enter(__ctx);
+                          if (!ctx) {
+                            return -1;
+                          }
+                          // kmp_tor_state_listener waits out a notification in progress,
+                          // so once cleared nothing is executing the old one.
+                          int ret = kmp_tor_state_listener(ctx, NULL, NULL);
+                          if (ret == 0 && listener) {
+                            __ctx->listener = listener;
+                            __ctx->listener_arg = arg;
+                            ret = kmp_tor_state_listener(ctx, &__kmp_tor_state_listener_trampoline, __ctx);
+                          }
+                          __kmp_tor_exit(__ctx);
+                          return ret;
+                        }
+
+                        static int
+                        __kmp_tor_ctrl_read(__kmp_tor_context_t *__ctx, void *buf, int len)
+                        {
+                          kmp_tor_context_t *ctx = __kmp_tor_enter(__ctx);
+                          if (!ctx) {
+                            return -1;
+                          }
+                          int ret = kmp_tor_ctrl_read(ctx, buf, len);
+                          __kmp_tor_exit(__ctx);
+                          return ret;
+                        }
+
+                        static int
+                        __kmp_tor_ctrl_write(__kmp_tor_context_t *__ctx, const void *buf, int len)
+                        {
+                          kmp_tor_context_t *ctx = __kmp_tor_enter(__ctx);
+                          if (!ctx) {
+                            return -1;
+                          }
+                          int ret = kmp_tor_ctrl_write(ctx, buf, len);
+                          __kmp_tor_exit(__ctx);
+                          return ret;
+                        }
+
+                        static int
+                        __kmp_tor_warm_restart(__kmp_tor_context_t *__ctx, int enable)
+                        {
+                          kmp_tor_context_t *ctx = __kmp_tor_enter(__ctx);
+                          if (!ctx) {
+                            return -1;
+                          }
+                          int ret = kmp_tor_warm_restart(ctx, enable);
+                          __kmp_tor_exit(__ctx);
+                          return ret;
+                        }
+
+                        static uint64_t
+                        __kmp_tor_warm_restart_saved_ns(__kmp_tor_context_t *__ctx)
+                        {
+                          kmp_tor_context_t *ctx = __kmp_tor_enter(__ctx);
+                          if (!ctx) {
+                            return 0;
+                          }
+                          uint64_t ret = kmp_tor_warm_restart_saved_ns(ctx);
+                          __kmp_tor_exit(__ctx);
+                          return ret;
+                        }
+
+                        static int
+                        __kmp_tor_stats(__kmp_tor_context_t *__ctx, kmp_tor_stats_t *stats)
+                        {
+                          kmp_tor_context_t *ctx = __kmp_tor_enter(__ctx);
+                          if (!ctx) {
+                            return -1;
+                          }
+                          int ret = kmp_tor_stats(ctx, stats);
+                          __kmp_tor_exit(__ctx);
+                          return ret;
                         }
 
                         static int
                         __kmp_tor_terminate_and_await_result(__kmp_tor_context_t *__ctx)
                         {
-                          if (!__ctx) {
+                          kmp_tor_context_t *ctx = __kmp_tor_enter(__ctx);
+                          if (!ctx) {
                             return -1;
                           }
-                          return kmp_tor_terminate_and_await_result(__ctx->ctx);
+                          int ret = kmp_tor_terminate_and_await_result(ctx);
+                          __kmp_tor_exit(__ctx);
+                          return ret;
                         }
 
                         #endif /* !defined(__KMP_TOR_H) */
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2025 Matthew Nelson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+/**
+ * Offline start/stop latency benchmark for kmp_tor.c + lib_load.c.
+ *
+ * Each iteration runs a full kmp_tor_run_main -> STARTED ->
+ * kmp_tor_terminate_and_await_result cycle against the given library
+ * and reports p50/p99/max of each phase over all iterations.
+ *
+ * When run against the stub library (tor_api_stub.c), the stub reports
+ * back when each point of its lifecycle is reached, which splits the
+ * cycle into the following phases:
+ *
+ *   dlopen      kmp_tor_run_main called -> stub constructor ran
+ *   resolve     stub constructor ran    -> tor_main_configuration_new
+ *   socketpair  configuration_new       -> configuration_set_command_line
+ *   spawn       set_command_line        -> tor_run_main entered on the tor thread
+ *   run         terminate called        -> tor_run_main observed the controller close
+ *   teardown    tor_run_main returned   -> stub destructor ran (configuration
+ *                                          free, OPENSSL_cleanup, thread join)
+ *   dlclose     stub destructor ran     -> terminate returned
+ *
+ * For any other library (e.g. the real libtor), the phases are instead
+ * taken from kmp_tor_stats (see kmp_tor_stats_t), where run is not
+ * available, teardown is tor_main_configuration_free + OPENSSL_cleanup
+ * and dlclose is lib_load_close.
+ *
+ * Nothing here requires a network; when running the real libtor, pass
+ * -d so tor has a throwaway DataDirectory (it is started with
+ * DisableNetwork 1).
+ *
+ * Usage: kmp_tor_bench [-n iterations] [-w warmup] [-d data_dir] /path/to/lib
+ **/
+#include "../kmp_tor.h"
+#include "tor_api_stub.h"
+
+#include <inttypes.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PHASE_DLOPEN      0
+#define BENCH_PHASE_RESOLVE     1
+#define BENCH_PHASE_SOCKETPAIR  2
+#define BENCH_PHASE_SPAWN       3
+#define BENCH_PHASE_RUN         4
+#define BENCH_PHASE_TEARDOWN    5
+#define BENCH_PHASE_DLCLOSE     6
+#define BENCH_PHASE_START       7
+#define BENCH_PHASE_STOP        8
+#define BENCH_PHASE_COUNT       9
+
+static const char *bench_phase_names[BENCH_PHASE_COUNT] = {
+  "dlopen",
+  "resolve",
+  "socketpair",
+  "spawn",
+  "run",
+  "teardown",
+  "dlclose",
+  "start (total)",
+  "stop (total)",
+};
+
+static uint64_t bench_stamps[TOR_API_STUB_STAMP_COUNT];
+
+static uint64_t
+bench_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec) * 1000000000ULL + ((uint64_t) ts.tv_nsec);
+}
+
+/**
+ * Looked up by the stub library via TOR_API_STUB_STAMP_SYMBOL. The
+ * executable must export its dynamic symbols (-rdynamic) for that.
+ **/
+__attribute__((visibility("default")))
+void
+tor_api_stub_stamp(int stamp)
+{
+  if (stamp < 0 || stamp >= TOR_API_STUB_STAMP_COUNT) {
+    return;
+  }
+  __atomic_store_n(&bench_stamps[stamp], bench_now_ns(), __ATOMIC_RELEASE);
+}
+
+static uint64_t
+bench_stamp(int stamp)
+{
+  return __atomic_load_n(&bench_stamps[stamp], __ATOMIC_ACQUIRE);
+}
+
+static int
+bench_compare(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+static uint64_t
+bench_percentile(const uint64_t *sorted, int n, int p)
+{
+  // Nearest-rank
+  int i = (int) (((int64_t) p * n + 99) / 100) - 1;
+  if (i < 0) {
+    i = 0;
+  }
+  return sorted[i];
+}
+
+static void
+bench_usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-n iterations] [-w warmup] [-d data_dir] /path/to/lib\n", name);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int iterations = 1000;
+  int warmup = 10;
+  const char *data_dir = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:w:d:")) != -1) {
+    switch (opt) {
+      case 'n':
+        iterations = atoi(optarg);
+        break;
+      case 'w':
+        warmup = atoi(optarg);
+        break;
+      case 'd':
+        data_dir = optarg;
+        break;
+      default:
+        bench_usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (optind != argc - 1 || iterations < 1 || warmup < 0) {
+    bench_usage(argv[0]);
+    return 1;
+  }
+
+  const char *lib_tor = argv[optind];
+
+  char *tor_argv[16];
+  int tor_argc = 0;
+  tor_argv[tor_argc++] = "tor";
+  tor_argv[tor_argc++] = "--quiet";
+  tor_argv[tor_argc++] = "--ignore-missing-torrc";
+  tor_argv[tor_argc++] = "--defaults-torrc";
+  tor_argv[tor_argc++] = "/dev/null";
+  tor_argv[tor_argc++] = "-f";
+  tor_argv[tor_argc++] = "/dev/null";
+  tor_argv[tor_argc++] = "--DisableNetwork";
+  tor_argv[tor_argc++] = "1";
+  tor_argv[tor_argc++] = "--SocksPort";
+  tor_argv[tor_argc++] = "0";
+  if (data_dir) {
+    tor_argv[tor_argc++] = "--DataDirectory";
+    tor_argv[tor_argc++] = (char *) data_dir;
+  }
+
+  uint64_t *samples[BENCH_PHASE_COUNT];
+  for (int p = 0; p < BENCH_PHASE_COUNT; p++) {
+    samples[p] = calloc((size_t) iterations, sizeof(uint64_t));
+    if (!samples[p]) {
+      fprintf(stderr, "Failed to allocate samples\n");
+      return 1;
+    }
+  }
+
+  kmp_tor_context_t *ctx = kmp_tor_init();
+  if (!ctx) {
+    fprintf(stderr, "kmp_tor_init failed\n");
+    return 1;
+  }
+
+  int is_stub = 1;
+  int rv = 0;
+
+  for (int i = 0; i < warmup + iterations; i++) {
+    memset(bench_stamps, 0, sizeof(bench_stamps));
+
+    uint64_t t_start = bench_now_ns();
+    const char *err = kmp_tor_run_main(ctx, lib_tor, tor_argc, tor_argv);
+    uint64_t t_started = bench_now_ns();
+    if (err) {
+      fprintf(stderr, "iteration[%d]: kmp_tor_run_main failed: %s\n", i, err);
+      rv = 1;
+      break;
+    }
+
+    // STARTED is published just before tor_run_main is called, so
+    // wait for the tor thread to actually get there.
+    if (is_stub && bench_stamp(TOR_API_STUB_STAMP_LOADED) != 0) {
+      while (bench_stamp(TOR_API_STUB_STAMP_RUN_MAIN_ENTER) == 0) {
+        sched_yield();
+      }
+    } else {
+      is_stub = 0;
+    }
+
+    uint64_t t_stop = bench_now_ns();
+    int result = kmp_tor_terminate_and_await_result(ctx);
+    uint64_t t_stopped = bench_now_ns();
+    if (result < 0) {
+      fprintf(stderr, "iteration[%d]: kmp_tor_terminate_and_await_result failed: %d\n", i, result);
+      rv = 1;
+      break;
+    }
+
+    if (i < warmup) {
+      continue;
+    }
+    int s = i - warmup;
+
+    samples[BENCH_PHASE_START][s] = t_started - t_start;
+    samples[BENCH_PHASE_STOP][s] = t_stopped - t_stop;
+
+    if (!is_stub) {
+      kmp_tor_stats_t stats;
+      kmp_tor_stats(ctx, &stats);
+      samples[BENCH_PHASE_DLOPEN][s] = stats.lib_open_ns;
+      samples[BENCH_PHASE_RESOLVE][s] = stats.lib_resolve_ns;
+      samples[BENCH_PHASE_SOCKETPAIR][s] = stats.configure_ns;
+      samples[BENCH_PHASE_SPAWN][s] = stats.thread_start_ns;
+      samples[BENCH_PHASE_TEARDOWN][s] = stats.cleanup_ns;
+      samples[BENCH_PHASE_DLCLOSE][s] = stats.lib_close_ns;
+      continue;
+    }
+
+    uint64_t loaded = bench_stamp(TOR_API_STUB_STAMP_LOADED);
+    uint64_t cfg_new = bench_stamp(TOR_API_STUB_STAMP_CFG_NEW);
+    uint64_t cfg_set = bench_stamp(TOR_API_STUB_STAMP_CFG_SET_COMMAND_LINE);
+    uint64_t run_enter = bench_stamp(TOR_API_STUB_STAMP_RUN_MAIN_ENTER);
+    uint64_t run_exit = bench_stamp(TOR_API_STUB_STAMP_RUN_MAIN_EXIT);
+    uint64_t unloaded = bench_stamp(TOR_API_STUB_STAMP_UNLOADED);
+
+    if (!cfg_new || !cfg_set || !run_exit || !unloaded) {
+      fprintf(stderr, "iteration[%d]: stub library did not report its full lifecycle\n", i);
+      rv = 1;
+      break;
+    }
+
+    samples[BENCH_PHASE_DLOPEN][s] = loaded - t_start;
+    samples[BENCH_PHASE_RESOLVE][s] = cfg_new - loaded;
+    samples[BENCH_PHASE_SOCKETPAIR][s] = cfg_set - cfg_new;
+    samples[BENCH_PHASE_SPAWN][s] = run_enter - cfg_set;
+    samples[BENCH_PHASE_RUN][s] = run_exit - t_stop;
+    samples[BENCH_PHASE_TEARDOWN][s] = unloaded - run_exit;
+    samples[BENCH_PHASE_DLCLOSE][s] = t_stopped - unloaded;
+  }
+
+  kmp_tor_deinit(ctx);
+
+  if (rv == 0) {
+    printf("lib[%s] iterations[%d] warmup[%d]\n\n", lib_tor, iterations, warmup);
+    printf("%-16s %12s %12s %12s\n", "phase", "p50 (us)", "p99 (us)", "max (us)");
+
+    for (int p = 0; p < BENCH_PHASE_COUNT; p++) {
+      if (!is_stub && p == BENCH_PHASE_RUN) {
+        continue;
+      }
+      qsort(samples[p], (size_t) iterations, sizeof(uint64_t), bench_compare);
+      printf(
+        "%-16s %12.3f %12.3f %12.3f\n",
+        bench_phase_names[p],
+        bench_percentile(samples[p], iterations, 50) / 1000.0,
+        bench_percentile(samples[p], iterations, 99) / 1000.0,
+        samples[p][iterations - 1] / 1000.0
+      );
+    }
+
+    if (!is_stub) {
+      printf("\nlib[%s] is not the stub library; phases are from kmp_tor_stats\n", lib_tor);
+    }
+  }
+
+  for (int p = 0; p < BENCH_PHASE_COUNT; p++) {
+    free(samples[p]);
+  }
+
+  return rv;
+}
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2025 Matthew Nelson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+/**
+ * A stand-in for libtor that exports the symbols listed in
+ * exports/tor_api.map, for exercising kmp_tor.c and lib_load.c without
+ * tor (or a network). tor_run_main does nothing but block until the
+ * __OwningControllerFD it was configured with is closed or shut down,
+ * which is how kmp_tor_terminate_and_await_result stops tor.
+ *
+ * Non-Windows only.
+ **/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "tor_api_stub.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define TOR_API_STUB_EXPORT __attribute__((visibility("default")))
+
+typedef struct {
+  int argc;
+  char **argv;
+} tor_main_configuration_t;
+
+static tor_api_stub_stamp_t stub_stamp_fn = NULL;
+static tor_api_stub_threads_t stub_threads_fn = NULL;
+
+static void
+stub_stamp(int stamp)
+{
+  if (stub_stamp_fn) {
+    stub_stamp_fn(stamp);
+  }
+}
+
+__attribute__((constructor))
+static void
+stub_load(void)
+{
+  *(void **) (&stub_stamp_fn) = dlsym(RTLD_DEFAULT, TOR_API_STUB_STAMP_SYMBOL);
+  *(void **) (&stub_threads_fn) = dlsym(RTLD_DEFAULT, TOR_API_STUB_THREADS_SYMBOL);
+  stub_stamp(TOR_API_STUB_STAMP_LOADED);
+}
+
+__attribute__((destructor))
+static void
+stub_unload(void)
+{
+  stub_stamp(TOR_API_STUB_STAMP_UNLOADED);
+  stub_stamp_fn = NULL;
+  stub_threads_fn = NULL;
+}
+
+TOR_API_STUB_EXPORT void
+OPENSSL_cleanup(void)
+{
+  stub_stamp(TOR_API_STUB_STAMP_OPENSSL_CLEANUP);
+}
+
+TOR_API_STUB_EXPORT int
+OPENSSL_init_ssl(uint64_t opts, const void *settings)
+{
+  (void) opts;
+  (void) settings;
+  return 1;
+}
+
+TOR_API_STUB_EXPORT const char *
+tor_api_get_provider_version(void)
+{
+  return "kmp-tor-stub";
+}
+
+TOR_API_STUB_EXPORT int
+tor_api_workqueue_threads_unjoined(void)
+{
+  // The stub never spawns any threads of its own.
+  return stub_threads_fn ? stub_threads_fn() : 0;
+}
+
+TOR_API_STUB_EXPORT tor_main_configuration_t *
+tor_main_configuration_new(void)
+{
+  stub_stamp(TOR_API_STUB_STAMP_CFG_NEW);
+  return calloc(1, sizeof(tor_main_configuration_t));
+}
+
+TOR_API_STUB_EXPORT int
+tor_main_configuration_set_command_line(tor_main_configuration_t *cfg, int argc, char *argv[])
+{
+  stub_stamp(TOR_API_STUB_STAMP_CFG_SET_COMMAND_LINE);
+  if (!cfg) {
+    return -1;
+  }
+  cfg->argc = argc;
+  cfg->argv = argv;
+  return 0;
+}
+
+TOR_API_STUB_EXPORT int
+tor_main_configuration_setup_control_socket(tor_main_configuration_t *cfg)
+{
+  (void) cfg;
+  // Only used by kmp_tor.c on Windows, which the stub does not support.
+  return -1;
+}
+
+TOR_API_STUB_EXPORT void
+tor_main_configuration_free(tor_main_configuration_t *cfg)
+{
+  stub_stamp(TOR_API_STUB_STAMP_CFG_FREE);
+  free(cfg);
+}
+
+TOR_API_STUB_EXPORT int
+tor_run_main(const tor_main_configuration_t *cfg)
+{
+  stub_stamp(TOR_API_STUB_STAMP_RUN_MAIN_ENTER);
+
+  int fd = -1;
+  if (cfg) {
+    for (int i = 0; i + 1 < cfg->argc; i++) {
+      if (cfg->argv[i] && cfg->argv[i + 1] && strcmp(cfg->argv[i], "--__OwningControllerFD") == 0) {
+        fd = (int) strtol(cfg->argv[i + 1], NULL, 10);
+      }
+    }
+  }
+
+  if (fd < 0) {
+    stub_stamp(TOR_API_STUB_STAMP_RUN_MAIN_EXIT);
+    return 1;
+  }
+
+  // Block like tor's main loop would until the owning controller
+  // goes away. Anything written to it is discarded.
+  char buf[256];
+  ssize_t r;
+  do {
+    r = recv(fd, buf, sizeof(buf), 0);
+  } while (r > 0 || (r < 0 && errno == EINTR));
+
+  stub_stamp(TOR_API_STUB_STAMP_RUN_MAIN_EXIT);
+  return 0;
+}
+
+TOR_API_STUB_EXPORT int
+tor_main(int argc, char *argv[])
+{
+  tor_main_configuration_t *cfg = tor_main_configuration_new();
+  if (!cfg) {
+    return 1;
+  }
+  int r = tor_main_configuration_set_command_line(cfg, argc, argv);
+  if (r == 0) {
+    r = tor_run_main(cfg);
+  }
+  tor_main_configuration_free(cfg);
+  return r;
+}
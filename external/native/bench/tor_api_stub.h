@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2025 Matthew Nelson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+#ifndef TOR_API_STUB_H
+#define TOR_API_STUB_H
+
+/**
+ * Name of the function the stub library looks up in the loading
+ * process (via dlsym RTLD_DEFAULT) when it is loaded. If present, it
+ * is called with one of the TOR_API_STUB_STAMP_* values as each point
+ * in the library's lifecycle is reached.
+ **/
+#define TOR_API_STUB_STAMP_SYMBOL "tor_api_stub_stamp"
+
+typedef void (*tor_api_stub_stamp_t)(int stamp);
+
+/**
+ * Name of another function the stub library looks up in the loading
+ * process when it is loaded. If present, tor_api_workqueue_threads_unjoined
+ * returns its result, so as to simulate tor having left threads running.
+ * Otherwise, it returns 0.
+ **/
+#define TOR_API_STUB_THREADS_SYMBOL "tor_api_stub_threads_unjoined"
+
+typedef int (*tor_api_stub_threads_t)(void);
+
+/** Library constructor ran (end of dlopen). **/
+#define TOR_API_STUB_STAMP_LOADED               0
+/** tor_main_configuration_new was called (symbols resolved). **/
+#define TOR_API_STUB_STAMP_CFG_NEW              1
+/** tor_main_configuration_set_command_line was called (socketpair done). **/
+#define TOR_API_STUB_STAMP_CFG_SET_COMMAND_LINE 2
+/** tor_run_main was entered on the tor thread. **/
+#define TOR_API_STUB_STAMP_RUN_MAIN_ENTER       3
+/** tor_run_main observed the owning controller close and is returning. **/
+#define TOR_API_STUB_STAMP_RUN_MAIN_EXIT        4
+/** tor_main_configuration_free was called. **/
+#define TOR_API_STUB_STAMP_CFG_FREE             5
+/** OPENSSL_cleanup was called. **/
+#define TOR_API_STUB_STAMP_OPENSSL_CLEANUP      6
+/** Library destructor ran (within dlclose). **/
+#define TOR_API_STUB_STAMP_UNLOADED             7
+
+#define TOR_API_STUB_STAMP_COUNT                8
+
+#endif /* !defined(TOR_API_STUB_H) */
@@ -17,6 +17,9 @@
 
 #include <jni.h>
 #include <assert.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -27,14 +30,64 @@
 #endif // JNI_VERSION_1_6
 
 #define ERR_BUF_LEN 1024
+// Number of uint64_t fields preceding last_error in kmp_tor_stats_t. MUST
+// match TorApiNoExec.Stats.LEN, which kmpTorStats verifies at runtime.
+#define STATS_LEN 13
+_Static_assert(
+  offsetof(kmp_tor_stats_t, last_error) == STATS_LEN * sizeof(uint64_t),
+  "kmp_tor_stats_t changed, update STATS_LEN, KMP_TOR_JNI_kmpTorStats and TorApiNoExec.Stats"
+);
+#define CTRL_BUF_LEN 8192
+
+typedef struct jni_context_t jni_context_t;
+
+struct jni_context_t {
+  kmp_tor_context_t *ctx;
+  // Global reference to the KmpTorApi instance to notify of state
+  // transitions, or NULL if no listener is set.
+  jobject state_listener;
+  jni_context_t *next;
+};
 
-static kmp_tor_context_t *ctx = NULL;
+// Contexts handed out by kmpTorInit. They live for as long as the
+// KmpTorApi instance which holds them and are released by kmpTorDeinit
+// (or JNI_OnUnload, for any still remaining).
+static pthread_mutex_t jni_contexts_lock = PTHREAD_MUTEX_INITIALIZER;
+static jni_context_t *jni_contexts = NULL;
 static jclass clazz_kmp_tor_api = NULL;
+static jmethodID method_kmp_tor_on_state = NULL;
+static JavaVM *jvm = NULL;
+// Set (non-NULL) for threads which JNIStateListener attached to the JVM,
+// such that they are detached by JNIDetachThread upon exiting.
+static pthread_key_t jni_detach_key;
+static int is_jni_detach_key = 0;
+
+static kmp_tor_context_t *
+JLongToContext(jlong j_ctx)
+{
+  return (kmp_tor_context_t *) (intptr_t) j_ctx;
+}
+
+static jni_context_t *
+JLongToNode(jlong j_ctx)
+{
+  kmp_tor_context_t *ctx = JLongToContext(j_ctx);
+  jni_context_t *node = NULL;
+
+  pthread_mutex_lock(&jni_contexts_lock);
+    node = jni_contexts;
+    while (node && node->ctx != ctx) {
+      node = node->next;
+    }
+  pthread_mutex_unlock(&jni_contexts_lock);
+
+  return node;
+}
 
 static int
 CStringToErrBuf(JNIEnv *env, jbyteArray err_buf, const char *error)
 {
-  // err_buf is checked for non-NULL & capacity ERR_BUF_LEN in KMP_TOR_JNI_kmpTorRunMain
+  // err_buf is checked for non-NULL & capacity ERR_BUF_LEN by callers
 
   if (!error) {
     return 0;
@@ -48,11 +101,7 @@ CStringToErrBuf(JNIEnv *env, jbyteArray err_buf, const char *error)
     len = ERR_BUF_LEN;
   }
 
-  jbyte j_error[len];
-  for (jsize i = 0; i < len; i++) {
-    j_error[i] = error[i];
-  }
-  (*env)->SetByteArrayRegion(env, err_buf, 0, len, j_error);
+  (*env)->SetByteArrayRegion(env, err_buf, 0, len, (const jbyte *) error);
 
   return len;
 }
@@ -72,7 +121,7 @@ JByteArrayToCString(JNIEnv *env, jbyteArray a)
     return NULL;
   }
 
-  c_arg = malloc((len + 1) * sizeof(char *));
+  c_arg = malloc(len + 1);
   if (!c_arg) {
     return NULL;
   } else {
@@ -83,112 +132,433 @@ JByteArrayToCString(JNIEnv *env, jbyteArray a)
     return c_arg;
   }
 
-  jbyte j_buf[len];
-  (*env)->GetByteArrayRegion(env, a, 0, len, j_buf);
+  (*env)->GetByteArrayRegion(env, a, 0, len, (jbyte *) c_arg);
 
-  for (jsize i = 0; i < len; i++) {
-    c_arg[i] = j_buf[i];
+  return c_arg;
+}
+
+static int *
+JIntArrayToCInts(JNIEnv *env, jintArray a, int *len)
+{
+  assert(len);
+  *len = 0;
+  if (!a) {
+    return NULL;
   }
 
-  return c_arg;
+  jsize j_len = (*env)->GetArrayLength(env, a);
+  if (j_len <= 0) {
+    return NULL;
+  }
+
+  // jint is 32 bits, as is int on all supported platforms, so
+  // the elements can be copied directly.
+  assert(sizeof(jint) == sizeof(int));
+  int *c_ints = malloc(j_len * sizeof(int));
+  if (!c_ints) {
+    return NULL;
+  }
+
+  (*env)->GetIntArrayRegion(env, a, 0, j_len, (jint *) c_ints);
+
+  *len = (int) j_len;
+  return c_ints;
 }
 
 static jint JNICALL
 KMP_TOR_JNI_kmpTorRunMain
-(JNIEnv *env, jobject thiz, jbyteArray lib_tor, jobjectArray args, jbyteArray err_buf)
-{
+(
+  JNIEnv *env,
+  jobject thiz,
+  jlong j_ctx,
+  jbyteArray lib_tor,
+  jint argc,
+  jbyteArray args,
+  jintArray cpu_set,
+  jlong stack_size,
+  jint sched_policy,
+  jboolean set_nice,
+  jint nice,
+  jbyteArray thread_name,
+  jbyteArray err_buf
+) {
   assert(lib_tor);
   assert(args);
   assert(err_buf);
   assert((*env)->GetArrayLength(env, err_buf) == ERR_BUF_LEN);
 
-  jsize j_argc = (*env)->GetArrayLength(env, args);
-  if (j_argc <= 0) {
+  if (argc <= 0) {
     return CStringToErrBuf(env, err_buf, "args cannot be empty");
   }
+  if (stack_size < 0) {
+    return CStringToErrBuf(env, err_buf, "stack_size cannot be negative");
+  }
 
-  int copy_args = 0;
-  int c_argc = 0;
-  char **c_argv = NULL;
-  char *c_lib_tor = NULL;
   const char *error = NULL;
+  char *c_lib_tor = NULL;
+  kmp_tor_args_t *c_args = NULL;
+  int *c_cpu_set = NULL;
+  char *c_thread_name = NULL;
+  kmp_tor_thread_options_t options;
 
   c_lib_tor = JByteArrayToCString(env, lib_tor);
   if (!c_lib_tor) {
     return CStringToErrBuf(env, err_buf, "JByteArrayToCString failed to copy lib_tor");
   }
 
-  c_argv = malloc(j_argc * sizeof(char *));
-  if (!c_argv) {
+  // args are packed by KmpTorApi as argc NUL terminated strings, so
+  // they can be transferred directly into the kmp_tor_args_t buffer
+  // (which kmp_tor_run_main_args takes ownership of) in one go.
+  jsize len = (*env)->GetArrayLength(env, args);
+  c_args = kmp_tor_args_new(argc, (size_t) (len < 0 ? 0 : len));
+  if (!c_args) {
     free(c_lib_tor);
-    c_lib_tor = NULL;
-    return CStringToErrBuf(env, err_buf, "Failed to create c_argv");
+    return CStringToErrBuf(env, err_buf, "Failed to create kmp_tor_args_t");
   }
+  (*env)->GetByteArrayRegion(env, args, 0, len, (jbyte *) kmp_tor_args_buf(c_args));
+
+  memset(&options, 0, sizeof(kmp_tor_thread_options_t));
+  options.stack_size = (size_t) stack_size;
+  options.sched_policy = sched_policy;
+  options.set_nice = set_nice ? 1 : 0;
+  options.nice = nice;
+
+  c_cpu_set = JIntArrayToCInts(env, cpu_set, &options.cpu_set_len);
+  c_thread_name = JByteArrayToCString(env, thread_name);
+  options.cpu_set = c_cpu_set;
+  options.name = c_thread_name;
+
+  if (cpu_set && (*env)->GetArrayLength(env, cpu_set) > 0 && !c_cpu_set) {
+    kmp_tor_args_free(c_args);
+    error = "Failed to copy cpu_set to C";
+  } else if (thread_name && !c_thread_name) {
+    kmp_tor_args_free(c_args);
+    error = "Failed to copy thread_name to C";
+  } else {
+    error = kmp_tor_run_main_args(JLongToContext(j_ctx), c_lib_tor, c_args, &options);
+  }
+  c_args = NULL;
 
-  for (jsize i = 0; i < j_argc; i++) {
-    if (copy_args != 0) {
-      c_argv[c_argc] = NULL;
-      c_argc++;
-      continue;
-    }
+  if (c_cpu_set) {
+    free(c_cpu_set);
+  }
+  if (c_thread_name) {
+    free(c_thread_name);
+  }
+  free(c_lib_tor);
 
-    jbyteArray j_arg = (jbyteArray) (*env)->GetObjectArrayElement(env, args, i);
-    c_argv[c_argc] = JByteArrayToCString(env, j_arg);
-    if (j_arg) {
-      (*env)->DeleteLocalRef(env, j_arg);
-    }
+  return CStringToErrBuf(env, err_buf, error);
+}
+
+static jint JNICALL
+KMP_TOR_JNI_kmpTorState
+(JNIEnv *env, jobject thiz, jlong j_ctx)
+{
+  return kmp_tor_state(JLongToContext(j_ctx));
+}
+
+static jint JNICALL
+KMP_TOR_JNI_kmpTorAwaitState
+(JNIEnv *env, jobject thiz, jlong j_ctx, jint state, jlong timeout_ns)
+{
+  return kmp_tor_await_state(JLongToContext(j_ctx), state, timeout_ns);
+}
 
-    if (!c_argv[c_argc]) {
-      copy_args = -1;
+static void
+JNIDetachThread(void *value)
+{
+  if (jvm) {
+    (*jvm)->DetachCurrentThread(jvm);
+  }
+}
+
+static void
+JNIStateListener(kmp_tor_context_t *ctx, int state, void *arg)
+{
+  // Called either on the thread which called into kmp_tor (already
+  // attached) or tor's thread (which is not). tor's thread is attached
+  // upon its first transition and stays so until it exits, rather than
+  // attaching and detaching for every transition.
+  jni_context_t *node = arg;
+  JNIEnv *env = NULL;
+
+  jint r = (*jvm)->GetEnv(jvm, (void **)&env, __JNI_VERSION);
+  if (r == JNI_EDETACHED && is_jni_detach_key) {
+#ifdef __ANDROID__
+    r = (*jvm)->AttachCurrentThreadAsDaemon(jvm, &env, NULL);
+#else
+    r = (*jvm)->AttachCurrentThreadAsDaemon(jvm, (void **)&env, NULL);
+#endif // __ANDROID__
+    if (r == JNI_OK && pthread_setspecific(jni_detach_key, jvm) != 0) {
+      (*jvm)->DetachCurrentThread(jvm);
+      r = JNI_ERR;
     }
+  }
+  if (r != JNI_OK) {
+    return;
+  }
 
-    c_argc++;
+  (*env)->CallVoidMethod(env, node->state_listener, method_kmp_tor_on_state, (jint) state);
+  if ((*env)->ExceptionCheck(env)) {
+    (*env)->ExceptionClear(env);
   }
+}
 
-  if (copy_args == 0) {
-    error = kmp_tor_run_main(ctx, c_lib_tor, c_argc, c_argv);
-  } else {
-    error = "Failed to copy arguments to C";
+static jint JNICALL
+KMP_TOR_JNI_kmpTorStateListener
+(JNIEnv *env, jobject thiz, jlong j_ctx, jobject listener)
+{
+  jni_context_t *node = JLongToNode(j_ctx);
+  if (!node) {
+    return -1;
   }
 
-  for (int i = 0; i < c_argc; i++) {
-    if (c_argv[i]) {
-      free(c_argv[i]);
-      c_argv[i] = NULL;
+  jobject ref = NULL;
+  if (listener) {
+    ref = (*env)->NewGlobalRef(env, listener);
+    if (!ref) {
+      return -1;
     }
   }
-  free(c_argv);
-  c_argv = NULL;
-  free(c_lib_tor);
-  c_lib_tor = NULL;
 
-  return CStringToErrBuf(env, err_buf, error);
+  // Once this returns, the listener is no longer being invoked (unless it
+  // is what called this) so the old reference can be swapped out.
+  kmp_tor_state_listener(node->ctx, NULL, NULL);
+  jobject old = node->state_listener;
+  node->state_listener = ref;
+  if (ref) {
+    kmp_tor_state_listener(node->ctx, &JNIStateListener, node);
+  }
+
+  if (old) {
+    (*env)->DeleteGlobalRef(env, old);
+  }
+  return 0;
+}
+
+static jbyte *
+DirectBufferRegion(JNIEnv *env, jobject buf, jint position, jint len)
+{
+  if (!buf || position < 0 || len < 0) {
+    return NULL;
+  }
+
+  jbyte *address = (*env)->GetDirectBufferAddress(env, buf);
+  if (!address) {
+    // Not a direct ByteBuffer
+    return NULL;
+  }
+
+  jlong capacity = (*env)->GetDirectBufferCapacity(env, buf);
+  if (capacity < 0 || ((jlong) position + (jlong) len) > capacity) {
+    return NULL;
+  }
+
+  return address + position;
 }
 
 static jint JNICALL
-KMP_TOR_JNI_kmpTorState
-(JNIEnv *env, jobject thiz)
+KMP_TOR_JNI_kmpTorCtrlRead
+(JNIEnv *env, jobject thiz, jlong j_ctx, jobject dst, jint position, jint len)
+{
+  jbyte *address = DirectBufferRegion(env, dst, position, len);
+  if (!address) {
+    return -1;
+  }
+  return kmp_tor_ctrl_read(JLongToContext(j_ctx), address, len);
+}
+
+static jint JNICALL
+KMP_TOR_JNI_kmpTorCtrlWrite
+(JNIEnv *env, jobject thiz, jlong j_ctx, jobject src, jint position, jint len)
+{
+  jbyte *address = DirectBufferRegion(env, src, position, len);
+  if (!address) {
+    return -1;
+  }
+  return kmp_tor_ctrl_write(JLongToContext(j_ctx), address, len);
+}
+
+static int
+ByteArrayRegionIsValid(JNIEnv *env, jbyteArray a, jint offset, jint len)
+{
+  if (!a || offset < 0 || len < 0) {
+    return 0;
+  }
+  return ((jlong) offset + (jlong) len) <= (jlong) (*env)->GetArrayLength(env, a);
+}
+
+// Heap arrays cannot be pinned across a blocking call, so the byte[] variants
+// transfer at most CTRL_BUF_LEN bytes per call via a stack buffer. Reads and
+// writes may be short regardless, which callers already handle.
+static jint JNICALL
+KMP_TOR_JNI_kmpTorCtrlReadBytes
+(JNIEnv *env, jobject thiz, jlong j_ctx, jbyteArray dst, jint offset, jint len)
 {
-  return kmp_tor_state(ctx);
+  if (!ByteArrayRegionIsValid(env, dst, offset, len)) {
+    return -1;
+  }
+
+  jbyte buf[CTRL_BUF_LEN];
+  int read = kmp_tor_ctrl_read(JLongToContext(j_ctx), buf, len > CTRL_BUF_LEN ? CTRL_BUF_LEN : len);
+  if (read > 0) {
+    (*env)->SetByteArrayRegion(env, dst, offset, read, buf);
+  }
+  return read;
+}
+
+static jint JNICALL
+KMP_TOR_JNI_kmpTorCtrlWriteBytes
+(JNIEnv *env, jobject thiz, jlong j_ctx, jbyteArray src, jint offset, jint len)
+{
+  if (!ByteArrayRegionIsValid(env, src, offset, len)) {
+    return -1;
+  }
+
+  jbyte buf[CTRL_BUF_LEN];
+  if (len > CTRL_BUF_LEN) {
+    len = CTRL_BUF_LEN;
+  }
+  (*env)->GetByteArrayRegion(env, src, offset, len, buf);
+  return kmp_tor_ctrl_write(JLongToContext(j_ctx), buf, len);
+}
+
+static jint JNICALL
+KMP_TOR_JNI_kmpTorWarmRestart
+(JNIEnv *env, jobject thiz, jlong j_ctx, jboolean enable)
+{
+  return kmp_tor_warm_restart(JLongToContext(j_ctx), enable ? 1 : 0);
+}
+
+static jlong JNICALL
+KMP_TOR_JNI_kmpTorWarmRestartSavedNanos
+(JNIEnv *env, jobject thiz, jlong j_ctx)
+{
+  return (jlong) kmp_tor_warm_restart_saved_ns(JLongToContext(j_ctx));
+}
+
+static jint JNICALL
+KMP_TOR_JNI_kmpTorStats
+(JNIEnv *env, jobject thiz, jlong j_ctx, jlongArray j_stats, jbyteArray err_buf)
+{
+  assert(j_stats);
+  if ((*env)->GetArrayLength(env, j_stats) != STATS_LEN) {
+    // TorApiNoExec.Stats.LEN does not match
+    return -2;
+  }
+  assert(err_buf);
+  assert((*env)->GetArrayLength(env, err_buf) == ERR_BUF_LEN);
+
+  kmp_tor_stats_t stats;
+  if (kmp_tor_stats(JLongToContext(j_ctx), &stats) != 0) {
+    return -1;
+  }
+
+  // Order MUST match KmpTorApi.Stats
+  jlong values[] = {
+    (jlong) stats.run_count,
+    (jlong) stats.started_at_ns,
+    (jlong) stats.stopped_at_ns,
+    (jlong) stats.lib_open_ns,
+    (jlong) stats.lib_resolve_ns,
+    (jlong) stats.configure_ns,
+    (jlong) stats.thread_start_ns,
+    (jlong) stats.run_main_ns,
+    (jlong) stats.cleanup_ns,
+    (jlong) stats.lib_close_ns,
+    (jlong) stats.warm_lib_close_ns,
+    (jlong) stats.lib_close_failures,
+    (jlong) stats.lib_close_retries,
+  };
+  _Static_assert(sizeof(values) / sizeof(values[0]) == STATS_LEN, "values does not cover kmp_tor_stats_t");
+  (*env)->SetLongArrayRegion(env, j_stats, 0, STATS_LEN, values);
+
+  return CStringToErrBuf(env, err_buf, stats.last_error);
 }
 
 static jint JNICALL
 KMP_TOR_JNI_kmpTorTerminateAndAwaitResult
+(JNIEnv *env, jobject thiz, jlong j_ctx)
+{
+  return kmp_tor_terminate_and_await_result(JLongToContext(j_ctx));
+}
+
+static jlong JNICALL
+KMP_TOR_JNI_kmpTorInit
 (JNIEnv *env, jobject thiz)
 {
-  return kmp_tor_terminate_and_await_result(ctx);
+  jni_context_t *node = malloc(sizeof(jni_context_t));
+  if (!node) {
+    return 0;
+  }
+
+  node->ctx = kmp_tor_init();
+  if (!node->ctx) {
+    free(node);
+    return 0;
+  }
+  node->state_listener = NULL;
+
+  pthread_mutex_lock(&jni_contexts_lock);
+    node->next = jni_contexts;
+    jni_contexts = node;
+  pthread_mutex_unlock(&jni_contexts_lock);
+
+  return (jlong) (intptr_t) node->ctx;
+}
+
+static jint JNICALL
+KMP_TOR_JNI_kmpTorDeinit
+(JNIEnv *env, jobject thiz, jlong j_ctx)
+{
+  // KmpTorApi guarantees nothing else is using the context at this point.
+  kmp_tor_context_t *ctx = JLongToContext(j_ctx);
+  jni_context_t *node = NULL;
+
+  pthread_mutex_lock(&jni_contexts_lock);
+    jni_context_t **next = &jni_contexts;
+    while (*next && (*next)->ctx != ctx) {
+      next = &(*next)->next;
+    }
+    if (*next) {
+      node = *next;
+      *next = node->next;
+    }
+  pthread_mutex_unlock(&jni_contexts_lock);
+
+  if (!node) {
+    return -1;
+  }
+
+  int r = kmp_tor_deinit(node->ctx);
+  if (node->state_listener) {
+    (*env)->DeleteGlobalRef(env, node->state_listener);
+  }
+  free(node);
+  return r;
 }
 
 static JNINativeMethod kmp_tor_jni_methods[] = {
-  {"kmpTorRunMain",                 "([B[[B[B)I", (void *) &KMP_TOR_JNI_kmpTorRunMain},
-  {"kmpTorState",                   "()I",        (void *) &KMP_TOR_JNI_kmpTorState},
-  {"kmpTorTerminateAndAwaitResult", "()I",        (void *) &KMP_TOR_JNI_kmpTorTerminateAndAwaitResult},
+  {"kmpTorInit",                    "()J",         (void *) &KMP_TOR_JNI_kmpTorInit},
+  {"kmpTorDeinit",                  "(J)I",        (void *) &KMP_TOR_JNI_kmpTorDeinit},
+  {"kmpTorRunMain",                 "(J[BI[B[IJIZI[B[B)I", (void *) &KMP_TOR_JNI_kmpTorRunMain},
+  {"kmpTorState",                   "(J)I",        (void *) &KMP_TOR_JNI_kmpTorState},
+  {"kmpTorAwaitState",              "(JIJ)I",      (void *) &KMP_TOR_JNI_kmpTorAwaitState},
+  {"kmpTorStateListener",           "(JLjava/lang/Object;)I", (void *) &KMP_TOR_JNI_kmpTorStateListener},
+  {"kmpTorCtrlRead",                "(JLjava/nio/ByteBuffer;II)I", (void *) &KMP_TOR_JNI_kmpTorCtrlRead},
+  {"kmpTorCtrlWrite",               "(JLjava/nio/ByteBuffer;II)I", (void *) &KMP_TOR_JNI_kmpTorCtrlWrite},
+  {"kmpTorCtrlRead",                "(J[BII)I",    (void *) &KMP_TOR_JNI_kmpTorCtrlReadBytes},
+  {"kmpTorCtrlWrite",               "(J[BII)I",    (void *) &KMP_TOR_JNI_kmpTorCtrlWriteBytes},
+  {"kmpTorWarmRestart",             "(JZ)I",       (void *) &KMP_TOR_JNI_kmpTorWarmRestart},
+  {"kmpTorWarmRestartSavedNanos",   "(J)J",        (void *) &KMP_TOR_JNI_kmpTorWarmRestartSavedNanos},
+  {"kmpTorStats",                   "(J[J[B)I",    (void *) &KMP_TOR_JNI_kmpTorStats},
+  {"kmpTorTerminateAndAwaitResult", "(J)I",        (void *) &KMP_TOR_JNI_kmpTorTerminateAndAwaitResult},
 };
 
 JNIEXPORT jint JNICALL
 JNI_OnLoad(JavaVM *vm, void *reserved)
 {
-  if (ctx) {
+  if (clazz_kmp_tor_api) {
     return JNI_ERR;
   }
 
@@ -207,8 +577,8 @@ JNI_OnLoad(JavaVM *vm, void *reserved)
     return JNI_ERR;
   }
 
-  ctx = kmp_tor_init();
-  if (!ctx) {
+  method_kmp_tor_on_state = (*env)->GetMethodID(env, clazz_kmp_tor_api, "kmpTorOnState", "(I)V");
+  if (!method_kmp_tor_on_state) {
     (*env)->DeleteGlobalRef(env, clazz_kmp_tor_api);
     clazz_kmp_tor_api = NULL;
     return JNI_ERR;
@@ -216,24 +586,42 @@ JNI_OnLoad(JavaVM *vm, void *reserved)
 
   int r = (*env)->RegisterNatives(env, clazz_kmp_tor_api, kmp_tor_jni_methods, sizeof(kmp_tor_jni_methods)/sizeof(JNINativeMethod));
   if (r != JNI_OK) {
-    kmp_tor_deinit(ctx);
-    ctx = NULL;
     (*env)->DeleteGlobalRef(env, clazz_kmp_tor_api);
     clazz_kmp_tor_api = NULL;
     return JNI_ERR;
   }
 
+  is_jni_detach_key = pthread_key_create(&jni_detach_key, &JNIDetachThread) == 0;
+  jvm = vm;
   return __JNI_VERSION;
 }
 
 JNIEXPORT void JNICALL
 JNI_OnUnload(JavaVM *vm, void *reserved)
 {
-  kmp_tor_deinit(ctx);
-  ctx = NULL;
+  jni_context_t *node = NULL;
+  JNIEnv *env = NULL;
 
-  JNIEnv *env;
   if ((*vm)->GetEnv(vm, (void **)&env, __JNI_VERSION) != JNI_OK) {
+    env = NULL;
+  }
+
+  pthread_mutex_lock(&jni_contexts_lock);
+    node = jni_contexts;
+    jni_contexts = NULL;
+  pthread_mutex_unlock(&jni_contexts_lock);
+
+  while (node) {
+    jni_context_t *next = node->next;
+    kmp_tor_deinit(node->ctx);
+    if (node->state_listener && env) {
+      (*env)->DeleteGlobalRef(env, node->state_listener);
+    }
+    free(node);
+    node = next;
+  }
+
+  if (!env) {
     return;
   }
   if (!clazz_kmp_tor_api) {
@@ -242,4 +630,9 @@ JNI_OnUnload(JavaVM *vm, void *reserved)
   (*env)->UnregisterNatives(env, clazz_kmp_tor_api);
   (*env)->DeleteGlobalRef(env, clazz_kmp_tor_api);
   clazz_kmp_tor_api = NULL;
+
+  if (is_jni_detach_key) {
+    pthread_key_delete(jni_detach_key);
+    is_jni_detach_key = 0;
+  }
 }
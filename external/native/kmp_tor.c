@@ -13,41 +13,116 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  **/
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// sched_setaffinity, SCHED_BATCH, SCHED_IDLE, pthread_setname_np
+#define _GNU_SOURCE
+#endif // __linux__ && !_GNU_SOURCE
+
 #include "kmp_tor.h"
 #include "lib_load.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __ANDROID__
+#include <android/log.h>
+#define fprintf(ignored, ...) \
+  __android_log_print(ANDROID_LOG_WARN, "kmp_tor", ##__VA_ARGS__)
+#endif // __ANDROID__
+
 #ifdef _WIN32
 #include "win32_sockets.h"
 
 typedef SOCKET kmp_tor_socket_t;
 #define KMP_TOR_SOCKET_INVALID INVALID_SOCKET
+#define KMP_TOR_SHUT_RDWR SD_BOTH
 #define __closesocket closesocket
 #else
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 
-#ifdef SOCK_CLOEXEC
-#include <errno.h>
-#endif // SOCK_CLOEXEC
+#ifdef __linux__
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif // __linux__
+
+#ifdef __APPLE__
+#include <pthread/qos.h>
+#endif // __APPLE__
 
 typedef int kmp_tor_socket_t;
 #define KMP_TOR_SOCKET_INVALID (-1)
+#define KMP_TOR_SHUT_RDWR SHUT_RDWR
 #define __closesocket close
 #endif // _WIN32
 
+#ifdef MSG_NOSIGNAL
+#define KMP_TOR_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define KMP_TOR_SEND_FLAGS 0
+#endif // MSG_NOSIGNAL
+
 #define KMP_TOR_RESULT_AWAITING -1
 
-typedef struct {
+// Timeouts greater than this are treated as indefinite so that
+// computing the absolute deadline cannot overflow time_t.
+#define KMP_TOR_AWAIT_MAX_NS ((int64_t) 365 * 24 * 60 * 60 * 1000000000)
+
+typedef struct kmp_tor_lib_claim_t kmp_tor_lib_claim_t;
+
+struct kmp_tor_lib_claim_t {
+  char *lib;
+#ifndef _WIN32
+  int has_id;
+  dev_t dev;
+  ino_t ino;
+#endif // !_WIN32
+  kmp_tor_lib_claim_t *next;
+};
+
+#define KMP_TOR_CTRL_FD_FLAG "--__OwningControllerFD"
+
+// Arguments for tor_run_main, held in a single allocation (see
+// kmp_tor_args_new) laid out as the struct, followed by argv, followed
+// by the packed argument strings (buf) which argv points into.
+//
+// The 2 argv slots after the caller's arguments are reserved for
+// __OwningControllerFD (to interrupt tor's main loop by closing it down
+// whenever needed, instead of dealing with signals, which can be a
+// nightmare), and point to ctrl_flag and ctrl_fd once configured.
+struct kmp_tor_args_t {
   int argc;
   char **argv;
+  size_t len;
+  char *buf;
+  char ctrl_flag[sizeof(KMP_TOR_CTRL_FD_FLAG)];
+  char ctrl_fd[32];
+};
+
+#define KMP_TOR_CTRL_DROPOWNERSHIP "DROPOWNERSHIP"
+
+// The keyword of the control-protocol line currently being written by
+// kmp_tor_ctrl_write, which may span multiple calls.
+typedef struct {
+  // Length of keyword so far, or -1 once past it (or if it is too long
+  // to be KMP_TOR_CTRL_DROPOWNERSHIP).
+  int len;
+  char keyword[sizeof(KMP_TOR_CTRL_DROPOWNERSHIP) - 1];
+} kmp_tor_ctrl_line_t;
+
+typedef struct {
+  kmp_tor_args_t *args;
 
   void *cfg;
 
@@ -56,6 +131,7 @@ typedef struct {
   void* (*tor_api_cfg_new)(void);
   int (*tor_api_cfg_set_command_line)(void *cfg, int argc, char **argv);
   int (*tor_api_run_main)(void *cfg);
+  int (*tor_api_threads_unjoined)(void);
 #ifdef _WIN32
   kmp_tor_socket_t (*tor_api_cfg_set_ctrl_socket)(void *cfg);
 
@@ -63,264 +139,1244 @@ typedef struct {
 #endif // _WIN32
   kmp_tor_socket_t ctrl_socket_0;
   kmp_tor_socket_t ctrl_socket_1;
+  int ctrl_io_count;
+  int ctrl_is_shutdown;
+  kmp_tor_ctrl_line_t ctrl_line;
 
   pthread_t thread_id;
+  kmp_tor_thread_options_t thread_options;
+  kmp_tor_lib_claim_t *lib_claim;
   lib_handle_t *lib_t;
+  uint64_t lib_load_ns;
+  // Runs of lib_t, up to and including this one, which reused a retained image.
+  uint64_t lib_reuse_count;
+  uint64_t openssl_cleanup_ns;
 
   int tor_run_main_result;
 } kmp_tor_handle_t;
 
+// A library image and its resolved symbols retained between runs
+// when warm restarts are enabled (see kmp_tor_warm_restart).
+typedef struct {
+  int enabled;
+
+  kmp_tor_lib_claim_t *lib_claim;
+  lib_handle_t *lib_t;
+
+  void (*OPENSSL_cleanup)(void);
+  void (*tor_api_cfg_free)(void *cfg);
+  void* (*tor_api_cfg_new)(void);
+  int (*tor_api_cfg_set_command_line)(void *cfg, int argc, char **argv);
+  int (*tor_api_run_main)(void *cfg);
+  int (*tor_api_threads_unjoined)(void);
+#ifdef _WIN32
+  kmp_tor_socket_t (*tor_api_cfg_set_ctrl_socket)(void *cfg);
+#endif // _WIN32
+
+  uint64_t load_ns;
+  uint64_t reuse_count;
+  uint64_t saved_ns;
+} kmp_tor_warm_t;
+
 struct kmp_tor_context_t {
   pthread_mutex_t lock;
+  pthread_cond_t cond;
   int state;
+  int state_fd[2];
+  int state_waiters;
+  int is_deinit;
+  kmp_tor_state_listener_t state_listener;
+  void *state_listener_arg;
+  // Transitions are numbered as they are published (state_seq), and the
+  // listener is notified of them in that order, outside of the lock (see
+  // kmp_tor_state_notify). state_notified_seq is the last one notified,
+  // and state_notifier the thread notifying while state_notifying > 0.
+  uint64_t state_seq;
+  uint64_t state_notified_seq;
+  int state_notifying;
+  pthread_t state_notifier;
+  kmp_tor_warm_t warm;
+  kmp_tor_stats_t stats;
+  // Backs errors returned by kmp_tor_run_main which carry a detail.
+  char error[KMP_TOR_STATS_ERROR_LEN];
   kmp_tor_handle_t *handle_t;
 };
 
-static int kmp_tor_is_initialized = 0;
+// Libraries currently loaded by a kmp_tor_context_t. Loading the same
+// library image twice would share tor's global state between contexts,
+// so each context running concurrently must use its own copy.
+static pthread_mutex_t kmp_tor_lib_claims_lock = PTHREAD_MUTEX_INITIALIZER;
+static kmp_tor_lib_claim_t *kmp_tor_lib_claims = NULL;
 
-kmp_tor_context_t *
-kmp_tor_init() {
-  if (kmp_tor_is_initialized > 0) {
-    return NULL;
+// Defined alongside kmp_tor_lib_claim, needed earlier by kmp_tor_warm_release.
+static void kmp_tor_lib_unclaim(kmp_tor_lib_claim_t *claim);
+
+static uint64_t
+kmp_tor_now_ns()
+{
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+    return 0;
   }
-  kmp_tor_is_initialized++;
+  return ((uint64_t) ts.tv_sec * 1000000000) + (uint64_t) ts.tv_nsec;
+}
 
-  kmp_tor_context_t *ctx = NULL;
-  pthread_mutexattr_t attr_t;
+static int
+kmp_tor_cond_init(pthread_cond_t *cond)
+{
+  int result = -1;
+  pthread_condattr_t attr_t;
 
-  ctx = malloc(sizeof(kmp_tor_context_t));
-  if (!ctx) {
-    kmp_tor_is_initialized--;
-    return NULL;
-  } else {
-    ctx->state = KMP_TOR_STATE_OFF;
-    ctx->handle_t = NULL;
+  if (pthread_condattr_init(&attr_t) != 0) {
+    return -1;
+  }
+#if !defined(__APPLE__) && !defined(_WIN32)
+  // Timed waits use CLOCK_MONOTONIC so they are unaffected
+  // by changes to the system's wall-clock time.
+  if (pthread_condattr_setclock(&attr_t, CLOCK_MONOTONIC) != 0) {
+    pthread_condattr_destroy(&attr_t);
+    return -1;
   }
+#endif // !__APPLE__ && !_WIN32
+  result = pthread_cond_init(cond, &attr_t);
+  pthread_condattr_destroy(&attr_t);
+  return result;
+}
 
-  if (pthread_mutexattr_init(&attr_t) != 0) {
-    free(ctx);
-    kmp_tor_is_initialized--;
-    return NULL;
+static void
+kmp_tor_cond_deadline(struct timespec *ts, int64_t timeout_ns)
+{
+  assert(ts);
+  assert(timeout_ns >= 0);
+
+#if !defined(__APPLE__) && !defined(_WIN32)
+  clock_gettime(CLOCK_MONOTONIC, ts);
+#else
+  clock_gettime(CLOCK_REALTIME, ts);
+#endif // !__APPLE__ && !_WIN32
+
+  int64_t nsec = (int64_t) ts->tv_nsec + (timeout_ns % 1000000000);
+  ts->tv_sec += (time_t) ((timeout_ns / 1000000000) + (nsec / 1000000000));
+  ts->tv_nsec = (long) (nsec % 1000000000);
+}
+
+static int
+kmp_tor_state_fd_open(kmp_tor_context_t *ctx)
+{
+  assert(ctx);
+  ctx->state_fd[0] = -1;
+  ctx->state_fd[1] = -1;
+
+#if defined(_WIN32)
+  return 0;
+#elif defined(__linux__)
+  ctx->state_fd[0] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (ctx->state_fd[0] == -1) {
+    return -1;
   }
-  if (pthread_mutexattr_settype(&attr_t, PTHREAD_MUTEX_RECURSIVE) != 0) {
-    free(ctx);
-    pthread_mutexattr_destroy(&attr_t);
-    kmp_tor_is_initialized--;
-    return NULL;
+  ctx->state_fd[1] = ctx->state_fd[0];
+  return 0;
+#else
+  if (pipe(ctx->state_fd) != 0) {
+    ctx->state_fd[0] = -1;
+    ctx->state_fd[1] = -1;
+    return -1;
   }
-  if (pthread_mutex_init(&ctx->lock, &attr_t) != 0) {
-    free(ctx);
-    ctx = NULL;
-    kmp_tor_is_initialized--;
+  for (int i = 0; i < 2; i++) {
+    int flags = fcntl(ctx->state_fd[i], F_GETFL);
+    if (flags == -1 || fcntl(ctx->state_fd[i], F_SETFL, flags | O_NONBLOCK) != 0) {
+      return -1;
+    }
+    if (fcntl(ctx->state_fd[i], F_SETFD, FD_CLOEXEC) != 0) {
+      return -1;
+    }
   }
-
-  pthread_mutexattr_destroy(&attr_t);
-  return ctx;
+  return 0;
+#endif // _WIN32
 }
 
-int
-kmp_tor_deinit(kmp_tor_context_t *ctx)
+static void
+kmp_tor_state_fd_close(kmp_tor_context_t *ctx)
 {
-  if (!ctx) {
-    return -1;
+  assert(ctx);
+#ifndef _WIN32
+  if (ctx->state_fd[1] != -1 && ctx->state_fd[1] != ctx->state_fd[0]) {
+    close(ctx->state_fd[1]);
   }
-  kmp_tor_terminate_and_await_result(ctx);
-  assert(ctx->state == KMP_TOR_STATE_OFF);
-  assert(!ctx->handle_t);
+  if (ctx->state_fd[0] != -1) {
+    close(ctx->state_fd[0]);
+  }
+#endif // !_WIN32
+  ctx->state_fd[0] = -1;
+  ctx->state_fd[1] = -1;
+}
 
-  pthread_mutex_lock(&ctx->lock);
-  pthread_mutex_unlock(&ctx->lock);
-  pthread_mutex_destroy(&ctx->lock);
+static void
+kmp_tor_stats_error(kmp_tor_context_t *ctx, const char *error, const char *detail)
+{
+  // ctx->lock MUST be held
+  assert(ctx);
+  assert(error);
 
-  free(ctx);
-  kmp_tor_is_initialized--;
-  return 0;
+  if (detail) {
+    snprintf(ctx->stats.last_error, sizeof(ctx->stats.last_error), "%s: %s", error, detail);
+  } else {
+    snprintf(ctx->stats.last_error, sizeof(ctx->stats.last_error), "%s", error);
+  }
 }
 
-static void *
-kmp_tor_execute(void *arg)
+static const char *
+kmp_tor_error_detail(kmp_tor_context_t *ctx, const char *error, const char *detail)
 {
-  int rv = -1;
-  void *cfg = NULL;
-  int (*tor_api_run_main)(void *cfg) = NULL;
-  void (*tor_api_cfg_free)(void *cfg) = NULL;
-  void (*OPENSSL_cleanup)(void) = NULL;
-  kmp_tor_context_t *ctx = arg;
   assert(ctx);
+  assert(error);
 
-  pthread_mutex_lock(&ctx->lock);
-    if (ctx->handle_t) {
-      cfg = ctx->handle_t->cfg;
-      tor_api_run_main = ctx->handle_t->tor_api_run_main;
-      tor_api_cfg_free = ctx->handle_t->tor_api_cfg_free;
-      OPENSSL_cleanup = ctx->handle_t->OPENSSL_cleanup;
-
-      ctx->handle_t->cfg = NULL;
-      ctx->handle_t->tor_api_run_main = NULL;
-      ctx->handle_t->tor_api_cfg_free = NULL;
-      ctx->handle_t->OPENSSL_cleanup = NULL;
+  // Captured at the point of failure, so that it cannot be confused
+  // with the failure of some other lib_load call made along the way.
+  if (!detail || !detail[0]) {
+    return error;
+  }
 
-      ctx->state = KMP_TOR_STATE_STARTED;
-    }
+  pthread_mutex_lock(&ctx->lock);
+    snprintf(ctx->error, sizeof(ctx->error), "%s: %s", error, detail);
   pthread_mutex_unlock(&ctx->lock);
+  return ctx->error;
+}
 
-  assert(cfg);
-  assert(tor_api_run_main);
-  assert(tor_api_cfg_free);
-  assert(OPENSSL_cleanup);
+// Checked before every OPENSSL_cleanup and unload of a library image, as
+// nothing may be executing within it any longer. tor joins its workqueue
+// threads before tor_run_main returns, see external/patches/tor/0003-*.
+// This only fails if tor exited without stopping them, in which event
+// the image is left loaded.
+//
+// Only called after tor_run_main returned on the calling thread, or once
+// the thread which ran it was joined.
+static int
+kmp_tor_lib_is_quiescent(kmp_tor_context_t *ctx, int (*tor_api_threads_unjoined)(void))
+{
+  assert(ctx);
 
-  rv = tor_api_run_main(cfg);
-  if (rv < 0 || rv > 255) {
-    rv = 1;
+  // NULL if the image was never run (e.g. resolving its symbols failed)
+  if (!tor_api_threads_unjoined || tor_api_threads_unjoined() == 0) {
+    return 1;
   }
 
-  usleep((useconds_t) (100 * 1000));
+  pthread_mutex_lock(&ctx->lock);
+    kmp_tor_stats_error(ctx, "tor threads are still running, leaving tor loaded", NULL);
+  pthread_mutex_unlock(&ctx->lock);
+  return 0;
+}
 
-  tor_api_cfg_free(cfg);
-  OPENSSL_cleanup();
+// Records the time taken in *stat_ns, which MUST be a field of ctx->stats
+// belonging to whatever owns lib_t (the current run, or a retained image).
+static uint64_t
+kmp_tor_lib_close(kmp_tor_context_t *ctx, lib_handle_t *lib_t, uint64_t *stat_ns)
+{
+  assert(ctx);
+  assert(lib_t);
+  assert(stat_ns);
 
-  cfg = NULL;
-  tor_api_run_main = NULL;
-  tor_api_cfg_free = NULL;
-  OPENSSL_cleanup = NULL;
+  int attempts = 0;
+  uint64_t start_ns = kmp_tor_now_ns();
+  int result = lib_load_close(lib_t, &attempts);
+  uint64_t close_ns = kmp_tor_now_ns() - start_ns;
 
   pthread_mutex_lock(&ctx->lock);
-    ctx->state = KMP_TOR_STATE_STOPPED;
-    if (ctx->handle_t) {
-      ctx->handle_t->tor_run_main_result = rv;
-      rv = -1;
+    *stat_ns = close_ns;
+    if (attempts > 1) {
+      ctx->stats.lib_close_retries += (uint64_t) (attempts - 1);
+    }
+    if (result != 0) {
+      ctx->stats.lib_close_failures++;
+      kmp_tor_stats_error(ctx, "Failed to unload tor", lib_load_last_error());
     }
   pthread_mutex_unlock(&ctx->lock);
 
-  assert(rv == -1);
-
-  return NULL;
+  return close_ns;
 }
 
 static void
-kmp_tor_closesocket(kmp_tor_socket_t s)
+kmp_tor_warm_credit_unload(kmp_tor_context_t *ctx, uint64_t reuse_count, uint64_t unload_ns)
 {
-  if (s == KMP_TOR_SOCKET_INVALID) {
+  assert(ctx);
+  if (reuse_count == 0) {
     return;
   }
-  __closesocket(s);
-}
-
-static void
-kmp_tor_state_set(kmp_tor_context_t *ctx, int new_state)
-{
-  assert(ctx);
-  assert(new_state >= KMP_TOR_STATE_OFF);
-  assert(new_state <= KMP_TOR_STATE_STOPPED);
 
+  // Each reuse of an image was preceded by a retention which skipped its
+  // OPENSSL_cleanup and unload. That cost is only known once the image is
+  // finally unloaded, so it is credited then.
   pthread_mutex_lock(&ctx->lock);
-    ctx->state = new_state;
+    ctx->warm.saved_ns += reuse_count * unload_ns;
   pthread_mutex_unlock(&ctx->lock);
 }
 
 static void
-kmp_tor_free(kmp_tor_handle_t *handle_t)
+kmp_tor_warm_take(kmp_tor_warm_t *warm, kmp_tor_handle_t *handle_t)
 {
+  assert(warm);
+  assert(warm->lib_t);
   assert(handle_t);
+  assert(!handle_t->lib_t);
+
+  handle_t->lib_claim = warm->lib_claim;
+  handle_t->lib_t = warm->lib_t;
+  handle_t->OPENSSL_cleanup = warm->OPENSSL_cleanup;
+  handle_t->tor_api_cfg_free = warm->tor_api_cfg_free;
+  handle_t->tor_api_cfg_new = warm->tor_api_cfg_new;
+  handle_t->tor_api_cfg_set_command_line = warm->tor_api_cfg_set_command_line;
+  handle_t->tor_api_run_main = warm->tor_api_run_main;
+  handle_t->tor_api_threads_unjoined = warm->tor_api_threads_unjoined;
+#ifdef _WIN32
+  handle_t->tor_api_cfg_set_ctrl_socket = warm->tor_api_cfg_set_ctrl_socket;
+#endif // _WIN32
+  handle_t->lib_reuse_count = warm->reuse_count + 1;
+
+  warm->reuse_count = 0;
+  warm->lib_claim = NULL;
+  warm->lib_t = NULL;
+  warm->OPENSSL_cleanup = NULL;
+  warm->tor_api_cfg_free = NULL;
+  warm->tor_api_cfg_new = NULL;
+  warm->tor_api_cfg_set_command_line = NULL;
+  warm->tor_api_run_main = NULL;
+  warm->tor_api_threads_unjoined = NULL;
+#ifdef _WIN32
+  warm->tor_api_cfg_set_ctrl_socket = NULL;
+#endif // _WIN32
+}
 
-  kmp_tor_closesocket(handle_t->ctrl_socket_0);
-  kmp_tor_closesocket(handle_t->ctrl_socket_1);
-  handle_t->ctrl_socket_0 = KMP_TOR_SOCKET_INVALID;
-  handle_t->ctrl_socket_1 = KMP_TOR_SOCKET_INVALID;
+static void
+kmp_tor_warm_retain(kmp_tor_warm_t *warm, kmp_tor_handle_t *handle_t)
+{
+  assert(warm);
+  assert(!warm->lib_t);
+  assert(handle_t);
+  assert(handle_t->lib_t);
+
+  warm->lib_claim = handle_t->lib_claim;
+  warm->lib_t = handle_t->lib_t;
+  warm->OPENSSL_cleanup = handle_t->OPENSSL_cleanup;
+  warm->tor_api_cfg_free = handle_t->tor_api_cfg_free;
+  warm->tor_api_cfg_new = handle_t->tor_api_cfg_new;
+  warm->tor_api_cfg_set_command_line = handle_t->tor_api_cfg_set_command_line;
+  warm->tor_api_run_main = handle_t->tor_api_run_main;
+  warm->tor_api_threads_unjoined = handle_t->tor_api_threads_unjoined;
+#ifdef _WIN32
+  warm->tor_api_cfg_set_ctrl_socket = handle_t->tor_api_cfg_set_ctrl_socket;
+#endif // _WIN32
+  if (handle_t->lib_load_ns > 0) {
+    // Otherwise the image was already retained, and load_ns is
+    // from the run which originally loaded it.
+    warm->load_ns = handle_t->lib_load_ns;
+  }
+  warm->reuse_count = handle_t->lib_reuse_count;
 
+  handle_t->lib_reuse_count = 0;
+  handle_t->lib_claim = NULL;
+  handle_t->lib_t = NULL;
+  handle_t->OPENSSL_cleanup = NULL;
+  handle_t->tor_api_cfg_free = NULL;
   handle_t->tor_api_cfg_new = NULL;
   handle_t->tor_api_cfg_set_command_line = NULL;
+  handle_t->tor_api_run_main = NULL;
+  handle_t->tor_api_threads_unjoined = NULL;
 #ifdef _WIN32
   handle_t->tor_api_cfg_set_ctrl_socket = NULL;
 #endif // _WIN32
+}
 
-  if (handle_t->cfg) {
-    handle_t->tor_api_cfg_free(handle_t->cfg);
-    handle_t->cfg = NULL;
+static void
+kmp_tor_warm_detach(kmp_tor_warm_t *warm, kmp_tor_warm_t *out)
+{
+  assert(warm);
+  assert(out);
+
+  *out = *warm;
+  warm->reuse_count = 0;
+  warm->lib_claim = NULL;
+  warm->lib_t = NULL;
+  warm->OPENSSL_cleanup = NULL;
+  warm->tor_api_cfg_free = NULL;
+  warm->tor_api_cfg_new = NULL;
+  warm->tor_api_cfg_set_command_line = NULL;
+  warm->tor_api_run_main = NULL;
+  warm->tor_api_threads_unjoined = NULL;
+#ifdef _WIN32
+  warm->tor_api_cfg_set_ctrl_socket = NULL;
+#endif // _WIN32
+}
+
+static void
+kmp_tor_warm_release(kmp_tor_context_t *ctx, kmp_tor_warm_t *warm)
+{
+  assert(ctx);
+  assert(warm);
+  if (!warm->lib_t) {
+    return;
   }
-  handle_t->tor_api_run_main = NULL;
-  handle_t->tor_api_cfg_free = NULL;
 
-  if (handle_t->argv) {
-    for (int i = 0; i < handle_t->argc; i++) {
-      if (handle_t->argv[i]) {
-        free(handle_t->argv[i]);
-        handle_t->argv[i] = NULL;
-      }
-    }
-    free(handle_t->argv);
-    handle_t->argv = NULL;
+  if (!kmp_tor_lib_is_quiescent(ctx, warm->tor_api_threads_unjoined)) {
+    // Deliberately leaked, along with its claim so that the same
+    // library file is never loaded again into the busy image.
+    warm->OPENSSL_cleanup = NULL;
+    warm->lib_t = NULL;
+    warm->lib_claim = NULL;
+    warm->reuse_count = 0;
   }
 
-  if (handle_t->OPENSSL_cleanup) {
-    handle_t->OPENSSL_cleanup();
-    handle_t->OPENSSL_cleanup = NULL;
+  if (warm->lib_t) {
+    uint64_t start_ns = kmp_tor_now_ns();
+    if (warm->OPENSSL_cleanup) {
+      warm->OPENSSL_cleanup();
+      warm->OPENSSL_cleanup = NULL;
+    }
+    uint64_t unload_ns = kmp_tor_now_ns() - start_ns;
+    unload_ns += kmp_tor_lib_close(ctx, warm->lib_t, &ctx->stats.warm_lib_close_ns);
+    warm->lib_t = NULL;
+    kmp_tor_warm_credit_unload(ctx, warm->reuse_count, unload_ns);
+    warm->reuse_count = 0;
   }
 
-  if (handle_t->lib_t) {
-    lib_load_close(handle_t->lib_t);
-    handle_t->lib_t = NULL;
+  if (warm->lib_claim) {
+    kmp_tor_lib_unclaim(warm->lib_claim);
+    warm->lib_claim = NULL;
   }
 
+  warm->tor_api_cfg_free = NULL;
+  warm->tor_api_cfg_new = NULL;
+  warm->tor_api_cfg_set_command_line = NULL;
+  warm->tor_api_run_main = NULL;
+  warm->tor_api_threads_unjoined = NULL;
 #ifdef _WIN32
-  if (handle_t->was_win32_sockets_initialized == 0) {
-    win32_sockets_deinit();
-    handle_t->was_win32_sockets_initialized = -1;
-  }
+  warm->tor_api_cfg_set_ctrl_socket = NULL;
 #endif // _WIN32
-
-  free(handle_t);
 }
 
-static const char *
-kmp_tor_configure_lib_t(const char * lib_tor, kmp_tor_handle_t *handle_t)
+kmp_tor_args_t *
+kmp_tor_args_new(int argc, size_t len)
 {
-  assert(lib_tor);
-  assert(handle_t);
-
-  handle_t->lib_t = lib_load_open(lib_tor);
-  if (!handle_t->lib_t) {
-    return "Failed to load tor";
+  // Every argument is at least its NUL terminator, so argc <= len
+  // which also bounds the size of argv.
+  if (argc <= 0 || len == 0 || (size_t) argc > len) {
+    return NULL;
+  }
+  if (len > (SIZE_MAX - sizeof(kmp_tor_args_t)) / (sizeof(char *) + 1) - 3) {
+    return NULL;
   }
 
-  *(void **) (&handle_t->OPENSSL_cleanup) = lib_load_resolve(handle_t->lib_t, "OPENSSL_cleanup");
-  if (!handle_t->OPENSSL_cleanup) {
-    return "Failed to resolve symbol OPENSSL_cleanup";
+  size_t argv_len = ((size_t) argc + 3) * sizeof(char *);
+  kmp_tor_args_t *args = malloc(sizeof(kmp_tor_args_t) + argv_len + len);
+  if (!args) {
+    return NULL;
   }
 
-  *(void **) (&handle_t->tor_api_cfg_free) = lib_load_resolve(handle_t->lib_t, "tor_main_configuration_free");
-  if (!handle_t->tor_api_cfg_free) {
-    return "Failed to resolve symbol tor_main_configuration_free";
+  args->argc = argc + 2;
+  args->argv = (char **) (args + 1);
+  args->len = len;
+  args->buf = ((char *) args->argv) + argv_len;
+  memcpy(args->ctrl_flag, KMP_TOR_CTRL_FD_FLAG, sizeof(KMP_TOR_CTRL_FD_FLAG));
+  args->ctrl_fd[0] = '\0';
+  memset(args->argv, 0, argv_len);
+  return args;
+}
+
+char *
+kmp_tor_args_buf(kmp_tor_args_t *args)
+{
+  if (!args) {
+    return NULL;
   }
+  return args->buf;
+}
 
-  *(void **) (&handle_t->tor_api_run_main) = lib_load_resolve(handle_t->lib_t, "tor_run_main");
-  if (!handle_t->tor_api_run_main) {
-    return "Failed to resolve symbol tor_run_main";
+void
+kmp_tor_args_free(kmp_tor_args_t *args)
+{
+  if (!args) {
+    return;
   }
+  free(args);
+}
 
-  *(void **) (&handle_t->tor_api_cfg_new) = lib_load_resolve(handle_t->lib_t, "tor_main_configuration_new");
-  if (!handle_t->tor_api_cfg_new) {
-    return "Failed to resolve symbol tor_main_configuration_new";
+static const char *
+kmp_tor_args_parse(kmp_tor_args_t *args)
+{
+  assert(args);
+  assert(args->len > 0);
+
+  // Guarantees strlen below stays within buf
+  if (args->buf[args->len - 1] != '\0') {
+    return "args MUST be NUL terminated";
   }
 
-  *(void **) (&handle_t->tor_api_cfg_set_command_line) = lib_load_resolve(handle_t->lib_t, "tor_main_configuration_set_command_line");
-  if (!handle_t->tor_api_cfg_set_command_line) {
-    return "Failed to resolve symbol tor_main_configuration_set_command_line";
+  char *arg = args->buf;
+  char *end = args->buf + args->len;
+  int argc = args->argc - 2;
+
+  for (int i = 0; i < argc; i++) {
+    if (arg >= end) {
+      return "args contains fewer arguments than argc";
+    }
+    args->argv[i] = arg;
+    arg += strlen(arg) + 1;
   }
 
-#ifdef _WIN32
-  *(void **) (&handle_t->tor_api_cfg_set_ctrl_socket) = lib_load_resolve(handle_t->lib_t, "tor_main_configuration_setup_control_socket");
-  if (!handle_t->tor_api_cfg_set_ctrl_socket) {
-    return "Failed to resolve symbol tor_main_configuration_setup_control_socket";
+  if (arg != end) {
+    return "args contains more arguments than argc";
   }
-#endif // _WIN32
 
   return NULL;
 }
 
-static const char *
-kmp_tor_configure_tor(kmp_tor_handle_t *handle_t)
-{
+kmp_tor_context_t *
+kmp_tor_init() {
+  kmp_tor_context_t *ctx = NULL;
+  pthread_mutexattr_t attr_t;
+
+  ctx = malloc(sizeof(kmp_tor_context_t));
+  if (!ctx) {
+    return NULL;
+  } else {
+    ctx->state = KMP_TOR_STATE_OFF;
+    ctx->state_waiters = 0;
+    ctx->is_deinit = 0;
+    ctx->state_listener = NULL;
+    ctx->state_listener_arg = NULL;
+    ctx->state_seq = 0;
+    ctx->state_notified_seq = 0;
+    ctx->state_notifying = 0;
+    memset(&ctx->warm, 0, sizeof(kmp_tor_warm_t));
+    memset(&ctx->stats, 0, sizeof(kmp_tor_stats_t));
+    ctx->error[0] = 0;
+    ctx->handle_t = NULL;
+  }
+
+  if (kmp_tor_state_fd_open(ctx) != 0) {
+    kmp_tor_state_fd_close(ctx);
+    free(ctx);
+    return NULL;
+  }
+  if (kmp_tor_cond_init(&ctx->cond) != 0) {
+    kmp_tor_state_fd_close(ctx);
+    free(ctx);
+    return NULL;
+  }
+
+  if (pthread_mutexattr_init(&attr_t) != 0) {
+    pthread_cond_destroy(&ctx->cond);
+    kmp_tor_state_fd_close(ctx);
+    free(ctx);
+    return NULL;
+  }
+  if (pthread_mutexattr_settype(&attr_t, PTHREAD_MUTEX_RECURSIVE) != 0) {
+    pthread_cond_destroy(&ctx->cond);
+    kmp_tor_state_fd_close(ctx);
+    free(ctx);
+    pthread_mutexattr_destroy(&attr_t);
+    return NULL;
+  }
+  if (pthread_mutex_init(&ctx->lock, &attr_t) != 0) {
+    pthread_cond_destroy(&ctx->cond);
+    kmp_tor_state_fd_close(ctx);
+    free(ctx);
+    ctx = NULL;
+  }
+
+  pthread_mutexattr_destroy(&attr_t);
+  return ctx;
+}
+
+int
+kmp_tor_deinit(kmp_tor_context_t *ctx)
+{
+  if (!ctx) {
+    return -1;
+  }
+  kmp_tor_terminate_and_await_result(ctx);
+  assert(ctx->state == KMP_TOR_STATE_OFF);
+  assert(!ctx->handle_t);
+
+  // Wake anything still blocked in kmp_tor_await_state (e.g. waiting on a
+  // state that will never come), or notifying the listener, and wait for
+  // it to leave before the lock and condition are destroyed from underneath
+  // it.
+  pthread_mutex_lock(&ctx->lock);
+    ctx->is_deinit = 1;
+    ctx->state_listener = NULL;
+    ctx->state_listener_arg = NULL;
+    pthread_cond_broadcast(&ctx->cond);
+    while (ctx->state_waiters > 0 || ctx->state_notifying > 0 || ctx->state_notified_seq != ctx->state_seq) {
+      pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+  pthread_mutex_unlock(&ctx->lock);
+  kmp_tor_warm_release(ctx, &ctx->warm);
+  pthread_mutex_destroy(&ctx->lock);
+  pthread_cond_destroy(&ctx->cond);
+  kmp_tor_state_fd_close(ctx);
+
+  free(ctx);
+  return 0;
+}
+
+static uint64_t
+kmp_tor_state_publish(kmp_tor_context_t *ctx, int new_state)
+{
+  // ctx->lock MUST be held. The returned sequence number MUST be passed
+  // to kmp_tor_state_notify once ctx->lock is released.
+  assert(ctx);
+  assert(new_state >= KMP_TOR_STATE_OFF);
+  assert(new_state <= KMP_TOR_STATE_STOPPED);
+
+  ctx->state = new_state;
+  pthread_cond_broadcast(&ctx->cond);
+
+#ifndef _WIN32
+  if (ctx->state_fd[1] != -1) {
+    ssize_t r = -1;
+#ifdef __linux__
+    uint64_t value = 1;
+#else
+    char value = 0;
+#endif // __linux__
+    do {
+      r = write(ctx->state_fd[1], &value, sizeof(value));
+    } while (r < 0 && errno == EINTR);
+    // EAGAIN means the descriptor is already readable, which is all
+    // that is needed to notify whoever is polling it.
+  }
+#endif // !_WIN32
+
+  return ++ctx->state_seq;
+}
+
+static void
+kmp_tor_state_notify(kmp_tor_context_t *ctx, uint64_t seq, int state)
+{
+  // ctx->lock MUST NOT be held (other than by the recursive acquisition
+  // of a listener which published this transition itself).
+  assert(ctx);
+  assert(seq > 0);
+
+  kmp_tor_state_listener_t listener = NULL;
+  void *arg = NULL;
+  int is_nested = 0;
+
+  pthread_mutex_lock(&ctx->lock);
+    // A transition published from within a listener (on the thread
+    // notifying it) cannot wait for its turn, as the listener returning is
+    // what everything else is waiting on. It is notified immediately,
+    // superseding any transitions still waiting.
+    is_nested = ctx->state_notifying > 0 && pthread_equal(ctx->state_notifier, pthread_self());
+    while (!is_nested && (ctx->state_notifying > 0 || ctx->state_notified_seq + 1 < seq)) {
+      pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    if (seq > ctx->state_notified_seq) {
+      listener = ctx->state_listener;
+      arg = ctx->state_listener_arg;
+    }
+    ctx->state_notifier = pthread_self();
+    ctx->state_notifying++;
+  pthread_mutex_unlock(&ctx->lock);
+
+  if (listener) {
+    listener(ctx, state, arg);
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+    ctx->state_notifying--;
+    if (seq > ctx->state_notified_seq) {
+      ctx->state_notified_seq = seq;
+    }
+    pthread_cond_broadcast(&ctx->cond);
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+static const char *
+kmp_tor_thread_options_copy(kmp_tor_handle_t *handle_t, const kmp_tor_thread_options_t *options)
+{
+  assert(handle_t);
+
+  if (!options) {
+    return NULL;
+  }
+  if (options->cpu_set_len < 0 || (options->cpu_set_len > 0 && !options->cpu_set)) {
+    return "Invalid kmp_tor_thread_options_t.cpu_set";
+  }
+  if (options->sched_policy < KMP_TOR_THREAD_SCHED_DEFAULT || options->sched_policy > KMP_TOR_THREAD_SCHED_IDLE) {
+    return "Invalid kmp_tor_thread_options_t.sched_policy";
+  }
+
+  handle_t->thread_options = *options;
+  handle_t->thread_options.cpu_set = NULL;
+  handle_t->thread_options.cpu_set_len = 0;
+  handle_t->thread_options.name = NULL;
+
+  if (options->cpu_set_len > 0) {
+    int *cpu_set = malloc(options->cpu_set_len * sizeof(int));
+    if (!cpu_set) {
+      return "Failed to copy kmp_tor_thread_options_t.cpu_set";
+    }
+    memcpy(cpu_set, options->cpu_set, options->cpu_set_len * sizeof(int));
+    handle_t->thread_options.cpu_set = cpu_set;
+    handle_t->thread_options.cpu_set_len = options->cpu_set_len;
+  }
+
+  if (options->name) {
+    handle_t->thread_options.name = strdup(options->name);
+    if (!handle_t->thread_options.name) {
+      return "Failed to copy kmp_tor_thread_options_t.name";
+    }
+  }
+
+  return NULL;
+}
+
+static void
+kmp_tor_thread_options_free(kmp_tor_thread_options_t *options)
+{
+  assert(options);
+
+  if (options->cpu_set) {
+    free((int *) options->cpu_set);
+    options->cpu_set = NULL;
+  }
+  options->cpu_set_len = 0;
+  if (options->name) {
+    free((char *) options->name);
+    options->name = NULL;
+  }
+}
+
+#if defined(__linux__) || defined(__APPLE__)
+static void
+kmp_tor_thread_options_failure(kmp_tor_context_t *ctx, const char *error, const char *detail)
+{
+  // ctx->lock MUST NOT be held
+  assert(ctx);
+  assert(error);
+  assert(detail);
+
+  fprintf(stderr, "KmpTor: %s - error[%s]\n", error, detail);
+  pthread_mutex_lock(&ctx->lock);
+    kmp_tor_stats_error(ctx, error, detail);
+  pthread_mutex_unlock(&ctx->lock);
+}
+#endif // __linux__ || __APPLE__
+
+static void
+kmp_tor_thread_options_apply(kmp_tor_context_t *ctx, const kmp_tor_thread_options_t *options)
+{
+  // ctx->lock MUST NOT be held, and MUST be called from tor's thread.
+  // Each attribute which fails to apply is logged and recorded as
+  // kmp_tor_stats_t.last_error, and the rest are still applied.
+  assert(ctx);
+  assert(options);
+
+#ifdef __linux__
+  if (options->cpu_set_len > 0) {
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for (int i = 0; i < options->cpu_set_len; i++) {
+      if (options->cpu_set[i] >= 0 && options->cpu_set[i] < CPU_SETSIZE) {
+        CPU_SET(options->cpu_set[i], &cpu_set);
+      }
+    }
+    // pid 0 is the calling thread
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &cpu_set) != 0) {
+      kmp_tor_thread_options_failure(ctx, "Failed to set tor thread CPU affinity", strerror(errno));
+    }
+  }
+
+  if (options->sched_policy != KMP_TOR_THREAD_SCHED_DEFAULT) {
+    int policy = SCHED_OTHER;
+#ifdef SCHED_BATCH
+    if (options->sched_policy == KMP_TOR_THREAD_SCHED_BATCH) {
+      policy = SCHED_BATCH;
+    }
+#endif // SCHED_BATCH
+#ifdef SCHED_IDLE
+    if (options->sched_policy == KMP_TOR_THREAD_SCHED_IDLE) {
+      policy = SCHED_IDLE;
+    }
+#endif // SCHED_IDLE
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    int result = pthread_setschedparam(pthread_self(), policy, &param);
+    if (result != 0) {
+      kmp_tor_thread_options_failure(ctx, "Failed to set tor thread scheduling policy", strerror(result));
+    }
+  }
+
+  if (options->set_nice) {
+    // Linux applies the nice value per-thread when given a thread id.
+    errno = 0;
+    if (setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), options->nice) != 0) {
+      kmp_tor_thread_options_failure(ctx, "Failed to set tor thread nice value", strerror(errno));
+    }
+  }
+
+  if (options->name) {
+    // Linux limits names to 16 bytes (including the NUL terminator).
+    char name[16];
+    snprintf(name, sizeof(name), "%s", options->name);
+    int result = pthread_setname_np(pthread_self(), name);
+    if (result != 0) {
+      kmp_tor_thread_options_failure(ctx, "Failed to set tor thread name", strerror(result));
+    }
+  }
+#elif defined(__APPLE__)
+  if (options->sched_policy != KMP_TOR_THREAD_SCHED_DEFAULT) {
+    qos_class_t qos = options->sched_policy == KMP_TOR_THREAD_SCHED_IDLE
+      ? QOS_CLASS_BACKGROUND
+      : QOS_CLASS_UTILITY;
+    int result = pthread_set_qos_class_self_np(qos, 0);
+    if (result != 0) {
+      kmp_tor_thread_options_failure(ctx, "Failed to set tor thread quality of service class", strerror(result));
+    }
+  }
+
+  if (options->name) {
+    int result = pthread_setname_np(options->name);
+    if (result != 0) {
+      kmp_tor_thread_options_failure(ctx, "Failed to set tor thread name", strerror(result));
+    }
+  }
+#else
+  (void) ctx;
+  (void) options;
+#endif // __linux__
+}
+
+static void
+kmp_tor_closesocket(kmp_tor_socket_t s)
+{
+  if (s == KMP_TOR_SOCKET_INVALID) {
+    return;
+  }
+  __closesocket(s);
+}
+
+static void
+kmp_tor_shutdownsocket(kmp_tor_socket_t s)
+{
+  if (s == KMP_TOR_SOCKET_INVALID) {
+    return;
+  }
+  shutdown(s, KMP_TOR_SHUT_RDWR);
+}
+
+static void *
+kmp_tor_execute(void *arg)
+{
+  int rv = -1;
+  uint64_t start_ns = 0;
+  uint64_t run_main_ns = 0;
+  void *cfg = NULL;
+  int (*tor_api_run_main)(void *cfg) = NULL;
+  int (*tor_api_threads_unjoined)(void) = NULL;
+  int is_quiescent = 0;
+  void (*tor_api_cfg_free)(void *cfg) = NULL;
+  uint64_t openssl_cleanup_ns = 0;
+  void (*OPENSSL_cleanup)(void) = NULL;
+  const kmp_tor_thread_options_t *options = NULL;
+  uint64_t seq = 0;
+  kmp_tor_context_t *ctx = arg;
+  assert(ctx);
+
+  pthread_mutex_lock(&ctx->lock);
+    if (ctx->handle_t) {
+      cfg = ctx->handle_t->cfg;
+      tor_api_run_main = ctx->handle_t->tor_api_run_main;
+      tor_api_threads_unjoined = ctx->handle_t->tor_api_threads_unjoined;
+      tor_api_cfg_free = ctx->handle_t->tor_api_cfg_free;
+
+      ctx->handle_t->cfg = NULL;
+      options = &ctx->handle_t->thread_options;
+    }
+  pthread_mutex_unlock(&ctx->lock);
+
+  if (options) {
+    // Applied without holding ctx->lock, as it makes syscalls and logs
+    // failures. handle_t outlives this thread (kmp_tor_terminate_and_await_result
+    // joins it before freeing handle_t), and its thread_options are not
+    // modified after kmp_tor_start.
+    kmp_tor_thread_options_apply(ctx, options);
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+    if (ctx->handle_t) {
+      ctx->stats.run_count++;
+      ctx->stats.started_at_ns = kmp_tor_now_ns();
+      seq = kmp_tor_state_publish(ctx, KMP_TOR_STATE_STARTED);
+    }
+  pthread_mutex_unlock(&ctx->lock);
+
+  if (seq) {
+    kmp_tor_state_notify(ctx, seq, KMP_TOR_STATE_STARTED);
+    seq = 0;
+  }
+
+  assert(cfg);
+  assert(tor_api_run_main);
+  assert(tor_api_threads_unjoined);
+  assert(tor_api_cfg_free);
+
+  start_ns = kmp_tor_now_ns();
+  rv = tor_api_run_main(cfg);
+  run_main_ns = kmp_tor_now_ns() - start_ns;
+  if (rv < 0 || rv > 255) {
+    rv = 1;
+  }
+
+  is_quiescent = kmp_tor_lib_is_quiescent(ctx, tor_api_threads_unjoined);
+
+  start_ns = kmp_tor_now_ns();
+  tor_api_cfg_free(cfg);
+
+  pthread_mutex_lock(&ctx->lock);
+    if (ctx->handle_t && !is_quiescent) {
+      // Neither cleaned up, nor retained for a warm restart.
+      ctx->handle_t->OPENSSL_cleanup = NULL;
+    }
+
+    // OpenSSL cannot be re-initialized after OPENSSL_cleanup, so it is
+    // deferred when the library image may be retained for a warm restart.
+    // Only a clean exit (0) which kmp_tor_terminate_and_await_result asked
+    // for (i.e. tor shut down from its main loop, running tor_cleanup) is
+    // considered safe to run again in the same image; see kmp_tor_warm_restart.
+    if (ctx->handle_t && (!ctx->warm.enabled || rv != 0 || !ctx->handle_t->ctrl_is_shutdown)) {
+      OPENSSL_cleanup = ctx->handle_t->OPENSSL_cleanup;
+      ctx->handle_t->OPENSSL_cleanup = NULL;
+    }
+  pthread_mutex_unlock(&ctx->lock);
+
+  if (OPENSSL_cleanup) {
+    uint64_t cleanup_start_ns = kmp_tor_now_ns();
+    OPENSSL_cleanup();
+    openssl_cleanup_ns = kmp_tor_now_ns() - cleanup_start_ns;
+  }
+
+  cfg = NULL;
+  tor_api_run_main = NULL;
+  tor_api_threads_unjoined = NULL;
+  tor_api_cfg_free = NULL;
+  OPENSSL_cleanup = NULL;
+
+  pthread_mutex_lock(&ctx->lock);
+    if (ctx->handle_t) {
+      // tor does not close __OwningControllerFD on exit, so signal
+      // EOF to anyone reading the controller connection.
+      kmp_tor_shutdownsocket(ctx->handle_t->ctrl_socket_1);
+      ctx->handle_t->openssl_cleanup_ns = openssl_cleanup_ns;
+      ctx->handle_t->tor_run_main_result = rv;
+      rv = -1;
+    }
+    ctx->stats.stopped_at_ns = kmp_tor_now_ns();
+    ctx->stats.run_main_ns = run_main_ns;
+    ctx->stats.cleanup_ns = ctx->stats.stopped_at_ns - start_ns;
+    seq = kmp_tor_state_publish(ctx, KMP_TOR_STATE_STOPPED);
+  pthread_mutex_unlock(&ctx->lock);
+
+  assert(rv == -1);
+
+  // ctx outlives this thread (kmp_tor_terminate_and_await_result joins it),
+  // so the listener is notified as the last thing it does.
+  kmp_tor_state_notify(ctx, seq, KMP_TOR_STATE_STOPPED);
+
+  return NULL;
+}
+
+static void
+kmp_tor_state_set(kmp_tor_context_t *ctx, int new_state)
+{
+  assert(ctx);
+  uint64_t seq = 0;
+
+  pthread_mutex_lock(&ctx->lock);
+    seq = kmp_tor_state_publish(ctx, new_state);
+  pthread_mutex_unlock(&ctx->lock);
+
+  kmp_tor_state_notify(ctx, seq, new_state);
+}
+
+static int
+kmp_tor_lib_claim_matches(kmp_tor_lib_claim_t *a, kmp_tor_lib_claim_t *b)
+{
+  assert(a);
+  assert(b);
+#ifndef _WIN32
+  if (a->has_id && b->has_id) {
+    return a->dev == b->dev && a->ino == b->ino;
+  }
+#endif // !_WIN32
+  return strcmp(a->lib, b->lib) == 0;
+}
+
+static void
+kmp_tor_lib_claim_free(kmp_tor_lib_claim_t *claim)
+{
+  assert(claim);
+  if (claim->lib) {
+    free(claim->lib);
+    claim->lib = NULL;
+  }
+  free(claim);
+}
+
+static int
+kmp_tor_lib_claim_is(kmp_tor_lib_claim_t *claim, const char *lib_tor)
+{
+  assert(claim);
+  assert(lib_tor);
+#ifndef _WIN32
+  struct stat st;
+  if (claim->has_id && stat(lib_tor, &st) == 0) {
+    return claim->dev == st.st_dev && claim->ino == st.st_ino;
+  }
+#endif // !_WIN32
+  return strcmp(claim->lib, lib_tor) == 0;
+}
+
+static const char *
+kmp_tor_lib_claim(const char *lib_tor, kmp_tor_lib_claim_t **out)
+{
+  assert(lib_tor);
+  assert(out);
+
+  const char *c_result = NULL;
+  kmp_tor_lib_claim_t *claim = malloc(sizeof(kmp_tor_lib_claim_t));
+  if (!claim) {
+    return "Failed to create kmp_tor_lib_claim_t";
+  } else {
+    claim->lib = NULL;
+    claim->next = NULL;
+  }
+
+  claim->lib = strdup(lib_tor);
+  if (!claim->lib) {
+    kmp_tor_lib_claim_free(claim);
+    return "Failed to copy lib_tor";
+  }
+
+#ifndef _WIN32
+  struct stat st;
+  if (stat(lib_tor, &st) == 0) {
+    claim->has_id = 1;
+    claim->dev = st.st_dev;
+    claim->ino = st.st_ino;
+  } else {
+    // e.g. Darwin frameworks which are resolved relative to the bundle
+    claim->has_id = 0;
+  }
+#endif // !_WIN32
+
+  pthread_mutex_lock(&kmp_tor_lib_claims_lock);
+    for (kmp_tor_lib_claim_t *c = kmp_tor_lib_claims; c; c = c->next) {
+      if (kmp_tor_lib_claim_matches(c, claim)) {
+        c_result = "lib_tor is in use by another kmp_tor_context_t";
+        break;
+      }
+    }
+    if (!c_result) {
+      claim->next = kmp_tor_lib_claims;
+      kmp_tor_lib_claims = claim;
+    }
+  pthread_mutex_unlock(&kmp_tor_lib_claims_lock);
+
+  if (c_result) {
+    kmp_tor_lib_claim_free(claim);
+  } else {
+    *out = claim;
+  }
+  return c_result;
+}
+
+static void
+kmp_tor_lib_unclaim(kmp_tor_lib_claim_t *claim)
+{
+  assert(claim);
+
+  pthread_mutex_lock(&kmp_tor_lib_claims_lock);
+    for (kmp_tor_lib_claim_t **c = &kmp_tor_lib_claims; *c; c = &(*c)->next) {
+      if (*c == claim) {
+        *c = claim->next;
+        break;
+      }
+    }
+  pthread_mutex_unlock(&kmp_tor_lib_claims_lock);
+
+  kmp_tor_lib_claim_free(claim);
+}
+
+static void
+kmp_tor_free(kmp_tor_context_t *ctx, kmp_tor_handle_t *handle_t)
+{
+  assert(ctx);
+  assert(handle_t);
+  assert(handle_t->ctrl_io_count == 0);
+
+  kmp_tor_closesocket(handle_t->ctrl_socket_0);
+  kmp_tor_closesocket(handle_t->ctrl_socket_1);
+  handle_t->ctrl_socket_0 = KMP_TOR_SOCKET_INVALID;
+  handle_t->ctrl_socket_1 = KMP_TOR_SOCKET_INVALID;
+
+  handle_t->tor_api_cfg_new = NULL;
+  handle_t->tor_api_cfg_set_command_line = NULL;
+#ifdef _WIN32
+  handle_t->tor_api_cfg_set_ctrl_socket = NULL;
+#endif // _WIN32
+
+  if (handle_t->cfg) {
+    handle_t->tor_api_cfg_free(handle_t->cfg);
+    handle_t->cfg = NULL;
+  }
+  handle_t->tor_api_run_main = NULL;
+  handle_t->tor_api_cfg_free = NULL;
+
+  if (handle_t->args) {
+    kmp_tor_args_free(handle_t->args);
+    handle_t->args = NULL;
+  }
+
+  if (handle_t->lib_t && !kmp_tor_lib_is_quiescent(ctx, handle_t->tor_api_threads_unjoined)) {
+    // Deliberately leaked, along with its claim so that the same
+    // library file is never loaded again into the busy image.
+    handle_t->OPENSSL_cleanup = NULL;
+    handle_t->lib_t = NULL;
+    handle_t->lib_claim = NULL;
+  }
+  handle_t->tor_api_threads_unjoined = NULL;
+
+  if (handle_t->OPENSSL_cleanup) {
+    uint64_t start_ns = kmp_tor_now_ns();
+    handle_t->OPENSSL_cleanup();
+    handle_t->OPENSSL_cleanup = NULL;
+    handle_t->openssl_cleanup_ns = kmp_tor_now_ns() - start_ns;
+  }
+
+  if (handle_t->lib_t) {
+    uint64_t close_ns = kmp_tor_lib_close(ctx, handle_t->lib_t, &ctx->stats.lib_close_ns);
+    handle_t->lib_t = NULL;
+    kmp_tor_warm_credit_unload(ctx, handle_t->lib_reuse_count, handle_t->openssl_cleanup_ns + close_ns);
+  }
+
+  if (handle_t->lib_claim) {
+    kmp_tor_lib_unclaim(handle_t->lib_claim);
+    handle_t->lib_claim = NULL;
+  }
+
+  kmp_tor_thread_options_free(&handle_t->thread_options);
+
+#ifdef _WIN32
+  if (handle_t->was_win32_sockets_initialized == 0) {
+    win32_sockets_deinit();
+    handle_t->was_win32_sockets_initialized = -1;
+  }
+#endif // _WIN32
+
+  free(handle_t);
+}
+
+static const char *
+kmp_tor_configure_lib_t(kmp_tor_context_t *ctx, const char * lib_tor, kmp_tor_handle_t *handle_t)
+{
+  assert(ctx);
+  assert(lib_tor);
+  assert(handle_t);
+
+  uint64_t start_ns = 0;
+  uint64_t open_ns = 0;
+  const char *c_result = NULL;
+  kmp_tor_warm_t stale;
+
+  memset(&stale, 0, sizeof(kmp_tor_warm_t));
+  pthread_mutex_lock(&ctx->lock);
+    if (ctx->warm.lib_t) {
+      // Only the very same library file can be re-run in the retained
+      // image. If it was replaced (e.g. updated), or a different one was
+      // requested, the retained image is fully unloaded.
+      if (ctx->warm.enabled && kmp_tor_lib_claim_is(ctx->warm.lib_claim, lib_tor)) {
+        kmp_tor_warm_take(&ctx->warm, handle_t);
+        ctx->warm.saved_ns += ctx->warm.load_ns;
+      } else {
+        kmp_tor_warm_detach(&ctx->warm, &stale);
+      }
+    }
+  pthread_mutex_unlock(&ctx->lock);
+
+  kmp_tor_warm_release(ctx, &stale);
+
+  if (handle_t->lib_t) {
+    return NULL;
+  }
+
+  start_ns = kmp_tor_now_ns();
+
+  c_result = kmp_tor_lib_claim(lib_tor, &handle_t->lib_claim);
+  if (c_result) {
+    return c_result;
+  }
+
+  handle_t->lib_t = lib_load_open(lib_tor);
+  if (!handle_t->lib_t) {
+    return kmp_tor_error_detail(ctx, "Failed to load tor", lib_load_last_error());
+  }
+  open_ns = kmp_tor_now_ns();
+
+  *(void **) (&handle_t->OPENSSL_cleanup) = lib_load_resolve(handle_t->lib_t, "OPENSSL_cleanup");
+  if (!handle_t->OPENSSL_cleanup) {
+    return kmp_tor_error_detail(ctx, "Failed to resolve symbol OPENSSL_cleanup", lib_load_last_error());
+  }
+
+  *(void **) (&handle_t->tor_api_cfg_free) = lib_load_resolve(handle_t->lib_t, "tor_main_configuration_free");
+  if (!handle_t->tor_api_cfg_free) {
+    return kmp_tor_error_detail(ctx, "Failed to resolve symbol tor_main_configuration_free", lib_load_last_error());
+  }
+
+  *(void **) (&handle_t->tor_api_run_main) = lib_load_resolve(handle_t->lib_t, "tor_run_main");
+  if (!handle_t->tor_api_run_main) {
+    return kmp_tor_error_detail(ctx, "Failed to resolve symbol tor_run_main", lib_load_last_error());
+  }
+
+  *(void **) (&handle_t->tor_api_threads_unjoined) = lib_load_resolve(handle_t->lib_t, "tor_api_workqueue_threads_unjoined");
+  if (!handle_t->tor_api_threads_unjoined) {
+    return kmp_tor_error_detail(ctx, "Failed to resolve symbol tor_api_workqueue_threads_unjoined", lib_load_last_error());
+  }
+
+  *(void **) (&handle_t->tor_api_cfg_new) = lib_load_resolve(handle_t->lib_t, "tor_main_configuration_new");
+  if (!handle_t->tor_api_cfg_new) {
+    return kmp_tor_error_detail(ctx, "Failed to resolve symbol tor_main_configuration_new", lib_load_last_error());
+  }
+
+  *(void **) (&handle_t->tor_api_cfg_set_command_line) = lib_load_resolve(handle_t->lib_t, "tor_main_configuration_set_command_line");
+  if (!handle_t->tor_api_cfg_set_command_line) {
+    return kmp_tor_error_detail(ctx, "Failed to resolve symbol tor_main_configuration_set_command_line", lib_load_last_error());
+  }
+
+#ifdef _WIN32
+  *(void **) (&handle_t->tor_api_cfg_set_ctrl_socket) = lib_load_resolve(handle_t->lib_t, "tor_main_configuration_setup_control_socket");
+  if (!handle_t->tor_api_cfg_set_ctrl_socket) {
+    return kmp_tor_error_detail(ctx, "Failed to resolve symbol tor_main_configuration_setup_control_socket", lib_load_last_error());
+  }
+#endif // _WIN32
+
+  handle_t->lib_load_ns = kmp_tor_now_ns() - start_ns;
+
+  pthread_mutex_lock(&ctx->lock);
+    ctx->stats.lib_open_ns = open_ns - start_ns;
+    ctx->stats.lib_resolve_ns = handle_t->lib_load_ns - ctx->stats.lib_open_ns;
+  pthread_mutex_unlock(&ctx->lock);
+
+  if (handle_t->lib_load_ns == 0) {
+    handle_t->lib_load_ns = 1;
+  }
+  return NULL;
+}
+
+static const char *
+kmp_tor_configure_tor(kmp_tor_handle_t *handle_t)
+{
   assert(handle_t);
 
   handle_t->cfg = handle_t->tor_api_cfg_new();
@@ -330,8 +1386,7 @@ kmp_tor_configure_tor(kmp_tor_handle_t *handle_t)
 
   int result = -1;
   kmp_tor_socket_t fds[2] = { KMP_TOR_SOCKET_INVALID };
-  char *s1 = NULL;
-  char *s2 = NULL;
+  kmp_tor_args_t *args = handle_t->args;
 
 #ifdef _WIN32
   result = win32_af_unix_socketpair(fds);
@@ -358,37 +1413,28 @@ kmp_tor_configure_tor(kmp_tor_handle_t *handle_t)
   }
 #endif // FD_CLOEXEC
 
+#ifdef SO_NOSIGPIPE
+  if (result == 0) {
+    int on = 1;
+    result = setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+  }
+#endif // SO_NOSIGPIPE
+
 #endif // _WIN32
 
   if (result == 0) {
-    char buf[32];
-    if (snprintf(buf, sizeof(buf), "%"PRIu64, (uint64_t) fds[1]) < 0) {
+    int len = snprintf(args->ctrl_fd, sizeof(args->ctrl_fd), "%"PRIu64, (uint64_t) fds[1]);
+    if (len < 0 || (size_t) len >= sizeof(args->ctrl_fd)) {
       result = -1;
-    } else {
-      s1 = strdup("--__OwningControllerFD");
-      s2 = strdup(buf);
-
-      if (!s1) {
-        result = -1;
-      }
-      if (!s2) {
-        result = -1;
-      }
     }
   }
 
   if (result == 0) {
     handle_t->ctrl_socket_0 = fds[0];
     handle_t->ctrl_socket_1 = fds[1];
-    handle_t->argv[handle_t->argc - 2] = s1;
-    handle_t->argv[handle_t->argc - 1] = s2;
+    args->argv[args->argc - 2] = args->ctrl_flag;
+    args->argv[args->argc - 1] = args->ctrl_fd;
   } else {
-    if (s1) {
-      free(s1);
-    }
-    if (s2) {
-      free(s2);
-    }
     kmp_tor_closesocket(fds[0]);
     kmp_tor_closesocket(fds[1]);
 #ifdef _WIN32
@@ -396,7 +1442,8 @@ kmp_tor_configure_tor(kmp_tor_handle_t *handle_t)
     // controller socket. Disregard the last 2 slots that were
     // added (which are NULL) so tor does not include them in the
     // event it is successful.
-    handle_t->argc = handle_t->argc - 2;
+    args->argc = args->argc - 2;
+    args->argv[args->argc] = NULL;
 
     // Try tor's implementation
     handle_t->ctrl_socket_0 = handle_t->tor_api_cfg_set_ctrl_socket(handle_t->cfg);
@@ -407,42 +1454,62 @@ kmp_tor_configure_tor(kmp_tor_handle_t *handle_t)
     return "Failed to setup controller socket";
   }
 
-  if (handle_t->tor_api_cfg_set_command_line(handle_t->cfg, handle_t->argc, handle_t->argv) != 0) {
+  if (handle_t->tor_api_cfg_set_command_line(handle_t->cfg, args->argc, args->argv) != 0) {
     return "Failed to set tor_main_configuration_t arguments";
   }
 
   return NULL;
 }
 
-const char *
-kmp_tor_run_main(kmp_tor_context_t *ctx, const char *lib_tor, int argc, char *argv[])
-{
-  if (!ctx) {
-    return "kmp_tor_context_t cannot be NULL";
-  }
+static const char *
+kmp_tor_start(
+  kmp_tor_context_t *ctx,
+  const char *lib_tor,
+  kmp_tor_args_t *args,
+  const kmp_tor_thread_options_t *options
+) {
+  // Takes ownership of args
+  assert(ctx);
+  assert(args);
+
   if (!lib_tor) {
+    kmp_tor_args_free(args);
     return "lib_tor cannot be NULL";
   }
-  if (argc <= 0) {
-    return "argc must be greater than 0";
-  }
-  if (!argv) {
-    return "argv cannot be NULL";
+
+  const char *parse_result = kmp_tor_args_parse(args);
+  if (parse_result) {
+    kmp_tor_args_free(args);
+    return parse_result;
   }
 
   int i_result = 0;
+  uint64_t start_ns = 0;
   const char *c_result = NULL;
   kmp_tor_handle_t *handle_t = NULL;
   pthread_attr_t attr_t;
+  uint64_t seq = 0;
 
   pthread_mutex_lock(&ctx->lock);
     i_result = ctx->state;
     if (ctx->state == KMP_TOR_STATE_OFF) {
-      ctx->state = KMP_TOR_STATE_STARTING;
+      ctx->stats.lib_open_ns = 0;
+      ctx->stats.lib_resolve_ns = 0;
+      ctx->stats.configure_ns = 0;
+      ctx->stats.thread_start_ns = 0;
+      ctx->stats.run_main_ns = 0;
+      ctx->stats.cleanup_ns = 0;
+      ctx->stats.lib_close_ns = 0;
+      seq = kmp_tor_state_publish(ctx, KMP_TOR_STATE_STARTING);
     }
   pthread_mutex_unlock(&ctx->lock);
 
+  if (seq) {
+    kmp_tor_state_notify(ctx, seq, KMP_TOR_STATE_STARTING);
+  }
+
   if (i_result != KMP_TOR_STATE_OFF) {
+    kmp_tor_args_free(args);
     if (i_result == KMP_TOR_STATE_STARTING) {
       return "tor is already starting up";
     }
@@ -458,11 +1525,12 @@ kmp_tor_run_main(kmp_tor_context_t *ctx, const char *lib_tor, int argc, char *ar
 
   handle_t = malloc(sizeof(kmp_tor_handle_t));
   if (!handle_t) {
+    kmp_tor_args_free(args);
     kmp_tor_state_set(ctx, KMP_TOR_STATE_OFF);
     return "Failed to create kmp_tor_handle_t";
   } else {
-    handle_t->argc = 0;
-    handle_t->argv = NULL;
+    handle_t->args = args;
+    args = NULL;
 
     handle_t->cfg = NULL;
 
@@ -471,83 +1539,66 @@ kmp_tor_run_main(kmp_tor_context_t *ctx, const char *lib_tor, int argc, char *ar
     handle_t->tor_api_cfg_new = NULL;
     handle_t->tor_api_cfg_set_command_line = NULL;
     handle_t->tor_api_run_main = NULL;
+    handle_t->tor_api_threads_unjoined = NULL;
 #ifdef _WIN32
     handle_t->tor_api_cfg_set_ctrl_socket = NULL;
     handle_t->was_win32_sockets_initialized = -1;
 #endif // _WIN32
     handle_t->ctrl_socket_0 = KMP_TOR_SOCKET_INVALID;
     handle_t->ctrl_socket_1 = KMP_TOR_SOCKET_INVALID;
+    handle_t->ctrl_io_count = 0;
+    handle_t->ctrl_is_shutdown = 0;
+    memset(&handle_t->ctrl_line, 0, sizeof(kmp_tor_ctrl_line_t));
+    memset(&handle_t->thread_options, 0, sizeof(kmp_tor_thread_options_t));
+    handle_t->lib_claim = NULL;
     handle_t->lib_t = NULL;
+    handle_t->lib_load_ns = 0;
+    handle_t->lib_reuse_count = 0;
+    handle_t->openssl_cleanup_ns = 0;
     handle_t->tor_run_main_result = KMP_TOR_RESULT_AWAITING;
   }
 
+  c_result = kmp_tor_thread_options_copy(handle_t, options);
+  if (c_result) {
+    kmp_tor_free(ctx, handle_t);
+    handle_t = NULL;
+    kmp_tor_state_set(ctx, KMP_TOR_STATE_OFF);
+    return c_result;
+  }
+
 #ifdef _WIN32
   handle_t->was_win32_sockets_initialized = win32_sockets_init();
   if (handle_t->was_win32_sockets_initialized != 0) {
-    kmp_tor_free(handle_t);
+    kmp_tor_free(ctx, handle_t);
     handle_t = NULL;
     kmp_tor_state_set(ctx, KMP_TOR_STATE_OFF);
     return "Failed to initialize windows sockets";
   }
 #endif // _WIN32
 
-  // Adding 2 to the end in order to setup __OwningControllerFD to
-  // interrupt tor's main loop by closing it down whenever needed,
-  // instead of dealing with signals (which can be a nightmare).
-  handle_t->argc = argc + 2;
-  handle_t->argv = malloc(handle_t->argc * sizeof(char *));
-  if (!handle_t->argv) {
-    kmp_tor_free(handle_t);
-    handle_t = NULL;
-    kmp_tor_state_set(ctx, KMP_TOR_STATE_OFF);
-    return "Failed to create argv";
-  }
-
-  handle_t->argv[argc] = NULL;
-  handle_t->argv[argc + 1] = NULL;
-
-  for (int i = 0; i < argc; i++) {
-    if (i_result != 0) {
-      handle_t->argv[i] = NULL;
-      continue;
-    }
-
-    if (argv[i]) {
-      handle_t->argv[i] = strdup(argv[i]);
-    } else {
-      handle_t->argv[i] = NULL;
-    }
-
-    if (!handle_t->argv[i]) {
-      i_result = -1;
-    }
-  }
-
-  if (i_result != 0) {
-    kmp_tor_free(handle_t);
-    handle_t = NULL;
-    kmp_tor_state_set(ctx, KMP_TOR_STATE_OFF);
-    return "Failed to copy arguments to argv";
-  }
-
-  c_result = kmp_tor_configure_lib_t(lib_tor, handle_t);
+  c_result = kmp_tor_configure_lib_t(ctx, lib_tor, handle_t);
   if (c_result) {
-    kmp_tor_free(handle_t);
+    kmp_tor_free(ctx, handle_t);
     handle_t = NULL;
     kmp_tor_state_set(ctx, KMP_TOR_STATE_OFF);
     return c_result;
   }
 
+  start_ns = kmp_tor_now_ns();
   c_result = kmp_tor_configure_tor(handle_t);
   if (c_result) {
-    kmp_tor_free(handle_t);
+    kmp_tor_free(ctx, handle_t);
     handle_t = NULL;
     kmp_tor_state_set(ctx, KMP_TOR_STATE_OFF);
     return c_result;
   }
 
+  pthread_mutex_lock(&ctx->lock);
+    ctx->stats.configure_ns = kmp_tor_now_ns() - start_ns;
+  pthread_mutex_unlock(&ctx->lock);
+
   if (pthread_attr_init(&attr_t) != 0) {
-    kmp_tor_free(handle_t);
+    kmp_tor_free(ctx, handle_t);
     handle_t = NULL;
     kmp_tor_state_set(ctx, KMP_TOR_STATE_OFF);
     return "Failed to initialize pthread_attr_t";
@@ -555,12 +1606,23 @@ kmp_tor_run_main(kmp_tor_context_t *ctx, const char *lib_tor, int argc, char *ar
 
   if (pthread_attr_setdetachstate(&attr_t, PTHREAD_CREATE_JOINABLE) != 0) {
     pthread_attr_destroy(&attr_t);
-    kmp_tor_free(handle_t);
+    kmp_tor_free(ctx, handle_t);
     handle_t = NULL;
     kmp_tor_state_set(ctx, KMP_TOR_STATE_OFF);
     return "Failed to set pthread_attr_t detachstate to PTHREAD_CREATE_JOINABLE";
   }
 
+  if (handle_t->thread_options.stack_size > 0) {
+    if (pthread_attr_setstacksize(&attr_t, handle_t->thread_options.stack_size) != 0) {
+      pthread_attr_destroy(&attr_t);
+      kmp_tor_free(ctx, handle_t);
+      handle_t = NULL;
+      kmp_tor_state_set(ctx, KMP_TOR_STATE_OFF);
+      return "Failed to set pthread_attr_t stacksize";
+    }
+  }
+
+  start_ns = kmp_tor_now_ns();
   pthread_mutex_lock(&ctx->lock);
     if (pthread_create(&handle_t->thread_id, &attr_t, kmp_tor_execute, ctx) == 0) {
       ctx->handle_t = handle_t;
@@ -571,25 +1633,110 @@ kmp_tor_run_main(kmp_tor_context_t *ctx, const char *lib_tor, int argc, char *ar
   pthread_attr_destroy(&attr_t);
 
   if (handle_t) {
-    kmp_tor_free(handle_t);
+    kmp_tor_free(ctx, handle_t);
     handle_t = NULL;
     kmp_tor_state_set(ctx, KMP_TOR_STATE_OFF);
     return "Failed to start tor thread";
   }
 
-  while (i_result == 0) {
-    pthread_mutex_lock(&ctx->lock);
-      if (ctx->state != KMP_TOR_STATE_STARTING) {
-        i_result = 1;
+  pthread_mutex_lock(&ctx->lock);
+    while (ctx->state == KMP_TOR_STATE_STARTING) {
+      pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    ctx->stats.thread_start_ns = ctx->stats.started_at_ns - start_ns;
+  pthread_mutex_unlock(&ctx->lock);
+
+  return NULL;
+}
+
+const char *
+kmp_tor_run_main(kmp_tor_context_t *ctx, const char *lib_tor, int argc, char *argv[])
+{
+  return kmp_tor_run_main_with_options(ctx, lib_tor, argc, argv, NULL);
+}
+
+const char *
+kmp_tor_run_main_with_options(
+  kmp_tor_context_t *ctx,
+  const char *lib_tor,
+  int argc,
+  char *argv[],
+  const kmp_tor_thread_options_t *options
+) {
+  if (!ctx) {
+    return "kmp_tor_context_t cannot be NULL";
+  }
+
+  const char *c_result = NULL;
+  size_t len = 0;
+
+  if (argc <= 0) {
+    c_result = "argc must be greater than 0";
+  } else if (!argv) {
+    c_result = "argv cannot be NULL";
+  } else {
+    for (int i = 0; i < argc; i++) {
+      if (!argv[i]) {
+        c_result = "argv cannot contain NULL";
+        break;
       }
-    pthread_mutex_unlock(&ctx->lock);
+      len += strlen(argv[i]) + 1;
+    }
+  }
 
-    if (i_result == 0) {
-      usleep((useconds_t) (5 * 1000));
+  kmp_tor_args_t *args = NULL;
+  if (!c_result) {
+    args = kmp_tor_args_new(argc, len);
+    if (!args) {
+      c_result = "Failed to create kmp_tor_args_t";
     }
   }
 
-  return NULL;
+  if (c_result) {
+    pthread_mutex_lock(&ctx->lock);
+      kmp_tor_stats_error(ctx, c_result, NULL);
+    pthread_mutex_unlock(&ctx->lock);
+    return c_result;
+  }
+
+  char *buf = kmp_tor_args_buf(args);
+  for (int i = 0; i < argc; i++) {
+    size_t arg_len = strlen(argv[i]) + 1;
+    memcpy(buf, argv[i], arg_len);
+    buf += arg_len;
+  }
+
+  return kmp_tor_run_main_args(ctx, lib_tor, args, options);
+}
+
+const char *
+kmp_tor_run_main_args(
+  kmp_tor_context_t *ctx,
+  const char *lib_tor,
+  kmp_tor_args_t *args,
+  const kmp_tor_thread_options_t *options
+) {
+  if (!ctx) {
+    kmp_tor_args_free(args);
+    return "kmp_tor_context_t cannot be NULL";
+  }
+
+  const char *c_result = NULL;
+
+  if (!args) {
+    c_result = "args cannot be NULL";
+  } else {
+    c_result = kmp_tor_start(ctx, lib_tor, args, options);
+    args = NULL;
+  }
+
+  if (c_result) {
+    pthread_mutex_lock(&ctx->lock);
+      kmp_tor_stats_error(ctx, c_result, NULL);
+    pthread_mutex_unlock(&ctx->lock);
+  }
+
+  return c_result;
 }
 
 int
@@ -605,6 +1752,288 @@ kmp_tor_state(kmp_tor_context_t *ctx)
   return state;
 }
 
+int
+kmp_tor_await_state(kmp_tor_context_t *ctx, int state, int64_t timeout_ns)
+{
+  if (!ctx) {
+    return -1;
+  }
+  if (state < KMP_TOR_STATE_OFF || state > KMP_TOR_STATE_STOPPED) {
+    return -1;
+  }
+
+  int result = 0;
+  struct timespec deadline;
+
+  if (timeout_ns > KMP_TOR_AWAIT_MAX_NS) {
+    timeout_ns = -1;
+  }
+  if (timeout_ns > 0) {
+    kmp_tor_cond_deadline(&deadline, timeout_ns);
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+    ctx->state_waiters++;
+    while (ctx->state != state && result == 0 && timeout_ns != 0 && !ctx->is_deinit) {
+      if (timeout_ns < 0) {
+        result = pthread_cond_wait(&ctx->cond, &ctx->lock);
+      } else {
+        result = pthread_cond_timedwait(&ctx->cond, &ctx->lock, &deadline);
+      }
+    }
+    result = ctx->state;
+    if (--ctx->state_waiters == 0 && ctx->is_deinit) {
+      pthread_cond_broadcast(&ctx->cond);
+    }
+  pthread_mutex_unlock(&ctx->lock);
+
+  return result;
+}
+
+int
+kmp_tor_state_fd(kmp_tor_context_t *ctx)
+{
+  if (!ctx) {
+    return -1;
+  }
+  return ctx->state_fd[0];
+}
+
+int
+kmp_tor_state_listener(kmp_tor_context_t *ctx, kmp_tor_state_listener_t listener, void *arg)
+{
+  if (!ctx) {
+    return -1;
+  }
+  pthread_mutex_lock(&ctx->lock);
+    // Wait out a notification in progress on another thread, so that the
+    // caller may release whatever backs the previous listener on return.
+    while (ctx->state_notifying > 0 && !pthread_equal(ctx->state_notifier, pthread_self())) {
+      pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    ctx->state_listener = listener;
+    ctx->state_listener_arg = listener ? arg : NULL;
+  pthread_mutex_unlock(&ctx->lock);
+  return 0;
+}
+
+static kmp_tor_handle_t *
+kmp_tor_ctrl_io_acquire(kmp_tor_context_t *ctx, kmp_tor_socket_t *s)
+{
+  assert(ctx);
+  assert(s);
+  kmp_tor_handle_t *handle_t = NULL;
+
+  pthread_mutex_lock(&ctx->lock);
+    if (ctx->handle_t && !ctx->handle_t->ctrl_is_shutdown) {
+      *s = ctx->handle_t->ctrl_socket_0;
+      if (*s != KMP_TOR_SOCKET_INVALID) {
+        handle_t = ctx->handle_t;
+        handle_t->ctrl_io_count++;
+      }
+    }
+  pthread_mutex_unlock(&ctx->lock);
+
+  return handle_t;
+}
+
+static void
+kmp_tor_ctrl_io_release(kmp_tor_context_t *ctx, kmp_tor_handle_t *handle_t)
+{
+  assert(ctx);
+  assert(handle_t);
+
+  pthread_mutex_lock(&ctx->lock);
+    handle_t->ctrl_io_count--;
+    if (handle_t->ctrl_io_count == 0 && handle_t->ctrl_is_shutdown) {
+      pthread_cond_broadcast(&ctx->cond);
+    }
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+int64_t
+kmp_tor_ctrl_socket(kmp_tor_context_t *ctx)
+{
+  if (!ctx) {
+    return -1;
+  }
+
+  int64_t s = -1;
+  pthread_mutex_lock(&ctx->lock);
+    if (ctx->handle_t && !ctx->handle_t->ctrl_is_shutdown) {
+      if (ctx->handle_t->ctrl_socket_0 != KMP_TOR_SOCKET_INVALID) {
+        s = (int64_t) ctx->handle_t->ctrl_socket_0;
+      }
+    }
+  pthread_mutex_unlock(&ctx->lock);
+  return s;
+}
+
+int
+kmp_tor_ctrl_read(kmp_tor_context_t *ctx, void *buf, int len)
+{
+  if (!ctx || !buf || len < 0) {
+    return -1;
+  }
+
+  int result = -1;
+  kmp_tor_socket_t s = KMP_TOR_SOCKET_INVALID;
+  kmp_tor_handle_t *handle_t = kmp_tor_ctrl_io_acquire(ctx, &s);
+  if (!handle_t) {
+    return -1;
+  }
+
+#ifdef _WIN32
+  result = recv(s, (char *) buf, len, 0);
+#else
+  ssize_t r = -1;
+  do {
+    r = recv(s, buf, (size_t) len, 0);
+  } while (r < 0 && errno == EINTR);
+  result = (int) r;
+#endif // _WIN32
+
+  kmp_tor_ctrl_io_release(ctx, handle_t);
+  return result < 0 ? -1 : result;
+}
+
+// Advances line over buf, returning 1 (and stopping) if it would complete
+// a DROPOWNERSHIP command, otherwise 0.
+//
+// kmp_tor_terminate_and_await_result stops tor by shutting down its owning
+// controller connection, which has no effect once tor has been told to drop
+// ownership of it. tor would then never exit.
+static int
+kmp_tor_ctrl_line_scan(kmp_tor_ctrl_line_t *line, const char *buf, int len)
+{
+  assert(line);
+  assert(buf);
+
+  for (int i = 0; i < len; i++) {
+    char c = buf[i];
+
+    if (c == '\n' || c == '\r' || c == ' ') {
+      if (line->len == (int) sizeof(line->keyword)
+          && memcmp(line->keyword, KMP_TOR_CTRL_DROPOWNERSHIP, sizeof(line->keyword)) == 0
+      ) {
+        return 1;
+      }
+      line->len = c == '\n' ? 0 : -1;
+      continue;
+    }
+
+    if (line->len < 0) {
+      continue;
+    }
+    if (line->len == 0 && c == '+') {
+      // Multi-line command
+      continue;
+    }
+    if (line->len == (int) sizeof(line->keyword)) {
+      line->len = -1;
+      continue;
+    }
+
+    // tor's command keywords are case-insensitive
+    line->keyword[line->len++] = (char) toupper((unsigned char) c);
+  }
+
+  return 0;
+}
+
+int
+kmp_tor_ctrl_write(kmp_tor_context_t *ctx, const void *buf, int len)
+{
+  if (!ctx || !buf || len < 0) {
+    return -1;
+  }
+
+  int result = -1;
+  kmp_tor_socket_t s = KMP_TOR_SOCKET_INVALID;
+  kmp_tor_handle_t *handle_t = kmp_tor_ctrl_io_acquire(ctx, &s);
+  if (!handle_t) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+    // Scanned on a copy, as only what is actually sent may advance it
+    kmp_tor_ctrl_line_t line = handle_t->ctrl_line;
+    int is_dropownership = kmp_tor_ctrl_line_scan(&line, buf, len);
+  pthread_mutex_unlock(&ctx->lock);
+
+  if (is_dropownership) {
+    kmp_tor_ctrl_io_release(ctx, handle_t);
+    return -2;
+  }
+
+#ifdef _WIN32
+  result = send(s, (const char *) buf, len, 0);
+#else
+  ssize_t r = -1;
+  do {
+    r = send(s, buf, (size_t) len, KMP_TOR_SEND_FLAGS);
+  } while (r < 0 && errno == EINTR);
+  result = (int) r;
+#endif // _WIN32
+
+  if (result > 0) {
+    pthread_mutex_lock(&ctx->lock);
+      kmp_tor_ctrl_line_scan(&handle_t->ctrl_line, buf, result);
+    pthread_mutex_unlock(&ctx->lock);
+  }
+
+  kmp_tor_ctrl_io_release(ctx, handle_t);
+  return result < 0 ? -1 : result;
+}
+
+int
+kmp_tor_warm_restart(kmp_tor_context_t *ctx, int enable)
+{
+  if (!ctx) {
+    return -1;
+  }
+
+  kmp_tor_warm_t stale;
+  memset(&stale, 0, sizeof(kmp_tor_warm_t));
+
+  pthread_mutex_lock(&ctx->lock);
+    ctx->warm.enabled = enable ? 1 : 0;
+    if (!ctx->warm.enabled) {
+      kmp_tor_warm_detach(&ctx->warm, &stale);
+    }
+  pthread_mutex_unlock(&ctx->lock);
+
+  kmp_tor_warm_release(ctx, &stale);
+  return 0;
+}
+
+uint64_t
+kmp_tor_warm_restart_saved_ns(kmp_tor_context_t *ctx)
+{
+  if (!ctx) {
+    return 0;
+  }
+
+  uint64_t saved_ns = 0;
+  pthread_mutex_lock(&ctx->lock);
+    saved_ns = ctx->warm.saved_ns;
+  pthread_mutex_unlock(&ctx->lock);
+  return saved_ns;
+}
+
+int
+kmp_tor_stats(kmp_tor_context_t *ctx, kmp_tor_stats_t *stats)
+{
+  if (!ctx || !stats) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+    *stats = ctx->stats;
+  pthread_mutex_unlock(&ctx->lock);
+  return 0;
+}
+
 int
 kmp_tor_terminate_and_await_result(kmp_tor_context_t *ctx)
 {
@@ -616,40 +2045,51 @@ kmp_tor_terminate_and_await_result(kmp_tor_context_t *ctx)
   kmp_tor_handle_t *handle_t = NULL;
   void *ret = NULL;
 
-  while (result == KMP_TOR_RESULT_AWAITING && handle_t == NULL) {
-    pthread_mutex_lock(&ctx->lock);
-      if (ctx->state == KMP_TOR_STATE_OFF) {
-        // Pop out
-        result = KMP_TOR_RESULT_AWAITING - 1;
-      } else {
-        if (ctx->handle_t) {
-          kmp_tor_closesocket(ctx->handle_t->ctrl_socket_0);
-          ctx->handle_t->ctrl_socket_0 = KMP_TOR_SOCKET_INVALID;
-
-          result = ctx->handle_t->tor_run_main_result;
-          if (result != KMP_TOR_RESULT_AWAITING) {
-            handle_t = ctx->handle_t;
-            ctx->handle_t = NULL;
-          }
+  pthread_mutex_lock(&ctx->lock);
+    while (ctx->state != KMP_TOR_STATE_OFF) {
+      if (ctx->handle_t) {
+        // Shutdown (instead of close) such that any in-flight calls to
+        // kmp_tor_ctrl_read/kmp_tor_ctrl_write return before the socket
+        // is closed by kmp_tor_free.
+        if (!ctx->handle_t->ctrl_is_shutdown) {
+          kmp_tor_shutdownsocket(ctx->handle_t->ctrl_socket_0);
+          ctx->handle_t->ctrl_is_shutdown = 1;
+        }
+
+        result = ctx->handle_t->tor_run_main_result;
+        if (result != KMP_TOR_RESULT_AWAITING && ctx->handle_t->ctrl_io_count == 0) {
+          handle_t = ctx->handle_t;
+          ctx->handle_t = NULL;
+          break;
         }
       }
-    pthread_mutex_unlock(&ctx->lock);
 
-    if (result == KMP_TOR_RESULT_AWAITING && handle_t == NULL) {
-      usleep((useconds_t) (10 * 1000));
+      // Woken up by kmp_tor_execute upon KMP_TOR_STATE_STOPPED,
+      // kmp_tor_run_main upon KMP_TOR_STATE_STARTED/KMP_TOR_STATE_OFF,
+      // or kmp_tor_ctrl_io_release.
+      pthread_cond_wait(&ctx->cond, &ctx->lock);
     }
-  }
+  pthread_mutex_unlock(&ctx->lock);
 
   if (!handle_t) {
     return -1;
   }
 
+  // Returns only once kmp_tor_execute has completed tor_run_main (which
+  // joins tor's workqueue threads), tor_main_configuration_free and
+  // OPENSSL_cleanup, at which point nothing is executing in the library.
   pthread_join(handle_t->thread_id, &ret);
   assert(!ret);
 
-  usleep((useconds_t) (50 * 1000));
+  pthread_mutex_lock(&ctx->lock);
+    // A non-NULL OPENSSL_cleanup means kmp_tor_execute deemed the run
+    // safe to be repeated in the same library image.
+    if (ctx->warm.enabled && handle_t->OPENSSL_cleanup && !ctx->warm.lib_t) {
+      kmp_tor_warm_retain(&ctx->warm, handle_t);
+    }
+  pthread_mutex_unlock(&ctx->lock);
 
-  kmp_tor_free(handle_t);
+  kmp_tor_free(ctx, handle_t);
   handle_t = NULL;
   kmp_tor_state_set(ctx, KMP_TOR_STATE_OFF);
   return result;
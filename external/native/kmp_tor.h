@@ -17,18 +17,47 @@
 #ifndef KMP_TOR_H
 #define KMP_TOR_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define KMP_TOR_STATE_OFF       0
 #define KMP_TOR_STATE_STARTING  1
 #define KMP_TOR_STATE_STARTED   2
 #define KMP_TOR_STATE_STOPPED   3
 
+#define KMP_TOR_THREAD_SCHED_DEFAULT  0
+#define KMP_TOR_THREAD_SCHED_BATCH    1
+#define KMP_TOR_THREAD_SCHED_IDLE     2
+
 /**
  *
  **/
 typedef struct kmp_tor_context_t kmp_tor_context_t;
 
+/**
+ * Callback for state transitions, see `kmp_tor_state_listener`.
+ *
+ * Listeners are invoked without the kmp_tor_context_t lock held, on the
+ * thread which made the transition (tor's thread for STARTED and STOPPED),
+ * one at a time and in the order the transitions were made. A transition
+ * waits for the listener to return from the previous one, so listeners
+ * should return quickly.
+ *
+ * **NOTE:** Listeners MAY call `kmp_tor_state`, `kmp_tor_await_state`,
+ * `kmp_tor_state_listener`, `kmp_tor_stats` and the `kmp_tor_ctrl_*`
+ * functions. They MUST NOT call `kmp_tor_run_main`,
+ * `kmp_tor_terminate_and_await_result` or `kmp_tor_deinit`.
+ **/
+typedef void (*kmp_tor_state_listener_t)(kmp_tor_context_t *ctx, int state, void *arg);
+
 /**
  * Returns a new kmp_tor_context_t on success, or NULL on failure.
+ *
+ * Multiple contexts may exist simultaneously. tor keeps its state in globals,
+ * so contexts running at the same time MUST each be given their own copy of
+ * the tor library (a distinct file) via `kmp_tor_run_main`; that way every
+ * instance gets a separate library image. Note that signal dispositions are
+ * process-wide and thus shared between instances.
  **/
 kmp_tor_context_t *kmp_tor_init();
 
@@ -36,14 +65,21 @@ kmp_tor_context_t *kmp_tor_init();
  * Deinitializes kmp_tor and free's the kmp_tor_context_t struct.
  *
  * **NOTE:** kmp_tor_terminate_and_await_result is always called prior
- * to freeing the kmp_tor_context_t.
+ * to freeing the kmp_tor_context_t. Callers blocked in `kmp_tor_await_state`
+ * are woken and waited on before ctx is freed.
  *
  * Returns -1 if ctx is NULL, otherwise 0.
  **/
 int kmp_tor_deinit(kmp_tor_context_t *ctx);
 
 /**
- * Returns NULL on successful startup. Otherwise, an error message.
+ * Returns NULL on successful startup. Otherwise, an error message. Failures to
+ * load tor or resolve its symbols carry the loader's reason (e.g. dlerror),
+ * such as "Failed to load tor: Failed to open lib[...] - error[...]". The
+ * message is valid until the next `kmp_tor_run_main*` call for ctx.
+ *
+ * An error is returned if `lib_tor` refers to a library which is currently
+ * loaded by another kmp_tor_context_t.
  *
  * After successful startup, `kmp_tor_terminate_and_await_result` can be called
  * to interrupt tor's main loop.
@@ -52,6 +88,91 @@ int kmp_tor_deinit(kmp_tor_context_t *ctx);
  **/
 const char *kmp_tor_run_main(kmp_tor_context_t *ctx, const char *lib_tor, int argc, char *argv[]);
 
+/**
+ * Attributes for the thread which runs tor's `tor_run_main`, see
+ * `kmp_tor_run_main_with_options`. A zeroed struct uses the defaults for
+ * everything (which is what `kmp_tor_run_main` does).
+ *
+ * Only `stack_size` is applied before the thread is created; failure to set
+ * it fails startup. The rest are applied by the thread itself before
+ * KMP_TOR_STATE_STARTED is published, on a best-effort basis; each failure is
+ * logged (stderr, or logcat on Android) naming the attribute, recorded as
+ * `kmp_tor_stats_t.last_error`, and startup continues.
+ **/
+typedef struct {
+  // Stack size in bytes, or 0 for the platform default. MUST be at least
+  // PTHREAD_STACK_MIN.
+  size_t stack_size;
+
+  // Indices of the CPUs the thread may run on, or NULL (or a `cpu_set_len`
+  // of 0) for no affinity. Linux/Android only.
+  const int *cpu_set;
+  int cpu_set_len;
+
+  // One of the KMP_TOR_THREAD_SCHED values. On Linux/Android, BATCH and IDLE
+  // are SCHED_BATCH and SCHED_IDLE. On Darwin, they are the quality of service
+  // classes QOS_CLASS_UTILITY and QOS_CLASS_BACKGROUND.
+  int sched_policy;
+
+  // If non-zero, the thread's nice value is set to `nice`. Linux/Android only.
+  int set_nice;
+  int nice;
+
+  // Name for the thread, or NULL. Linux/Android truncate it to 15 bytes.
+  // Linux/Android/Darwin only.
+  const char *name;
+} kmp_tor_thread_options_t;
+
+/**
+ * The same as `kmp_tor_run_main`, but tor's thread is configured as per
+ * `options` (which may be NULL). `options` is copied and need not outlive
+ * the call.
+ **/
+const char *kmp_tor_run_main_with_options(
+  kmp_tor_context_t *ctx,
+  const char *lib_tor,
+  int argc,
+  char *argv[],
+  const kmp_tor_thread_options_t *options
+);
+
+/**
+ * Arguments for `kmp_tor_run_main_args`, held in a single allocation which
+ * tor's argv is parsed into without copying each argument.
+ **/
+typedef struct kmp_tor_args_t kmp_tor_args_t;
+
+/**
+ * Returns a new kmp_tor_args_t for `argc` arguments whose NUL terminated
+ * strings total `len` bytes, or NULL if argc or len is invalid or allocation
+ * fails. The arguments MUST then be written, packed back to back, to the
+ * buffer returned by `kmp_tor_args_buf`.
+ **/
+kmp_tor_args_t *kmp_tor_args_new(int argc, size_t len);
+
+/**
+ * Returns the `len` byte buffer of args (see `kmp_tor_args_new`), or NULL if
+ * args is NULL.
+ **/
+char *kmp_tor_args_buf(kmp_tor_args_t *args);
+
+/**
+ * Frees args. Only necessary if it is not passed to `kmp_tor_run_main_args`.
+ **/
+void kmp_tor_args_free(kmp_tor_args_t *args);
+
+/**
+ * The same as `kmp_tor_run_main_with_options`, but takes ownership of `args`
+ * (regardless of success) instead of copying `argv`. An error is returned if
+ * its buffer does not hold exactly `argc` NUL terminated strings.
+ **/
+const char *kmp_tor_run_main_args(
+  kmp_tor_context_t *ctx,
+  const char *lib_tor,
+  kmp_tor_args_t *args,
+  const kmp_tor_thread_options_t *options
+);
+
 /**
  * Returns current state.
  *  - (0) KMP_TOR_STATE_OFF:       Nothing happening. Free to call `kmp_tor_run_main`
@@ -64,10 +185,191 @@ const char *kmp_tor_run_main(kmp_tor_context_t *ctx, const char *lib_tor, int ar
  **/
 int kmp_tor_state(kmp_tor_context_t *ctx);
 
+/**
+ * Blocks until the current state is equal to `state`, or `timeout_ns` has
+ * elapsed. A negative `timeout_ns` waits indefinitely, whereas 0 does not
+ * wait at all.
+ *
+ * Returns the state at the time of return (callers should compare it against
+ * `state` to determine if a timeout occurred). If ctx is NULL or state is not
+ * a known KMP_TOR_STATE, -1 is returned.
+ *
+ * `kmp_tor_deinit` wakes any callers blocked here and waits for them to
+ * return before freeing ctx. Callers MUST NOT enter this function once
+ * `kmp_tor_deinit` has returned.
+ **/
+int kmp_tor_await_state(kmp_tor_context_t *ctx, int state, int64_t timeout_ns);
+
+/**
+ * Returns a non-blocking descriptor which becomes readable whenever the state
+ * changes, suitable for use with poll/epoll/kqueue. Callers should drain it
+ * (read until EAGAIN) before calling `kmp_tor_state`. The descriptor is owned
+ * by ctx and MUST NOT be closed by callers.
+ *
+ * On Linux/Android this is an eventfd, otherwise the read end of a pipe.
+ *
+ * Returns -1 if ctx is NULL or the platform does not support it (Windows).
+ **/
+int kmp_tor_state_fd(kmp_tor_context_t *ctx);
+
+/**
+ * Sets (or clears, if `listener` is NULL) the listener to be notified of
+ * state transitions. Only a single listener is supported; setting a new one
+ * replaces the old. Once this returns, the previous listener is no longer
+ * being invoked (other than by the caller itself, if called from within it).
+ *
+ * Returns -1 if ctx is NULL, otherwise 0.
+ **/
+int kmp_tor_state_listener(kmp_tor_context_t *ctx, kmp_tor_state_listener_t listener, void *arg);
+
+/**
+ * Returns the socket for this end of tor's `__OwningControllerFD`
+ * connection, or -1 if tor is not running (or ctx is NULL). It is intended
+ * for readiness notification only (e.g. poll/epoll/kqueue/WSAPoll); data
+ * should be transferred using `kmp_tor_ctrl_read` and `kmp_tor_ctrl_write`.
+ * The socket is owned by ctx and MUST NOT be closed by callers.
+ *
+ * The value is widened to int64_t so that a single signature serves every
+ * platform. On Windows it is the `SOCKET` handle (cast back with `(SOCKET)`),
+ * elsewhere it is the `int` file descriptor (cast back with `(int)`). Neither
+ * is ever negative when valid; INVALID_SOCKET is reported as -1.
+ *
+ * tor treats the owning controller connection as already authenticated, so
+ * control-protocol commands can be written immediately without issuing
+ * AUTHENTICATE. Writing to the socket directly would bypass the refusal of
+ * `DROPOWNERSHIP` by `kmp_tor_ctrl_write`.
+ **/
+int64_t kmp_tor_ctrl_socket(kmp_tor_context_t *ctx);
+
+/**
+ * Reads up to `len` bytes of control-protocol output from tor into `buf`,
+ * blocking until data is available.
+ *
+ * Returns the number of bytes read, 0 upon EOF (tor's `tor_run_main` returned
+ * or `kmp_tor_terminate_and_await_result` was called), or -1 on error or if
+ * tor is not running.
+ **/
+int kmp_tor_ctrl_read(kmp_tor_context_t *ctx, void *buf, int len);
+
+/**
+ * Writes up to `len` bytes of control-protocol input from `buf` to tor.
+ *
+ * tor's `DROPOWNERSHIP` command is refused, as `kmp_tor_terminate_and_await_result`
+ * relies upon tor owning the connection in order to stop it. Commands are tracked
+ * across calls, so nothing of `buf` is written if it would complete one.
+ *
+ * Returns the number of bytes written (which may be less than `len`), -2 if `buf`
+ * would complete a `DROPOWNERSHIP` command, or -1 on error or if tor is not running.
+ **/
+int kmp_tor_ctrl_write(kmp_tor_context_t *ctx, const void *buf, int len);
+
+/**
+ * Enables (non-zero) or disables (0) warm restarts, which are off by default.
+ *
+ * When enabled, the tor library image and its resolved symbols are retained
+ * after `kmp_tor_terminate_and_await_result` (instead of calling
+ * `OPENSSL_cleanup` and unloading it), and are reused by the next call to
+ * `kmp_tor_run_main`. This skips loading, relocating and symbol resolution on
+ * restart, and the `OPENSSL_cleanup` and unload on stop. The next run only
+ * reuses the image if `lib_tor` refers to the same file. Otherwise, a full
+ * unload is performed as per usual.
+ *
+ * Retention only occurs if `tor_run_main` exited cleanly (0) after
+ * `kmp_tor_terminate_and_await_result` asked it to stop. That is, tor shut
+ * down from its main loop and ran `tor_cleanup`, which frees its options,
+ * connections, circuits, event base and subsystems. Runs which exit on their
+ * own (e.g. `--verify-config`, `--version`, or a configuration error) are
+ * always fully unloaded.
+ *
+ * **NOTE:** What `tor_cleanup` does NOT reset carries over into the next run:
+ * OpenSSL's initialization (which is the point, as it cannot be re-initialized
+ * after `OPENSSL_cleanup`), libevent's global configuration, and any of tor's
+ * static variables which it fails to reset (tor bug 23847). The latter may
+ * cause a second `tor_run_main` in the same image to misbehave, so do not
+ * enable warm restarts if every run requires a pristine process image.
+ *
+ * Disabling releases any retained library image immediately.
+ *
+ * Returns -1 if ctx is NULL, otherwise 0.
+ **/
+int kmp_tor_warm_restart(kmp_tor_context_t *ctx, int enable);
+
+/**
+ * Returns the cumulative time, in nanoseconds, saved by warm restarts. For
+ * each run which reused a retained image, that is the measured cost of
+ * loading the library and resolving its symbols (from the run which loaded
+ * it), plus the measured cost of `OPENSSL_cleanup` and unloading it. The
+ * latter is only known, and so only counted, once the image is unloaded.
+ *
+ * Returns 0 if ctx is NULL.
+ **/
+uint64_t kmp_tor_warm_restart_saved_ns(kmp_tor_context_t *ctx);
+
+#define KMP_TOR_STATS_ERROR_LEN 256
+
+/**
+ * Lifecycle instrumentation for a kmp_tor_context_t, see `kmp_tor_stats`.
+ *
+ * All values are in nanoseconds of a monotonic clock. Phase durations are for
+ * the most recent run, and are reset when `kmp_tor_run_main` is called; a
+ * phase which did not occur is 0 (e.g. `lib_open_ns` and `lib_resolve_ns`
+ * upon a warm restart).
+ **/
+typedef struct {
+  // Number of runs which reached KMP_TOR_STATE_STARTED.
+  uint64_t run_count;
+  // Monotonic timestamps of the most recent KMP_TOR_STATE_STARTED and
+  // KMP_TOR_STATE_STOPPED transitions.
+  uint64_t started_at_ns;
+  uint64_t stopped_at_ns;
+
+  // Loading the tor library (dlopen/LoadLibrary).
+  uint64_t lib_open_ns;
+  // Resolving the tor library's symbols.
+  uint64_t lib_resolve_ns;
+  // Setting up the controller socket and tor's configuration.
+  uint64_t configure_ns;
+  // Spawning tor's thread, up until KMP_TOR_STATE_STARTED.
+  uint64_t thread_start_ns;
+  // Time spent in tor's `tor_run_main`.
+  uint64_t run_main_ns;
+  // `tor_main_configuration_free` and `OPENSSL_cleanup` after tor's
+  // `tor_run_main` returned.
+  uint64_t cleanup_ns;
+  // Unloading the tor library (dlclose/FreeLibrary).
+  uint64_t lib_close_ns;
+  // Unloading a tor library image which was retained for a warm restart,
+  // upon its most recent release (see `kmp_tor_warm_restart`). Not reset
+  // by `kmp_tor_run_main`, as it is not a phase of any one run.
+  uint64_t warm_lib_close_ns;
+
+  // Number of times unloading the tor library failed, in which event the
+  // library remains loaded.
+  uint64_t lib_close_failures;
+  // Number of times unloading the tor library was attempted again after a
+  // first attempt failed.
+  uint64_t lib_close_retries;
+  // Most recent error (NUL terminated), or empty if none has occurred.
+  char last_error[KMP_TOR_STATS_ERROR_LEN];
+} kmp_tor_stats_t;
+
+/**
+ * Copies the current lifecycle instrumentation for ctx into `stats`.
+ *
+ * Returns -1 if ctx or stats is NULL, otherwise 0.
+ **/
+int kmp_tor_stats(kmp_tor_context_t *ctx, kmp_tor_stats_t *stats);
+
 /**
  * This MUST be called to release resources before calling `kmp_tor_run_main` again. It
  * should be called as soon as possible (i.e. when `kmp_tor_state` is `KMP_TOR_STATE_STOPPED`).
  *
+ * A tor library image is never cleaned up nor unloaded while any of tor's threads are still
+ * running (e.g. if tor exited without stopping them). It is instead left loaded, and can not
+ * be loaded again by any kmp_tor_context_t; `kmp_tor_stats` reports it as the last error.
+ * This applies equally to retained images released by `kmp_tor_warm_restart` and
+ * `kmp_tor_deinit`.
+ *
  * Returns -1 if state is `KMP_TOR_STATE_OFF` or ctx is NULL. Otherwise, will return whatever
  * `tor_run_main` completed with.
  **/
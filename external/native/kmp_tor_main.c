@@ -14,10 +14,49 @@
  * limitations under the License.
  **/
 
+
 /**
  * An alternative implementation of tor's src/app/main/tor_main.c,
  * specific to how kmp-tor-resource compiles tor.
- */
+ *
+ * On non-Windows hosts it also provides an optional fork-server mode,
+ * started via `tor --kmp-tor-fork-server /path/to/socket`. A single
+ * server process (exec'd and dynamically linked against libtor only
+ * once) listens on the given unix socket and forks a child per request,
+ * which calls tor_main + OPENSSL_cleanup exactly as main does. OpenSSL
+ * is initialized by the server before it accepts requests (see
+ * kmp_tor_fork_preinit), so children inherit it rather than each doing
+ * so from within tor_main.
+ *
+ * Each connection carries a single request (all integers are uint32_t
+ * or int32_t in host byte order):
+ *
+ *   client -> server
+ *     [magic][argc][envc][payload_len]
+ *       16 byte header. The message carrying it may also carry an
+ *       SCM_RIGHTS control message holding up to KMP_TOR_FORK_MAX_FDS
+ *       file descriptors, which are installed in the child as 0, 1, 2...
+ *       in the order received (typically stdin, stdout and stderr).
+ *     [payload]
+ *       argc NUL terminated arguments (argv[0] included), followed by
+ *       envc NUL terminated KEY=VALUE strings which become the child's
+ *       entire environment.
+ *
+ *   server -> client
+ *     [pid]
+ *       The child's pid, or a negative errno value if the request was
+ *       rejected, was not received in full within
+ *       KMP_TOR_FORK_REQUEST_TIMEOUT_MS (-ETIMEDOUT), or fork failed
+ *       (after which the server hangs up).
+ *     [result]
+ *       The child's exit code once it has exited, or 128 + signal if it
+ *       was killed, after which the server hangs up.
+ *
+ * If the client hangs up before the child exits, the child is sent
+ * SIGTERM. Upon receipt of SIGTERM or SIGINT the server stops accepting
+ * requests, sends SIGTERM to all remaining children, waits for them to
+ * exit and then removes the socket.
+ **/
 
 int tor_main(int argc, char *argv[]);
 
@@ -28,15 +67,783 @@ int tor_main(int argc, char *argv[]);
  */
 void OPENSSL_cleanup(void);
 
-int
-main(int argc, char *argv[])
+static int
+kmp_tor_main_result(int r)
 {
-  int r;
-  r = tor_main(argc, argv);
-  OPENSSL_cleanup();
   if (r < 0 || r > 255) {
     return 1;
   } else {
     return r;
   }
 }
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Exported by libtor (see exports/tor_api.map) so that the fork server
+ * can initialize OpenSSL once, before forking any children. When tor
+ * later calls it from within tor_main with the same options, it is a
+ * no-op. OpenSSL 3.x detects forks and reseeds its random generators
+ * in each child.
+ **/
+int OPENSSL_init_ssl(uint64_t opts, const void *settings);
+
+// The options tor's crypto_openssl_early_init passes to OPENSSL_init_ssl
+// (values from openssl/crypto.h and openssl/ssl.h).
+#define KMP_TOR_OPENSSL_INIT_LOAD_CRYPTO_STRINGS 0x00000002L
+#define KMP_TOR_OPENSSL_INIT_ADD_ALL_CIPHERS     0x00000004L
+#define KMP_TOR_OPENSSL_INIT_ADD_ALL_DIGESTS     0x00000008L
+#define KMP_TOR_OPENSSL_INIT_LOAD_SSL_STRINGS    0x00200000L
+
+#define KMP_TOR_FORK_SERVER_FLAG  "--kmp-tor-fork-server"
+
+#define KMP_TOR_FORK_MAGIC        0x4b544653 // KTFS
+#define KMP_TOR_FORK_MAX_FDS      16
+#define KMP_TOR_FORK_MAX_PAYLOAD  (1024 * 1024)
+#define KMP_TOR_FORK_BACKLOG      32
+
+// Milliseconds an accepted connection has to deliver its request in full.
+#ifndef KMP_TOR_FORK_REQUEST_TIMEOUT_MS
+#define KMP_TOR_FORK_REQUEST_TIMEOUT_MS (5 * 1000)
+#endif
+
+// Connections which may be delivering their request at once. Further
+// connections wait in the listen backlog until one completes.
+#define KMP_TOR_FORK_MAX_REQUESTS 16
+
+#ifdef MSG_NOSIGNAL
+#define KMP_TOR_FORK_SEND_FLAGS   MSG_NOSIGNAL
+#else
+#define KMP_TOR_FORK_SEND_FLAGS   0
+#endif
+
+extern char **environ;
+
+typedef struct {
+  pid_t pid;
+  int conn; // -1 after the client hung up
+} kmp_tor_fork_child_t;
+
+// A request being received on a (non-blocking) accepted connection.
+typedef struct {
+  int conn;
+  int64_t deadline_ms;
+  uint32_t header[4];
+  size_t header_len; // bytes of header received
+  int fds[KMP_TOR_FORK_MAX_FDS];
+  int nfds;
+  char *payload;
+  size_t payload_len; // bytes of payload received
+} kmp_tor_fork_request_t;
+
+typedef struct {
+  int listen_fd;
+  int sig_fds[2];
+  kmp_tor_fork_child_t *children;
+  int children_len;
+  int children_cap;
+  kmp_tor_fork_request_t requests[KMP_TOR_FORK_MAX_REQUESTS];
+  int requests_len;
+  // Laid out as the listening socket, the signal pipe, children (see
+  // kmp_tor_fork_track), then requests.
+  struct pollfd *pfds;
+} kmp_tor_fork_server_t;
+
+static volatile sig_atomic_t kmp_tor_fork_stop = 0;
+static int kmp_tor_fork_sig_write_fd = -1;
+
+static void
+kmp_tor_fork_on_signal(int sig)
+{
+  int saved_errno = errno;
+  char c = 0;
+
+  if (sig != SIGCHLD) {
+    kmp_tor_fork_stop = 1;
+  }
+  if (kmp_tor_fork_sig_write_fd != -1) {
+    // Non-blocking. If the pipe is full, a wakeup is already pending.
+    if (write(kmp_tor_fork_sig_write_fd, &c, 1) < 0) {}
+  }
+
+  errno = saved_errno;
+}
+
+static int64_t
+kmp_tor_fork_now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static void
+kmp_tor_fork_send_int(int fd, int32_t value)
+{
+  const char *p = (const char *) &value;
+  size_t len = sizeof(value);
+  while (len > 0) {
+    ssize_t r = send(fd, p, len, KMP_TOR_FORK_SEND_FLAGS);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return;
+    }
+    p += r;
+    len -= (size_t) r;
+  }
+}
+
+static void
+kmp_tor_fork_close_fds(int *fds, int nfds)
+{
+  for (int i = 0; i < nfds; i++) {
+    close(fds[i]);
+  }
+}
+
+/**
+ * Releases everything held by the request at index i, other than its
+ * connection, and removes it.
+ **/
+static void
+kmp_tor_fork_request_remove(kmp_tor_fork_server_t *server, int i)
+{
+  kmp_tor_fork_request_t *request = &server->requests[i];
+  kmp_tor_fork_close_fds(request->fds, request->nfds);
+  free(request->payload);
+  server->requests[i] = server->requests[--server->requests_len];
+}
+
+/**
+ * Replies to the request at index i with error, hangs up and removes it.
+ **/
+static void
+kmp_tor_fork_request_reject(kmp_tor_fork_server_t *server, int i, int32_t error)
+{
+  kmp_tor_fork_send_int(server->requests[i].conn, error);
+  close(server->requests[i].conn);
+  kmp_tor_fork_request_remove(server, i);
+}
+
+/**
+ * Receives (part of) the request header along with any file descriptors
+ * attached to it.
+ **/
+static ssize_t
+kmp_tor_fork_recv_header(kmp_tor_fork_request_t *request)
+{
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * KMP_TOR_FORK_MAX_FDS)];
+  } control;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  ssize_t r;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = ((char *) request->header) + request->header_len;
+  iov.iov_len = sizeof(request->header) - request->header_len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  r = recvmsg(request->conn, &msg, 0);
+  if (r <= 0) {
+    return r;
+  }
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+
+    int n = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    int *data = (int *) CMSG_DATA(cmsg);
+    for (int i = 0; i < n; i++) {
+      int fd;
+      memcpy(&fd, &data[i], sizeof(int));
+      if (request->nfds < KMP_TOR_FORK_MAX_FDS) {
+        request->fds[request->nfds++] = fd;
+      } else {
+        // More file descriptors were sent than are accepted.
+        close(fd);
+        msg.msg_flags |= MSG_CTRUNC;
+      }
+    }
+  }
+
+  if ((msg.msg_flags & MSG_CTRUNC) != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return r;
+}
+
+/**
+ * Receives whatever is available of the request without blocking.
+ *
+ * Returns 1 once the request has been received in full, 0 if more is
+ * yet to arrive, or a negative errno value to reject it with.
+ **/
+static int32_t
+kmp_tor_fork_request_recv(kmp_tor_fork_request_t *request)
+{
+  for (;;) {
+    ssize_t r;
+
+    if (request->header_len < sizeof(request->header)) {
+      r = kmp_tor_fork_recv_header(request);
+    } else if (request->payload_len < request->header[3]) {
+      r = recv(request->conn, request->payload + request->payload_len, request->header[3] - request->payload_len, 0);
+    } else {
+      return 1;
+    }
+
+    if (r == 0) {
+      return -EPIPE;
+    }
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      return -errno;
+    }
+
+    if (request->header_len < sizeof(request->header)) {
+      request->header_len += (size_t) r;
+      if (request->header_len < sizeof(request->header)) {
+        continue;
+      }
+
+      uint32_t argc = request->header[1];
+      uint32_t envc = request->header[2];
+      uint32_t len = request->header[3];
+      if (request->header[0] != KMP_TOR_FORK_MAGIC
+          || argc < 1
+          || len > KMP_TOR_FORK_MAX_PAYLOAD
+          || (uint64_t) argc + envc > len
+      ) {
+        return -EINVAL;
+      }
+
+      request->payload = malloc(len);
+      if (!request->payload) {
+        return -ENOMEM;
+      }
+    } else {
+      request->payload_len += (size_t) r;
+    }
+  }
+}
+
+/**
+ * Runs in the forked child. Never returns.
+ **/
+static void
+kmp_tor_fork_run_child(
+  kmp_tor_fork_server_t *server,
+  kmp_tor_fork_request_t *request,
+  int argc,
+  char **argv,
+  char **envp
+) {
+  int *fds = request->fds;
+  int nfds = request->nfds;
+  int r;
+
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGPIPE, SIG_DFL);
+
+  close(server->listen_fd);
+  close(server->sig_fds[0]);
+  close(server->sig_fds[1]);
+  for (int i = 0; i < server->children_len; i++) {
+    if (server->children[i].conn != -1) {
+      close(server->children[i].conn);
+    }
+  }
+  for (int i = 0; i < server->requests_len; i++) {
+    close(server->requests[i].conn);
+    if (&server->requests[i] != request) {
+      kmp_tor_fork_close_fds(server->requests[i].fds, server->requests[i].nfds);
+    }
+  }
+
+  // Move everything out of the way of 0..nfds-1 first, so that
+  // installing one descriptor cannot clobber another.
+  for (int i = 0; i < nfds; i++) {
+    int fd = fcntl(fds[i], F_DUPFD, nfds);
+    if (fd == -1) {
+      _exit(127);
+    }
+    close(fds[i]);
+    fds[i] = fd;
+  }
+  for (int i = 0; i < nfds; i++) {
+    if (dup2(fds[i], i) == -1) {
+      _exit(127);
+    }
+    close(fds[i]);
+  }
+
+  environ = envp;
+
+  r = tor_main(argc, argv);
+  OPENSSL_cleanup();
+  exit(kmp_tor_main_result(r));
+}
+
+static int
+kmp_tor_fork_track(kmp_tor_fork_server_t *server)
+{
+  if (server->children_len < server->children_cap) {
+    return 0;
+  }
+
+  int cap = server->children_cap == 0 ? 8 : server->children_cap * 2;
+  kmp_tor_fork_child_t *children = realloc(server->children, sizeof(kmp_tor_fork_child_t) * (size_t) cap);
+  if (!children) {
+    return -1;
+  }
+  server->children = children;
+
+  struct pollfd *pfds = realloc(server->pfds, sizeof(struct pollfd) * (size_t) (cap + 2 + KMP_TOR_FORK_MAX_REQUESTS));
+  if (!pfds) {
+    return -1;
+  }
+  server->pfds = pfds;
+  server->children_cap = cap;
+  return 0;
+}
+
+/**
+ * Forks the child for the fully received request at index i. Its
+ * connection is either handed off to the tracked child, or closed.
+ **/
+static void
+kmp_tor_fork_spawn(kmp_tor_fork_server_t *server, int i)
+{
+  kmp_tor_fork_request_t *request = &server->requests[i];
+  uint32_t argc = request->header[1];
+  uint32_t envc = request->header[2];
+  uint32_t len = request->header[3];
+  char *payload = request->payload;
+  char **ptrs = NULL;
+  int32_t error = -EINVAL;
+  pid_t pid;
+
+  // The payload must hold exactly argc + envc NUL terminated strings.
+  if (payload[len - 1] != '\0') {
+    goto reject;
+  }
+
+  ptrs = malloc(sizeof(char *) * ((size_t) argc + envc + 2));
+  if (!ptrs) {
+    error = -ENOMEM;
+    goto reject;
+  }
+
+  char **argv = ptrs;
+  char **envp = ptrs + argc + 1;
+  uint32_t n = 0;
+  for (uint32_t j = 0; j < len; n++) {
+    if (n == argc + envc) {
+      goto reject;
+    }
+    if (n < argc) {
+      argv[n] = payload + j;
+    } else {
+      envp[n - argc] = payload + j;
+    }
+    j += (uint32_t) strlen(payload + j) + 1;
+  }
+  if (n != argc + envc) {
+    goto reject;
+  }
+  argv[argc] = NULL;
+  envp[envc] = NULL;
+
+  // Ensure the child can be tracked before forking it.
+  if (kmp_tor_fork_track(server) != 0) {
+    error = -ENOMEM;
+    goto reject;
+  }
+
+  pid = fork();
+  if (pid == 0) {
+    kmp_tor_fork_run_child(server, request, (int) argc, argv, envp);
+  }
+  if (pid < 0) {
+    error = -errno;
+    goto reject;
+  }
+
+  free(ptrs);
+
+  server->children[server->children_len].pid = pid;
+  server->children[server->children_len].conn = request->conn;
+  server->children_len++;
+  kmp_tor_fork_send_int(request->conn, (int32_t) pid);
+  kmp_tor_fork_request_remove(server, i);
+  return;
+
+reject:
+  free(ptrs);
+  kmp_tor_fork_request_reject(server, i, error);
+}
+
+/**
+ * Starts receiving a request on the newly accepted connection.
+ **/
+static void
+kmp_tor_fork_accept(kmp_tor_fork_server_t *server, int conn)
+{
+  kmp_tor_fork_request_t *request;
+
+  fcntl(conn, F_SETFD, FD_CLOEXEC);
+  if (fcntl(conn, F_SETFL, fcntl(conn, F_GETFL) | O_NONBLOCK) == -1) {
+    close(conn);
+    return;
+  }
+
+  request = &server->requests[server->requests_len++];
+  memset(request, 0, sizeof(kmp_tor_fork_request_t));
+  request->conn = conn;
+  request->deadline_ms = kmp_tor_fork_now_ms() + KMP_TOR_FORK_REQUEST_TIMEOUT_MS;
+}
+
+/**
+ * Progresses the requests at indices [0, n), whose poll results begin
+ * at pfds_offset. Those which are complete are forked, and those which
+ * failed or whose deadline passed are rejected.
+ **/
+static void
+kmp_tor_fork_requests(kmp_tor_fork_server_t *server, int pfds_offset, int n)
+{
+  int64_t now = kmp_tor_fork_now_ms();
+
+  // Backwards, as removal moves the last request into the removed one's
+  // place. Poll results are looked up each time as spawning may grow pfds.
+  for (int i = n - 1; i >= 0; i--) {
+    int32_t result = 0;
+    if ((server->pfds[pfds_offset + i].revents & (POLLIN | POLLHUP | POLLERR)) != 0) {
+      result = kmp_tor_fork_request_recv(&server->requests[i]);
+    }
+    if (result == 1) {
+      kmp_tor_fork_spawn(server, i);
+    } else if (result < 0) {
+      kmp_tor_fork_request_reject(server, i, result);
+    } else if (now >= server->requests[i].deadline_ms) {
+      kmp_tor_fork_request_reject(server, i, -ETIMEDOUT);
+    }
+  }
+}
+
+/**
+ * Milliseconds until the soonest request deadline, or -1 if there are
+ * no requests.
+ **/
+static int
+kmp_tor_fork_poll_timeout(kmp_tor_fork_server_t *server)
+{
+  int64_t now;
+  int64_t timeout = -1;
+
+  if (server->requests_len == 0) {
+    return -1;
+  }
+
+  now = kmp_tor_fork_now_ms();
+  for (int i = 0; i < server->requests_len; i++) {
+    int64_t remaining = server->requests[i].deadline_ms - now;
+    if (remaining < 0) {
+      remaining = 0;
+    }
+    if (timeout == -1 || remaining < timeout) {
+      timeout = remaining;
+    }
+  }
+  return (int) timeout;
+}
+
+/**
+ * Initializes what every child would otherwise initialize on its own,
+ * before any are forked.
+ **/
+static void
+kmp_tor_fork_preinit(void)
+{
+  if (OPENSSL_init_ssl(
+        KMP_TOR_OPENSSL_INIT_LOAD_SSL_STRINGS
+        | KMP_TOR_OPENSSL_INIT_LOAD_CRYPTO_STRINGS
+        | KMP_TOR_OPENSSL_INIT_ADD_ALL_CIPHERS
+        | KMP_TOR_OPENSSL_INIT_ADD_ALL_DIGESTS,
+        NULL
+      ) != 1) {
+    // Not fatal. tor will try again (and fail properly) in each child.
+    fprintf(stderr, "kmp-tor-fork-server: OPENSSL_init_ssl failed\n");
+  }
+}
+
+static void
+kmp_tor_fork_reaped(kmp_tor_fork_server_t *server, pid_t pid, int status)
+{
+  int32_t result;
+
+  if (WIFEXITED(status)) {
+    result = WEXITSTATUS(status);
+  } else if (WIFSIGNALED(status)) {
+    result = 128 + WTERMSIG(status);
+  } else {
+    return;
+  }
+
+  for (int i = 0; i < server->children_len; i++) {
+    if (server->children[i].pid != pid) {
+      continue;
+    }
+    if (server->children[i].conn != -1) {
+      kmp_tor_fork_send_int(server->children[i].conn, result);
+      close(server->children[i].conn);
+    }
+    server->children[i] = server->children[--server->children_len];
+    return;
+  }
+}
+
+static void
+kmp_tor_fork_reap(kmp_tor_fork_server_t *server)
+{
+  int status;
+  pid_t pid;
+
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    kmp_tor_fork_reaped(server, pid, status);
+  }
+}
+
+static int
+kmp_tor_fork_listen(const char *path)
+{
+  struct sockaddr_un addr;
+  mode_t mask;
+  int fd;
+  int r;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "kmp-tor-fork-server: socket path too long[%s]\n", path);
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    fprintf(stderr, "kmp-tor-fork-server: socket failed: %s\n", strerror(errno));
+    return -1;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  // Only the owning user may submit requests.
+  mask = umask(077);
+  r = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+  if (r == -1 && errno == EADDRINUSE) {
+    // Replace the socket only if it was left behind by a dead server.
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe != -1) {
+      if (connect(probe, (struct sockaddr *) &addr, sizeof(addr)) == -1 && errno == ECONNREFUSED) {
+        unlink(path);
+        r = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+      } else {
+        errno = EADDRINUSE;
+      }
+      close(probe);
+    }
+  }
+  umask(mask);
+
+  if (r == -1 || listen(fd, KMP_TOR_FORK_BACKLOG) == -1) {
+    fprintf(stderr, "kmp-tor-fork-server: failed to listen on[%s]: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int
+kmp_tor_fork_server(const char *path)
+{
+  kmp_tor_fork_server_t server;
+  struct sigaction sa;
+  int status;
+
+  memset(&server, 0, sizeof(server));
+  server.sig_fds[0] = -1;
+  server.sig_fds[1] = -1;
+
+  // Before listening, so that the socket only appears once the server
+  // is ready to fork.
+  kmp_tor_fork_preinit();
+
+  server.listen_fd = kmp_tor_fork_listen(path);
+  if (server.listen_fd == -1) {
+    return 1;
+  }
+
+  if (pipe(server.sig_fds) == -1 || kmp_tor_fork_track(&server) != 0) {
+    fprintf(stderr, "kmp-tor-fork-server: failed to initialize: %s\n", strerror(errno));
+    close(server.listen_fd);
+    unlink(path);
+    return 1;
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(server.sig_fds[i], F_SETFD, FD_CLOEXEC);
+    fcntl(server.sig_fds[i], F_SETFL, fcntl(server.sig_fds[i], F_GETFL) | O_NONBLOCK);
+  }
+  kmp_tor_fork_sig_write_fd = server.sig_fds[1];
+
+  memset(&sa, 0, sizeof(sa));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_handler = kmp_tor_fork_on_signal;
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &sa, NULL);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  while (!kmp_tor_fork_stop) {
+    int npfds = 2;
+    int children_len = server.children_len;
+    int requests_len = server.requests_len;
+
+    // Connections beyond KMP_TOR_FORK_MAX_REQUESTS wait in the backlog.
+    server.pfds[0].fd = requests_len < KMP_TOR_FORK_MAX_REQUESTS ? server.listen_fd : -1;
+    server.pfds[0].events = POLLIN;
+    server.pfds[1].fd = server.sig_fds[0];
+    server.pfds[1].events = POLLIN;
+    for (int i = 0; i < server.children_len; i++) {
+      // Still polled after hangup (as -1, which poll ignores) so
+      // indices continue to line up with children.
+      server.pfds[npfds].fd = server.children[i].conn;
+      server.pfds[npfds].events = POLLIN;
+      npfds++;
+    }
+    for (int i = 0; i < requests_len; i++) {
+      server.pfds[npfds].fd = server.requests[i].conn;
+      server.pfds[npfds].events = POLLIN;
+      npfds++;
+    }
+
+    if (poll(server.pfds, (nfds_t) npfds, kmp_tor_fork_poll_timeout(&server)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "kmp-tor-fork-server: poll failed: %s\n", strerror(errno));
+      break;
+    }
+
+    // Clients are only expected to hang up. Anything else is discarded.
+    for (int i = 0; i < children_len; i++) {
+      if (server.children[i].conn == -1 || (server.pfds[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) == 0) {
+        continue;
+      }
+      char buf[64];
+      ssize_t r = recv(server.children[i].conn, buf, sizeof(buf), MSG_DONTWAIT);
+      if (r == 0 || (r < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        kill(server.children[i].pid, SIGTERM);
+        close(server.children[i].conn);
+        server.children[i].conn = -1;
+      }
+    }
+
+    kmp_tor_fork_requests(&server, 2 + children_len, requests_len);
+
+    if ((server.pfds[1].revents & POLLIN) != 0) {
+      char buf[64];
+      while (read(server.sig_fds[0], buf, sizeof(buf)) > 0) {}
+      kmp_tor_fork_reap(&server);
+    }
+
+    if ((server.pfds[0].revents & POLLIN) != 0 && !kmp_tor_fork_stop) {
+      int conn = accept(server.listen_fd, NULL, NULL);
+      if (conn != -1) {
+        kmp_tor_fork_accept(&server, conn);
+      }
+    }
+  }
+
+  close(server.listen_fd);
+  unlink(path);
+
+  while (server.requests_len > 0) {
+    close(server.requests[0].conn);
+    kmp_tor_fork_request_remove(&server, 0);
+  }
+
+  for (int i = 0; i < server.children_len; i++) {
+    kill(server.children[i].pid, SIGTERM);
+  }
+  while (server.children_len > 0) {
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    kmp_tor_fork_reaped(&server, pid, status);
+  }
+
+  kmp_tor_fork_sig_write_fd = -1;
+  close(server.sig_fds[0]);
+  close(server.sig_fds[1]);
+  free(server.children);
+  free(server.pfds);
+  return 0;
+}
+#endif // !_WIN32
+
+int
+main(int argc, char *argv[])
+{
+  int r;
+
+#ifndef _WIN32
+  if (argc == 3 && strcmp(argv[1], KMP_TOR_FORK_SERVER_FLAG) == 0) {
+    return kmp_tor_fork_server(argv[2]);
+  }
+#endif // !_WIN32
+
+  r = tor_main(argc, argv);
+  OPENSSL_cleanup();
+  return kmp_tor_main_result(r);
+}
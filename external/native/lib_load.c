@@ -16,10 +16,10 @@
 #include "lib_load.h"
 
 #include <assert.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <unistd.h>
 
 #ifdef __ANDROID__
 #include <android/log.h>
@@ -44,6 +44,29 @@ struct lib_handle_t {
 };
 #endif // _WIN32
 
+#define LIB_LOAD_ERR_LEN 256
+
+static __thread char lib_load_err[LIB_LOAD_ERR_LEN];
+static __thread int lib_load_err_is_set = 0;
+
+static void
+lib_load_report(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  vsnprintf(lib_load_err, sizeof(lib_load_err), format, args);
+  va_end(args);
+  lib_load_err_is_set = 1;
+  fprintf(stderr, "KmpTor: %s\n", lib_load_err);
+}
+
+static void
+lib_load_report_clear(void)
+{
+  lib_load_err[0] = 0;
+  lib_load_err_is_set = 0;
+}
+
 static void
 lib_load_assert(lib_handle_t *handle_t)
 {
@@ -108,13 +131,15 @@ lib_load_free(lib_handle_t *handle_t)
 lib_handle_t *
 lib_load_open(const char *lib)
 {
+  lib_load_report_clear();
   if (!lib) {
+    lib_load_report("lib cannot be NULL");
     return NULL;
   }
 
   lib_handle_t *handle_t = malloc(sizeof(lib_handle_t));
   if (!handle_t) {
-    fprintf(stderr, "KmpTor: Failed to allocate memory to lib_handle_t for lib[%s]\n", lib);
+    lib_load_report("Failed to allocate memory to lib_handle_t for lib[%s]", lib);
     return NULL;
   } else {
     handle_t->lib = NULL;
@@ -126,7 +151,7 @@ lib_load_open(const char *lib)
 
   handle_t->lib = strdup(lib);
   if (!handle_t->lib) {
-    fprintf(stderr, "KmpTor: Failed to allocate memory to lib_handle_t.lib for lib[%s]\n", lib);
+    lib_load_report("Failed to allocate memory to lib_handle_t.lib for lib[%s]", lib);
     lib_load_free(handle_t);
     handle_t = NULL;
     return NULL;
@@ -135,7 +160,7 @@ lib_load_open(const char *lib)
 
   handle_t->err_buf = malloc(2048 * sizeof(char *));
   if (!handle_t->err_buf) {
-    fprintf(stderr, "KmpTor: Failed to allocate memory to lib_handle_t.err_buf for lib[%s]\n", lib);
+    lib_load_report("Failed to allocate memory to lib_handle_t.err_buf for lib[%s]", lib);
     lib_load_free(handle_t);
     handle_t = NULL;
     return NULL;
@@ -147,6 +172,7 @@ lib_load_open(const char *lib)
 
   len = MultiByteToWideChar(CP_THREAD_ACP, 0, handle_t->lib, -1, NULL, 0);
   if (len == 0) {
+    lib_load_report("Failed to convert lib[%s] to a wide string", lib);
     lib_load_free(handle_t);
     handle_t = NULL;
     return NULL;
@@ -154,6 +180,7 @@ lib_load_open(const char *lib)
 
   w_lib = malloc(len * sizeof(*w_lib));
   if (!w_lib) {
+    lib_load_report("Failed to allocate memory to the wide string of lib[%s]", lib);
     lib_load_free(handle_t);
     handle_t = NULL;
     return NULL;
@@ -180,7 +207,7 @@ lib_load_open(const char *lib)
 
   if (!handle_t->handle) {
     char *err = lib_load_error(handle_t);
-    fprintf(stderr, "KmpTor: Failed to open lib[%s] - error[%s]\n", handle_t->lib, err);
+    lib_load_report("Failed to open lib[%s] - error[%s]", handle_t->lib, err);
     lib_load_free(handle_t);
     handle_t = NULL;
     return NULL;
@@ -192,6 +219,7 @@ lib_load_open(const char *lib)
 void *
 lib_load_resolve(lib_handle_t *handle_t, const char *symbol)
 {
+  lib_load_report_clear();
   lib_load_assert(handle_t);
   void *ptr = NULL;
 
@@ -203,49 +231,53 @@ lib_load_resolve(lib_handle_t *handle_t, const char *symbol)
 
   if (!ptr) {
     char *err = lib_load_error(handle_t);
-    fprintf(stderr, "KmpTor: Failed to resolve symbol[%s] - error[%s]\n", symbol, err);
+    lib_load_report("Failed to resolve symbol[%s] - error[%s]", symbol, err);
   }
 
   return ptr;
 }
 
 int
-lib_load_close(lib_handle_t *handle_t)
+lib_load_close(lib_handle_t *handle_t, int *attempts)
 {
+  lib_load_report_clear();
   lib_load_assert(handle_t);
 
   int result = -1;
-  char *err = NULL;
-
-  for (int i = 0; i < 5; i++) {
-    if (i > 0) {
-      // Exponential back off before trying again
-      usleep((useconds_t) i * 1000);
-    }
 
+  // Callers only close the handle once nothing is executing within the
+  // library, so a failure here is not transient and is not retried.
 #ifdef _WIN32
-    // FreeLibrary returns 0 on failure
-    if (FreeLibrary(handle_t->handle) == 0) {
-      result = -1;
-    } else {
-      result = 0;
-    }
+  // FreeLibrary returns 0 on failure
+  if (FreeLibrary(handle_t->handle) == 0) {
+    result = -1;
+  } else {
+    result = 0;
+  }
 #else
-    result = dlclose(handle_t->handle);
+  result = dlclose(handle_t->handle);
 #endif // _WIN32
 
-    if (result == 0) {
-      break;
-    } else {
-      err = lib_load_error(handle_t);
-    }
+  if (attempts) {
+    *attempts = 1;
   }
 
   if (result != 0) {
-    fprintf(stderr, "KmpTor: Failed to close handle[%s] - error[%s]\n", handle_t->lib, err);
+    char *err = lib_load_error(handle_t);
+    lib_load_report("Failed to close handle[%s] - error[%s]", handle_t->lib, err);
   }
 
   handle_t->handle = NULL;
   lib_load_free(handle_t);
   return result;
 }
+
+const char *
+lib_load_last_error(void)
+{
+  if (!lib_load_err_is_set) {
+    return NULL;
+  }
+  lib_load_err_is_set = 0;
+  return lib_load_err;
+}
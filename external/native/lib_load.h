@@ -23,6 +23,20 @@ lib_handle_t *lib_load_open(const char *lib);
 
 void *lib_load_resolve(lib_handle_t *handle_t, const char *symbol);
 
-int lib_load_close(lib_handle_t *handle_t);
+/**
+ * Unloads the library and frees handle_t, regardless of the result. If
+ * attempts is not NULL, it is set to the number of times unloading was
+ * attempted.
+ **/
+int lib_load_close(lib_handle_t *handle_t, int *attempts);
+
+/**
+ * Returns a description of the failure of the most recent lib_load_open,
+ * lib_load_resolve or lib_load_close call on the calling thread, or NULL
+ * if it succeeded. Each of those calls clears it upon entry, and like
+ * dlerror, so does this. The returned string is valid until the next
+ * lib_load call on the calling thread.
+ **/
+const char *lib_load_last_error(void);
 
 #endif /* !defined(LIB_LOAD_H) */
@@ -0,0 +1,570 @@
+/*
+ * Copyright (c) 2025 Matthew Nelson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+/**
+ * Protocol test for the fork-server mode of kmp_tor_main.c (see the
+ * request/response description at the top of that file).
+ *
+ * Starts the given `tor` executable (kmp_tor_main.c linked with
+ * tor_main_stub.c) as a fork server on a socket in a temporary
+ * directory, runs each test case against it as a client, then stops it
+ * with SIGTERM. The executable is expected to have been compiled with a
+ * KMP_TOR_FORK_REQUEST_TIMEOUT_MS of TEST_REQUEST_TIMEOUT_MS.
+ *
+ * Usage: kmp_tor_main_test /path/to/tor
+ **/
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TEST_MAGIC              0x4b544653 // KTFS, KMP_TOR_FORK_MAGIC
+#define TEST_MAX_FDS            16         // KMP_TOR_FORK_MAX_FDS
+#define TEST_REQUEST_TIMEOUT_MS 500
+#define TEST_AWAIT_MS           10000
+
+#define CHECK(cond) do {                                              \
+  if (!(cond)) {                                                      \
+    fprintf(stderr, "    %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+    return -1;                                                        \
+  }                                                                   \
+} while (0)
+
+static char test_socket_path[256];
+
+static int64_t
+test_now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static int
+test_connect(void)
+{
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, test_socket_path);
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Waits up to timeout_ms for fd to become readable. Returns 1 if it
+ * did, otherwise 0.
+ **/
+static int
+test_await_readable(int fd, int timeout_ms)
+{
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  int r;
+  do {
+    r = poll(&pfd, 1, timeout_ms);
+  } while (r < 0 && errno == EINTR);
+  return r == 1;
+}
+
+/**
+ * Reads the next int32_t from the server. Returns 0 on success, or -1 if
+ * the server hung up (or nothing arrived within TEST_AWAIT_MS).
+ **/
+static int
+test_read_int(int conn, int32_t *value)
+{
+  char *p = (char *) value;
+  size_t len = sizeof(int32_t);
+  while (len > 0) {
+    if (!test_await_readable(conn, TEST_AWAIT_MS)) {
+      return -1;
+    }
+    ssize_t r = recv(conn, p, len, 0);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return -1;
+    }
+    p += r;
+    len -= (size_t) r;
+  }
+  return 0;
+}
+
+/**
+ * Builds a request into buf (of size cap), returning its length.
+ **/
+static size_t
+test_build(char *buf, size_t cap, const char **args, int argc, const char **env, int envc)
+{
+  uint32_t h[4] = { TEST_MAGIC, (uint32_t) argc, (uint32_t) envc, 0 };
+  size_t len = sizeof(h);
+
+  for (int i = 0; i < argc + envc; i++) {
+    const char *s = i < argc ? args[i] : env[i - argc];
+    size_t n = strlen(s) + 1;
+    if (len + n > cap) {
+      abort();
+    }
+    memcpy(buf + len, s, n);
+    len += n;
+  }
+
+  h[3] = (uint32_t) (len - sizeof(h));
+  memcpy(buf, h, sizeof(h));
+  return len;
+}
+
+/**
+ * Sends len bytes of buf, attaching fds to the first byte. If trickle is
+ * non-zero, each byte is sent separately with a delay in between.
+ **/
+static int
+test_send(int conn, const char *buf, size_t len, const int *fds, int nfds, int trickle)
+{
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * (TEST_MAX_FDS + 1))];
+  } control;
+  struct iovec iov;
+  struct msghdr msg;
+  size_t sent = 0;
+
+  while (sent < len) {
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *) (buf + sent);
+    iov.iov_len = trickle ? 1 : len - sent;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (sent == 0 && nfds > 0) {
+      memset(&control, 0, sizeof(control));
+      msg.msg_control = control.buf;
+      msg.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t) nfds);
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t) nfds);
+      memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (size_t) nfds);
+    }
+
+    ssize_t r = sendmsg(conn, &msg, 0);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return -1;
+    }
+    sent += (size_t) r;
+    if (trickle) {
+      usleep(1000);
+    }
+  }
+  return 0;
+}
+
+/**
+ * Runs a request to completion, returning the child's result in result.
+ * If out is non-NULL, the child's stdout is read into it.
+ **/
+static int
+test_run(const char **args, int argc, const char **env, int envc, char *out, size_t out_cap, int32_t *result)
+{
+  char buf[1024];
+  int pipe_fds[2];
+  int32_t pid;
+
+  if (pipe(pipe_fds) == -1) {
+    return -1;
+  }
+  int fds[3] = { STDIN_FILENO, pipe_fds[1], STDERR_FILENO };
+
+  int conn = test_connect();
+  CHECK(conn != -1);
+  size_t len = test_build(buf, sizeof(buf), args, argc, env, envc);
+  CHECK(test_send(conn, buf, len, fds, 3, 0) == 0);
+  close(pipe_fds[1]);
+
+  CHECK(test_read_int(conn, &pid) == 0);
+  CHECK(pid > 0);
+  CHECK(test_read_int(conn, result) == 0);
+  close(conn);
+
+  if (out) {
+    size_t n = 0;
+    ssize_t r;
+    while (n + 1 < out_cap && (r = read(pipe_fds[0], out + n, out_cap - n - 1)) > 0) {
+      n += (size_t) r;
+    }
+    out[n] = '\0';
+  }
+  close(pipe_fds[0]);
+  return 0;
+}
+
+/**
+ * Sends the given raw request and expects it to be rejected with error.
+ **/
+static int
+test_expect_rejected(const char *buf, size_t len, const int *fds, int nfds, int32_t error)
+{
+  int32_t pid;
+  int conn = test_connect();
+  CHECK(conn != -1);
+  CHECK(test_send(conn, buf, len, fds, nfds, 0) == 0);
+  CHECK(test_read_int(conn, &pid) == 0);
+  CHECK(pid == error);
+  CHECK(test_read_int(conn, &pid) == -1);
+  close(conn);
+  return 0;
+}
+
+static int
+test_passes_args_env_and_fds(void)
+{
+  const char *args[] = { "tor", "echo", "a", "b c" };
+  const char *env[] = { "KMP_TOR_TEST=abc" };
+  char out[256];
+  int32_t result = -1;
+
+  CHECK(test_run(args, 4, env, 1, out, sizeof(out), &result) == 0);
+  CHECK(result == 0);
+  // init_count of 1 shows OpenSSL was initialized by the server, pre-fork
+  CHECK(strcmp(out, "a b c|abc|1\n") == 0);
+  return 0;
+}
+
+static int
+test_replaces_environment(void)
+{
+  const char *args[] = { "tor", "echo" };
+  char out[256];
+  int32_t result = -1;
+
+  setenv("KMP_TOR_TEST", "leaked", 1);
+  CHECK(test_run(args, 2, NULL, 0, out, sizeof(out), &result) == 0);
+  unsetenv("KMP_TOR_TEST");
+  CHECK(result == 0);
+  CHECK(strcmp(out, "||1\n") == 0);
+  return 0;
+}
+
+static int
+test_exit_codes(void)
+{
+  const char *exit7[] = { "tor", "exit", "7" };
+  const char *exit300[] = { "tor", "exit", "300" };
+  const char *killed[] = { "tor", "kill" };
+  int32_t result = -1;
+
+  CHECK(test_run(exit7, 3, NULL, 0, NULL, 0, &result) == 0);
+  CHECK(result == 7);
+  CHECK(test_run(exit300, 3, NULL, 0, NULL, 0, &result) == 0);
+  CHECK(result == 1);
+  CHECK(test_run(killed, 2, NULL, 0, NULL, 0, &result) == 0);
+  CHECK(result == 128 + SIGKILL);
+  return 0;
+}
+
+static int
+test_rejects_malformed(void)
+{
+  const char *args[] = { "tor", "exit", "0" };
+  char buf[256];
+  uint32_t header[4];
+  size_t len;
+
+  len = test_build(buf, sizeof(buf), args, 3, NULL, 0);
+
+  // Bad magic
+  memcpy(header, buf, sizeof(header));
+  header[0] = 0;
+  memcpy(buf, header, sizeof(header));
+  CHECK(test_expect_rejected(buf, len, NULL, 0, -EINVAL) == 0);
+
+  // No argv[0]
+  header[0] = TEST_MAGIC;
+  header[1] = 0;
+  header[2] = 3;
+  memcpy(buf, header, sizeof(header));
+  CHECK(test_expect_rejected(buf, len, NULL, 0, -EINVAL) == 0);
+
+  // More strings than argc + envc
+  header[1] = 2;
+  header[2] = 0;
+  memcpy(buf, header, sizeof(header));
+  CHECK(test_expect_rejected(buf, len, NULL, 0, -EINVAL) == 0);
+
+  // Fewer strings than argc + envc
+  header[1] = 3;
+  header[2] = 1;
+  memcpy(buf, header, sizeof(header));
+  CHECK(test_expect_rejected(buf, len, NULL, 0, -EINVAL) == 0);
+
+  // Payload not NUL terminated
+  header[2] = 0;
+  memcpy(buf, header, sizeof(header));
+  buf[len - 1] = 'x';
+  CHECK(test_expect_rejected(buf, len, NULL, 0, -EINVAL) == 0);
+
+  // Payload too large
+  len = test_build(buf, sizeof(buf), args, 3, NULL, 0);
+  memcpy(header, buf, sizeof(header));
+  header[3] = (1024 * 1024) + 1;
+  memcpy(buf, header, sizeof(header));
+  CHECK(test_expect_rejected(buf, len, NULL, 0, -EINVAL) == 0);
+
+  // Too many file descriptors
+  int fds[TEST_MAX_FDS + 1];
+  for (int i = 0; i < TEST_MAX_FDS + 1; i++) {
+    fds[i] = STDERR_FILENO;
+  }
+  len = test_build(buf, sizeof(buf), args, 3, NULL, 0);
+  CHECK(test_expect_rejected(buf, len, fds, TEST_MAX_FDS + 1, -EINVAL) == 0);
+  return 0;
+}
+
+static int
+test_trickled_request(void)
+{
+  const char *args[] = { "tor", "exit", "3" };
+  int fds[1] = { STDERR_FILENO };
+  char buf[256];
+  int32_t pid;
+  int32_t result;
+
+  int conn = test_connect();
+  CHECK(conn != -1);
+  size_t len = test_build(buf, sizeof(buf), args, 3, NULL, 0);
+  CHECK(test_send(conn, buf, len, fds, 1, 1) == 0);
+  CHECK(test_read_int(conn, &pid) == 0);
+  CHECK(pid > 0);
+  CHECK(test_read_int(conn, &result) == 0);
+  CHECK(result == 3);
+  close(conn);
+  return 0;
+}
+
+static int
+test_slow_client_does_not_stall_others(void)
+{
+  const char *args[] = { "tor", "exit", "0" };
+  char buf[256];
+  int32_t error;
+  int32_t result = -1;
+
+  // Connects and delivers part of its header, then nothing.
+  int slow = test_connect();
+  CHECK(slow != -1);
+  test_build(buf, sizeof(buf), args, 3, NULL, 0);
+  CHECK(test_send(slow, buf, 3, NULL, 0, 0) == 0);
+
+  // Another slow client which does not deliver anything at all.
+  int silent = test_connect();
+  CHECK(silent != -1);
+
+  int64_t start = test_now_ms();
+  CHECK(test_run(args, 3, NULL, 0, NULL, 0, &result) == 0);
+  CHECK(result == 0);
+  CHECK(test_now_ms() - start < TEST_REQUEST_TIMEOUT_MS);
+
+  CHECK(test_read_int(slow, &error) == 0);
+  CHECK(error == -ETIMEDOUT);
+  CHECK(test_read_int(silent, &error) == 0);
+  CHECK(error == -ETIMEDOUT);
+  CHECK(test_now_ms() - start >= TEST_REQUEST_TIMEOUT_MS);
+  close(slow);
+  close(silent);
+  return 0;
+}
+
+static int
+test_hangup_terminates_child(void)
+{
+  const char *args[] = { "tor", "block" };
+  char buf[256];
+  int stdin_fds[2];
+  int stdout_fds[2];
+  int32_t pid;
+
+  CHECK(pipe(stdin_fds) == 0);
+  CHECK(pipe(stdout_fds) == 0);
+  int fds[2] = { stdin_fds[0], stdout_fds[1] };
+
+  int conn = test_connect();
+  CHECK(conn != -1);
+  size_t len = test_build(buf, sizeof(buf), args, 2, NULL, 0);
+  CHECK(test_send(conn, buf, len, fds, 2, 0) == 0);
+  close(stdin_fds[0]);
+  close(stdout_fds[1]);
+  CHECK(test_read_int(conn, &pid) == 0);
+  CHECK(pid > 0);
+
+  // Still blocked on stdin (whose write end is held open here)
+  CHECK(!test_await_readable(stdout_fds[0], 100));
+
+  close(conn);
+
+  // Terminated, so its stdout reaches EOF
+  CHECK(test_await_readable(stdout_fds[0], TEST_AWAIT_MS));
+  CHECK(read(stdout_fds[0], buf, sizeof(buf)) == 0);
+  close(stdout_fds[0]);
+  close(stdin_fds[1]);
+  return 0;
+}
+
+static int
+test_concurrent_requests(void)
+{
+  const char *args[] = { "tor", "exit", NULL };
+  char codes[32][4];
+  char buf[256];
+  int conns[32];
+
+  for (int i = 0; i < 32; i++) {
+    snprintf(codes[i], sizeof(codes[i]), "%d", i);
+    args[2] = codes[i];
+    conns[i] = test_connect();
+    CHECK(conns[i] != -1);
+    size_t len = test_build(buf, sizeof(buf), args, 3, NULL, 0);
+    CHECK(test_send(conns[i], buf, len, NULL, 0, 0) == 0);
+  }
+
+  for (int i = 0; i < 32; i++) {
+    int32_t pid;
+    int32_t result;
+    CHECK(test_read_int(conns[i], &pid) == 0);
+    CHECK(pid > 0);
+    CHECK(test_read_int(conns[i], &result) == 0);
+    CHECK(result == i);
+    close(conns[i]);
+  }
+  return 0;
+}
+
+typedef struct {
+  const char *name;
+  int (*run)(void);
+} test_case_t;
+
+static const test_case_t test_cases[] = {
+  { "passes_args_env_and_fds",           test_passes_args_env_and_fds },
+  { "replaces_environment",              test_replaces_environment },
+  { "exit_codes",                        test_exit_codes },
+  { "rejects_malformed",                 test_rejects_malformed },
+  { "trickled_request",                  test_trickled_request },
+  { "slow_client_does_not_stall_others", test_slow_client_does_not_stall_others },
+  { "hangup_terminates_child",           test_hangup_terminates_child },
+  { "concurrent_requests",               test_concurrent_requests },
+};
+
+int
+main(int argc, char *argv[])
+{
+  char dir[] = "/tmp/kmp_tor_main_test.XXXXXX";
+  struct stat st;
+  int failures = 0;
+  int status;
+
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s /path/to/tor\n", argv[0]);
+    return 2;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if (!mkdtemp(dir)) {
+    fprintf(stderr, "mkdtemp failed: %s\n", strerror(errno));
+    return 1;
+  }
+  snprintf(test_socket_path, sizeof(test_socket_path), "%s/fork.sock", dir);
+
+  pid_t server = fork();
+  if (server == 0) {
+    execl(argv[1], argv[1], "--kmp-tor-fork-server", test_socket_path, (char *) NULL);
+    _exit(127);
+  }
+  if (server < 0) {
+    fprintf(stderr, "fork failed: %s\n", strerror(errno));
+    rmdir(dir);
+    return 1;
+  }
+
+  // The socket only appears once the server is ready.
+  int64_t start = test_now_ms();
+  int conn;
+  while ((conn = test_connect()) == -1 && test_now_ms() - start < TEST_AWAIT_MS) {
+    usleep(10 * 1000);
+  }
+  if (conn == -1) {
+    fprintf(stderr, "fork server did not start\n");
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+    rmdir(dir);
+    return 1;
+  }
+  close(conn);
+
+  if (stat(test_socket_path, &st) != 0 || (st.st_mode & 077) != 0) {
+    printf("FAIL socket_permissions\n");
+    failures++;
+  }
+
+  for (size_t i = 0; i < sizeof(test_cases) / sizeof(test_cases[0]); i++) {
+    if (test_cases[i].run() == 0) {
+      printf("PASS %s\n", test_cases[i].name);
+    } else {
+      printf("FAIL %s\n", test_cases[i].name);
+      failures++;
+    }
+  }
+
+  kill(server, SIGTERM);
+  while (waitpid(server, &status, 0) == -1 && errno == EINTR) {}
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    printf("FAIL shutdown\n");
+    failures++;
+  } else if (access(test_socket_path, F_OK) == 0) {
+    printf("FAIL shutdown (socket not removed)\n");
+    unlink(test_socket_path);
+    failures++;
+  } else {
+    printf("PASS shutdown\n");
+  }
+  rmdir(dir);
+
+  printf("%d failure(s)\n", failures);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,470 @@
+/*
+ * Copyright (c) 2025 Matthew Nelson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+/**
+ * Lifecycle test for kmp_tor.c, run against the stub libtor (see
+ * bench/tor_api_stub.c).
+ *
+ * Each test case runs its own copies of the stub library, copied into a
+ * temporary directory, as a library file which is left loaded can never
+ * be loaded again by any kmp_tor_context_t.
+ *
+ * Usage: kmp_tor_test /path/to/libtor_stub
+ **/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "../kmp_tor.h"
+#include "../bench/tor_api_stub.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHECK(cond) do {                                              \
+  if (!(cond)) {                                                      \
+    fprintf(stderr, "    %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+    return -1;                                                        \
+  }                                                                   \
+} while (0)
+
+static const char *test_stub_path = NULL;
+static char test_dir[] = "/tmp/kmp_tor_test.XXXXXX";
+static int test_lib_count = 0;
+
+static int test_stamps[TOR_API_STUB_STAMP_COUNT];
+static int test_threads_unjoined = 0;
+
+// Looked up by the stub library, see tor_api_stub.h
+void
+tor_api_stub_stamp(int stamp)
+{
+  if (stamp >= 0 && stamp < TOR_API_STUB_STAMP_COUNT) {
+    __atomic_add_fetch(&test_stamps[stamp], 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+int
+tor_api_stub_threads_unjoined(void)
+{
+  return __atomic_load_n(&test_threads_unjoined, __ATOMIC_SEQ_CST);
+}
+
+static void
+test_reset(void)
+{
+  for (int i = 0; i < TOR_API_STUB_STAMP_COUNT; i++) {
+    __atomic_store_n(&test_stamps[i], 0, __ATOMIC_SEQ_CST);
+  }
+  __atomic_store_n(&test_threads_unjoined, 0, __ATOMIC_SEQ_CST);
+}
+
+static int
+test_stamp(int stamp)
+{
+  return __atomic_load_n(&test_stamps[stamp], __ATOMIC_SEQ_CST);
+}
+
+// Copies the stub library to a new file in test_dir, returning its path.
+static char *
+test_copy_stub(void)
+{
+  char buf[8192];
+  char *path = NULL;
+  FILE *in = NULL;
+  FILE *out = NULL;
+  size_t n;
+  int ok = 0;
+
+  if (asprintf(&path, "%s/libtor_%d.so", test_dir, test_lib_count++) < 0) {
+    return NULL;
+  }
+
+  in = fopen(test_stub_path, "rb");
+  out = fopen(path, "wb");
+  if (in && out) {
+    ok = 1;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+      if (fwrite(buf, 1, n, out) != n) {
+        ok = 0;
+        break;
+      }
+    }
+    if (ferror(in)) {
+      ok = 0;
+    }
+  }
+  if (in) {
+    fclose(in);
+  }
+  if (out && fclose(out) != 0) {
+    ok = 0;
+  }
+
+  if (!ok) {
+    unlink(path);
+    free(path);
+    return NULL;
+  }
+  return path;
+}
+
+static int
+test_run(kmp_tor_context_t *ctx, const char *lib)
+{
+  char *argv[] = { "tor", NULL };
+  const char *error = kmp_tor_run_main(ctx, lib, 1, argv);
+  if (error) {
+    fprintf(stderr, "    kmp_tor_run_main: %s\n", error);
+    return -1;
+  }
+  return kmp_tor_terminate_and_await_result(ctx);
+}
+
+static int
+test_warm_restart_reuses_retained_image(void)
+{
+  kmp_tor_stats_t stats;
+  uint64_t saved_ns = 0;
+  char *lib = test_copy_stub();
+  CHECK(lib);
+
+  kmp_tor_context_t *ctx = kmp_tor_init();
+  CHECK(ctx);
+  CHECK(kmp_tor_warm_restart(ctx, 1) == 0);
+
+  for (int i = 0; i < 5; i++) {
+    CHECK(test_run(ctx, lib) == 0);
+    CHECK(kmp_tor_stats(ctx, &stats) == 0);
+    CHECK(stats.run_count == (uint64_t) i + 1);
+    CHECK(stats.last_error[0] == '\0');
+
+    // Loaded once, and never cleaned up nor unloaded while retained
+    CHECK(test_stamp(TOR_API_STUB_STAMP_LOADED) == 1);
+    CHECK(test_stamp(TOR_API_STUB_STAMP_RUN_MAIN_EXIT) == i + 1);
+    CHECK(test_stamp(TOR_API_STUB_STAMP_OPENSSL_CLEANUP) == 0);
+    CHECK(test_stamp(TOR_API_STUB_STAMP_UNLOADED) == 0);
+    CHECK(stats.lib_close_ns == 0);
+    CHECK(stats.warm_lib_close_ns == 0);
+
+    if (i == 0) {
+      CHECK(stats.lib_open_ns > 0);
+      CHECK(kmp_tor_warm_restart_saved_ns(ctx) == 0);
+    } else {
+      // Each reuse saves the load of the run which loaded the image
+      CHECK(stats.lib_open_ns == 0);
+      CHECK(kmp_tor_warm_restart_saved_ns(ctx) > saved_ns);
+    }
+    saved_ns = kmp_tor_warm_restart_saved_ns(ctx);
+  }
+
+  // Releasing the image credits its cleanup and unload, once per reuse
+  CHECK(kmp_tor_warm_restart(ctx, 0) == 0);
+  CHECK(test_stamp(TOR_API_STUB_STAMP_OPENSSL_CLEANUP) == 1);
+  CHECK(test_stamp(TOR_API_STUB_STAMP_UNLOADED) == 1);
+  CHECK(kmp_tor_warm_restart_saved_ns(ctx) > saved_ns);
+
+  // ...and is not charged to the run which retained it
+  CHECK(kmp_tor_stats(ctx, &stats) == 0);
+  CHECK(stats.lib_close_ns == 0);
+  CHECK(stats.warm_lib_close_ns > 0);
+
+  // Loaded anew, and unloaded upon stop
+  CHECK(test_run(ctx, lib) == 0);
+  CHECK(test_stamp(TOR_API_STUB_STAMP_LOADED) == 2);
+  CHECK(test_stamp(TOR_API_STUB_STAMP_UNLOADED) == 2);
+  CHECK(kmp_tor_stats(ctx, &stats) == 0);
+  CHECK(stats.lib_close_ns > 0);
+  CHECK(stats.lib_close_failures == 0);
+  CHECK(stats.lib_close_retries == 0);
+
+  CHECK(kmp_tor_deinit(ctx) == 0);
+  free(lib);
+  return 0;
+}
+
+static int
+test_warm_restart_releases_replaced_image(void)
+{
+  char *lib_a = test_copy_stub();
+  char *lib_b = test_copy_stub();
+  CHECK(lib_a);
+  CHECK(lib_b);
+
+  kmp_tor_context_t *ctx = kmp_tor_init();
+  CHECK(ctx);
+  CHECK(kmp_tor_warm_restart(ctx, 1) == 0);
+
+  CHECK(test_run(ctx, lib_a) == 0);
+  CHECK(test_stamp(TOR_API_STUB_STAMP_UNLOADED) == 0);
+
+  // lib_a is released before lib_b is loaded
+  CHECK(test_run(ctx, lib_b) == 0);
+  CHECK(test_stamp(TOR_API_STUB_STAMP_LOADED) == 2);
+  CHECK(test_stamp(TOR_API_STUB_STAMP_OPENSSL_CLEANUP) == 1);
+  CHECK(test_stamp(TOR_API_STUB_STAMP_UNLOADED) == 1);
+
+  // lib_b is retained until then
+  CHECK(kmp_tor_deinit(ctx) == 0);
+  CHECK(test_stamp(TOR_API_STUB_STAMP_OPENSSL_CLEANUP) == 2);
+  CHECK(test_stamp(TOR_API_STUB_STAMP_UNLOADED) == 2);
+
+  free(lib_a);
+  free(lib_b);
+  return 0;
+}
+
+static int
+test_busy_image_is_not_unloaded(void)
+{
+  kmp_tor_stats_t stats;
+  char *lib = test_copy_stub();
+  CHECK(lib);
+
+  kmp_tor_context_t *ctx = kmp_tor_init();
+  CHECK(ctx);
+
+  __atomic_store_n(&test_threads_unjoined, 1, __ATOMIC_SEQ_CST);
+  CHECK(test_run(ctx, lib) == 0);
+  CHECK(test_stamp(TOR_API_STUB_STAMP_CFG_FREE) == 1);
+  CHECK(test_stamp(TOR_API_STUB_STAMP_OPENSSL_CLEANUP) == 0);
+  CHECK(test_stamp(TOR_API_STUB_STAMP_UNLOADED) == 0);
+  CHECK(kmp_tor_stats(ctx, &stats) == 0);
+  CHECK(stats.last_error[0] != '\0');
+
+  // Left loaded, so is never loaded again
+  char *argv[] = { "tor", NULL };
+  CHECK(kmp_tor_run_main(ctx, lib, 1, argv) != NULL);
+
+  CHECK(kmp_tor_deinit(ctx) == 0);
+  free(lib);
+  return 0;
+}
+
+static int
+test_busy_retained_image_is_not_unloaded(void)
+{
+  kmp_tor_stats_t stats;
+  char *lib = test_copy_stub();
+  CHECK(lib);
+
+  kmp_tor_context_t *ctx = kmp_tor_init();
+  CHECK(ctx);
+  CHECK(kmp_tor_warm_restart(ctx, 1) == 0);
+
+  CHECK(test_run(ctx, lib) == 0);
+  CHECK(kmp_tor_stats(ctx, &stats) == 0);
+  CHECK(stats.last_error[0] == '\0');
+
+  __atomic_store_n(&test_threads_unjoined, 1, __ATOMIC_SEQ_CST);
+  CHECK(kmp_tor_warm_restart(ctx, 0) == 0);
+  CHECK(test_stamp(TOR_API_STUB_STAMP_OPENSSL_CLEANUP) == 0);
+  CHECK(test_stamp(TOR_API_STUB_STAMP_UNLOADED) == 0);
+  CHECK(kmp_tor_stats(ctx, &stats) == 0);
+  CHECK(stats.last_error[0] != '\0');
+
+  CHECK(kmp_tor_deinit(ctx) == 0);
+  free(lib);
+  return 0;
+}
+
+static int
+test_ctrl_write(kmp_tor_context_t *ctx, const char *data)
+{
+  return kmp_tor_ctrl_write(ctx, data, (int) strlen(data));
+}
+
+static int
+test_ctrl_write_refuses_dropownership(void)
+{
+  char *argv[] = { "tor", NULL };
+  char *lib = test_copy_stub();
+  CHECK(lib);
+
+  kmp_tor_context_t *ctx = kmp_tor_init();
+  CHECK(ctx);
+  CHECK(kmp_tor_run_main(ctx, lib, 1, argv) == NULL);
+
+  CHECK(test_ctrl_write(ctx, "GETINFO version\r\n") == 17);
+  CHECK(test_ctrl_write(ctx, "DROPOWNERSHIP\r\n") == -2);
+  CHECK(test_ctrl_write(ctx, "dropOwnership\n") == -2);
+  CHECK(test_ctrl_write(ctx, "+DROPOWNERSHIP\r\n") == -2);
+  CHECK(test_ctrl_write(ctx, "GETINFO version\r\nDROPOWNERSHIP\r\n") == -2);
+
+  // Across calls
+  CHECK(test_ctrl_write(ctx, "DROPOWN") == 7);
+  CHECK(test_ctrl_write(ctx, "ERSHIP") == 6);
+  CHECK(test_ctrl_write(ctx, "\r\n") == -2);
+  CHECK(test_ctrl_write(ctx, "S\r\n") == 3);
+
+  // Only as the keyword
+  CHECK(test_ctrl_write(ctx, "DROPOWNERSHIPS\r\n") == 16);
+  CHECK(test_ctrl_write(ctx, "SETEVENTS DROPOWNERSHIP\r\n") == 25);
+
+  CHECK(kmp_tor_terminate_and_await_result(ctx) == 0);
+  CHECK(kmp_tor_ctrl_write(ctx, "x", 1) == -1);
+
+  CHECK(kmp_tor_deinit(ctx) == 0);
+  free(lib);
+  return 0;
+}
+
+typedef struct {
+  kmp_tor_context_t *ctx;
+  pthread_t caller;
+  int states[8];
+  int states_len;
+  int is_off_caller;
+  int is_started_caller;
+  int is_started_unlocked;
+  int is_stats_done;
+} test_listener_t;
+
+static void *
+test_listener_stats(void *arg)
+{
+  test_listener_t *l = arg;
+  kmp_tor_stats_t stats;
+  kmp_tor_stats(l->ctx, &stats);
+  __atomic_store_n(&l->is_stats_done, 1, __ATOMIC_SEQ_CST);
+  return NULL;
+}
+
+static void
+test_listener(kmp_tor_context_t *ctx, int state, void *arg)
+{
+  test_listener_t *l = arg;
+  if (l->states_len < (int) (sizeof(l->states) / sizeof(l->states[0]))) {
+    l->states[l->states_len++] = state;
+  }
+  if (kmp_tor_state(ctx) < 0) {
+    l->states_len = -1;
+  }
+
+  if (state == KMP_TOR_STATE_OFF) {
+    l->is_off_caller = pthread_equal(l->caller, pthread_self());
+  }
+  if (state != KMP_TOR_STATE_STARTED) {
+    return;
+  }
+  l->is_started_caller = pthread_equal(l->caller, pthread_self());
+
+  // Another thread can acquire ctx->lock (kmp_tor_stats) while this runs
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, test_listener_stats, l) != 0) {
+    return;
+  }
+  for (int i = 0; i < 500 && !__atomic_load_n(&l->is_stats_done, __ATOMIC_SEQ_CST); i++) {
+    usleep(10 * 1000);
+  }
+  if (__atomic_load_n(&l->is_stats_done, __ATOMIC_SEQ_CST)) {
+    l->is_started_unlocked = 1;
+    pthread_join(thread, NULL);
+  } else {
+    pthread_detach(thread);
+  }
+}
+
+static int
+test_state_listener_is_notified_in_order_without_lock(void)
+{
+  test_listener_t l;
+  memset(&l, 0, sizeof(l));
+  l.caller = pthread_self();
+
+  char *lib = test_copy_stub();
+  CHECK(lib);
+
+  kmp_tor_context_t *ctx = kmp_tor_init();
+  CHECK(ctx);
+  l.ctx = ctx;
+  CHECK(kmp_tor_state_listener(ctx, test_listener, &l) == 0);
+
+  CHECK(test_run(ctx, lib) == 0);
+  CHECK(l.is_started_unlocked);
+  CHECK(!l.is_started_caller);
+  CHECK(l.is_off_caller);
+  CHECK(l.states_len == 4);
+  CHECK(l.states[0] == KMP_TOR_STATE_STARTING);
+  CHECK(l.states[1] == KMP_TOR_STATE_STARTED);
+  CHECK(l.states[2] == KMP_TOR_STATE_STOPPED);
+  CHECK(l.states[3] == KMP_TOR_STATE_OFF);
+
+  // Not notified once cleared
+  CHECK(kmp_tor_state_listener(ctx, NULL, NULL) == 0);
+  CHECK(test_run(ctx, lib) == 0);
+  CHECK(l.states_len == 4);
+
+  CHECK(kmp_tor_deinit(ctx) == 0);
+  free(lib);
+  return 0;
+}
+
+typedef struct {
+  const char *name;
+  int (*run)(void);
+} test_case_t;
+
+static const test_case_t test_cases[] = {
+  { "warm_restart_reuses_retained_image",   test_warm_restart_reuses_retained_image },
+  { "warm_restart_releases_replaced_image", test_warm_restart_releases_replaced_image },
+  { "busy_image_is_not_unloaded",           test_busy_image_is_not_unloaded },
+  { "busy_retained_image_is_not_unloaded",  test_busy_retained_image_is_not_unloaded },
+  { "ctrl_write_refuses_dropownership",     test_ctrl_write_refuses_dropownership },
+  { "state_listener_is_notified_in_order_without_lock", test_state_listener_is_notified_in_order_without_lock },
+};
+
+int
+main(int argc, char *argv[])
+{
+  int failures = 0;
+
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s /path/to/libtor_stub\n", argv[0]);
+    return 2;
+  }
+  test_stub_path = argv[1];
+
+  if (!mkdtemp(test_dir)) {
+    fprintf(stderr, "mkdtemp failed: %s\n", strerror(errno));
+    return 1;
+  }
+
+  for (size_t i = 0; i < sizeof(test_cases) / sizeof(test_cases[0]); i++) {
+    test_reset();
+    if (test_cases[i].run() == 0) {
+      printf("PASS %s\n", test_cases[i].name);
+    } else {
+      printf("FAIL %s\n", test_cases[i].name);
+      failures++;
+    }
+  }
+
+  for (int i = 0; i < test_lib_count; i++) {
+    char path[sizeof(test_dir) + 32];
+    snprintf(path, sizeof(path), "%s/libtor_%d.so", test_dir, i);
+    unlink(path);
+  }
+  rmdir(test_dir);
+
+  printf("%d failure(s)\n", failures);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2025 Matthew Nelson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+/**
+ * A stand-in for the parts of libtor which kmp_tor_main.c uses, linked
+ * statically with it to produce the `tor` executable which
+ * kmp_tor_main_test.c runs as a fork server. tor_main does whatever
+ * argv[1] says:
+ *
+ *   echo [args...]  Writes "args|$KMP_TOR_TEST|init_count\n" to stdout,
+ *                   where init_count is the number of times
+ *                   OPENSSL_init_ssl was called in this process (which
+ *                   tor_main itself never does), and returns 0.
+ *   exit <code>     Returns code.
+ *   kill            Sends itself SIGKILL.
+ *   block           Reads stdin until EOF, then returns 0.
+ *
+ * Non-Windows only.
+ **/
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int init_count = 0;
+
+int
+OPENSSL_init_ssl(uint64_t opts, const void *settings)
+{
+  (void) opts;
+  (void) settings;
+  init_count++;
+  return 1;
+}
+
+void
+OPENSSL_cleanup(void)
+{
+}
+
+int
+tor_main(int argc, char *argv[])
+{
+  if (argc < 2) {
+    return 1;
+  }
+
+  if (strcmp(argv[1], "echo") == 0) {
+    const char *env = getenv("KMP_TOR_TEST");
+    for (int i = 2; i < argc; i++) {
+      printf("%s%s", i == 2 ? "" : " ", argv[i]);
+    }
+    printf("|%s|%d\n", env ? env : "", init_count);
+    fflush(stdout);
+    return 0;
+  }
+
+  if (strcmp(argv[1], "exit") == 0 && argc == 3) {
+    return (int) strtol(argv[2], NULL, 10);
+  }
+
+  if (strcmp(argv[1], "kill") == 0) {
+    raise(SIGKILL);
+  }
+
+  if (strcmp(argv[1], "block") == 0) {
+    char buf[64];
+    while (read(STDIN_FILENO, buf, sizeof(buf)) > 0) {}
+    return 0;
+  }
+
+  return 1;
+}
@@ -19,6 +19,57 @@ readonly CMD_TASK="$1"
 readonly DIR_TASK="$( cd "$( dirname "$0" )" >/dev/null && pwd )"
 if [ -n "$CMD_TASK" ]; then shift; fi
 
+function bench:native { ## 1 ARG (optional) - [1]: /path/to/libtor to also benchmark. Offline kmp_tor start/stop benchmark (host cc, no docker)
+  bench:native:compile
+
+  local dir_bench="$DIR_TASK/build/bench"
+  local ext="so"
+  if [ "$(uname -s)" = "Darwin" ]; then ext="dylib"; fi
+
+  "$dir_bench/kmp_tor_bench" -n "${ITERATIONS:-1000}" "$dir_bench/libtor_stub.$ext"
+
+  if [ -z "$1" ]; then return 0; fi
+
+  __util:require:file_exists "$1" "libtor"
+
+  local dir_data=
+  dir_data="$(mktemp -d)"
+  trap 'rm -rf "$dir_data"' RETURN
+
+  echo ""
+  "$dir_bench/kmp_tor_bench" -n "${ITERATIONS:-25}" -w 1 -d "$dir_data" "$1"
+}
+
+function bench:native:compile { ## Compiles the offline kmp_tor benchmark and its stub libtor without running them (host cc, no docker)
+  local dir_bench="$DIR_TASK/build/bench"
+  local dir_native="$DIR_TASK/native"
+  local cc="${CC:-cc}"
+  local ext="so"
+  local cflags="-O3 -Wall -Wextra ${CFLAGS_BENCH}"
+  local stub_ldflags="-shared -Wl,--version-script,$dir_native/exports/tor_api.map"
+  local bench_ldflags="-rdynamic -lpthread -ldl"
+
+  if [ "$(uname -s)" = "Darwin" ]; then
+    ext="dylib"
+    stub_ldflags="-dynamiclib -exported_symbols_list $dir_native/exports/tor_api.exp"
+    bench_ldflags="-lpthread"
+  fi
+
+  mkdir -p "$dir_bench"
+
+  ${cc} $cflags -fPIC -fvisibility=hidden \
+    -o "$dir_bench/libtor_stub.$ext" \
+    "$dir_native/bench/tor_api_stub.c" \
+    $stub_ldflags
+
+  ${cc} $cflags \
+    -o "$dir_bench/kmp_tor_bench" \
+    "$dir_native/bench/kmp_tor_bench.c" \
+    "$dir_native/kmp_tor.c" \
+    "$dir_native/lib_load.c" \
+    $bench_ldflags
+}
+
 function build:all { ## Builds all targets
   build:all:desktop
   build:all:mobile
@@ -602,6 +653,51 @@ function sign:mingw { ## Codesign mingw binaries (see codesign/windows.pkcs11.sa
   __sign:generate:detached:mingw "x86_64"
 }
 
+function test:native { ## Runs the lifecycle test for kmp_tor.c against a stub libtor, and the fork-server protocol test for kmp_tor_main.c against a stub tor_main (host cc, no docker, non-Windows)
+  local dir_test="$DIR_TASK/build/test"
+  local dir_native="$DIR_TASK/native"
+  local cc="${CC:-cc}"
+  local cflags="-O2 -Wall -Wextra ${CFLAGS_TEST}"
+  local ext="so"
+  local stub_ldflags="-shared -Wl,--version-script,$dir_native/exports/tor_api.map"
+  local test_ldflags="-rdynamic -lpthread -ldl"
+
+  if [ "$(uname -s)" = "Darwin" ]; then
+    ext="dylib"
+    stub_ldflags="-dynamiclib -exported_symbols_list $dir_native/exports/tor_api.exp"
+    test_ldflags="-lpthread"
+  fi
+
+  mkdir -p "$dir_test"
+
+  ${cc} $cflags -fPIC -fvisibility=hidden \
+    -o "$dir_test/libtor_stub.$ext" \
+    "$dir_native/bench/tor_api_stub.c" \
+    $stub_ldflags
+
+  ${cc} $cflags \
+    -o "$dir_test/kmp_tor_test" \
+    "$dir_native/test/kmp_tor_test.c" \
+    "$dir_native/kmp_tor.c" \
+    "$dir_native/lib_load.c" \
+    $test_ldflags
+
+  "$dir_test/kmp_tor_test" "$dir_test/libtor_stub.$ext"
+
+  # A short request deadline keeps the slow client test quick. MUST
+  # match TEST_REQUEST_TIMEOUT_MS in test/kmp_tor_main_test.c
+  ${cc} $cflags -DKMP_TOR_FORK_REQUEST_TIMEOUT_MS=500 \
+    -o "$dir_test/tor" \
+    "$dir_native/kmp_tor_main.c" \
+    "$dir_native/test/tor_main_stub.c"
+
+  ${cc} $cflags \
+    -o "$dir_test/kmp_tor_main_test" \
+    "$dir_native/test/kmp_tor_main_test.c"
+
+  "$dir_test/kmp_tor_main_test" "$dir_test/tor"
+}
+
 function validate { ## Checks the build/package directory output against expected sha256 hashes
   local targets="JVM"
   targets+=",LINUX_ARM64,LINUX_X64"
@@ -754,7 +850,7 @@ else
   TIMEFORMAT="
     Task '$CMD_TASK' completed in %3lR
   "
-  if [ "$CMD_TASK" = "sign:macos" ]; then
+  if [ "$CMD_TASK" = "sign:macos" ] || [ "$CMD_TASK" = "bench:native" ]; then
     time "$CMD_TASK" "$@"
   else
     time "$CMD_TASK"
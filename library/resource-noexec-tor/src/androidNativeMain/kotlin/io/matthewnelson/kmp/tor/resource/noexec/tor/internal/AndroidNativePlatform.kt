@@ -16,12 +16,18 @@
 package io.matthewnelson.kmp.tor.resource.noexec.tor.internal
 
 import io.matthewnelson.kmp.file.File
+import io.matthewnelson.kmp.file.path
 import io.matthewnelson.kmp.file.toFile
 import io.matthewnelson.kmp.tor.common.api.InternalKmpTorApi
 import io.matthewnelson.kmp.tor.common.core.Resource
 import kotlinx.cinterop.ExperimentalForeignApi
+import kotlinx.cinterop.alloc
+import kotlinx.cinterop.convert
+import kotlinx.cinterop.memScoped
+import kotlinx.cinterop.ptr
 import kotlinx.cinterop.toKString
 import platform.posix.getenv
+import platform.posix.stat
 
 @Suppress("NOTHING_TO_INLINE")
 @OptIn(InternalKmpTorApi::class)
@@ -57,3 +63,10 @@ internal actual inline fun Map<String, File>.findLibs(): Map<String, File> {
 
     return toMutableMap().apply { put(ALIAS_LIBTOR, lib) }
 }
+
+@OptIn(ExperimentalForeignApi::class)
+internal actual fun File.lastModifiedSeconds(): Long = memScoped {
+    val st = alloc<stat>()
+    if (stat(path, st.ptr) != 0) return -1L
+    st.st_mtim.tv_sec.convert()
+}
@@ -23,39 +23,64 @@ import io.matthewnelson.kmp.file.path
 import io.matthewnelson.kmp.file.resolve
 import io.matthewnelson.kmp.file.toFile
 import io.matthewnelson.kmp.tor.common.api.InternalKmpTorApi
-import io.matthewnelson.kmp.tor.common.api.TorApi
 import io.matthewnelson.kmp.tor.common.core.SynchronizedObject
 import io.matthewnelson.kmp.tor.common.core.synchronized
 import io.matthewnelson.kmp.tor.common.core.synchronizedObject
+import io.matthewnelson.kmp.tor.resource.noexec.tor.TorApiNoExec
 import kotlinx.cinterop.CPointer
 import kotlinx.cinterop.ExperimentalForeignApi
+import kotlinx.cinterop.StableRef
+import kotlinx.cinterop.addressOf
 import kotlinx.cinterop.memScoped
 import kotlinx.cinterop.toCStringArray
 import kotlinx.cinterop.toKString
+import kotlinx.cinterop.usePinned
 import platform.Foundation.NSBundle
+import kotlin.concurrent.AtomicReference
+import kotlin.experimental.ExperimentalNativeApi
+import kotlin.native.ref.Cleaner
+import kotlin.native.ref.createCleaner
 
 // appleFramework
+//
+// Unlike nonAppleFramework, LibTor.framework cannot be copied per instance
+// (it is code signed as part of the application bundle), so only one instance
+// at a time is able to run tor. Others fail in torRunMain until it stops.
 @OptIn(ExperimentalForeignApi::class, InternalKmpTorApi::class)
-internal actual class KmpTorApi private constructor(): TorApi() {
+internal actual class KmpTorApi private constructor(): TorApiNoExec() {
 
     private val ctx: CPointer<__kmp_tor_context_t>
     private val bundle: NSBundle
     private val lock: SynchronizedObject
+    // Referenced by cleaner, which disposes of it if close is never called
+    private val stateListener = AtomicReference<StableRef<(State) -> Unit>?>(null)
+    private var isClosed: Boolean = false
+    @Suppress("unused")
+    @OptIn(ExperimentalNativeApi::class)
+    private val cleaner: Cleaner
+
+    actual override var threadOptions: ThreadOptions?
+        get() = _threadOptions.value
+        set(value) { _threadOptions.value = value }
+    private val _threadOptions = AtomicReference<ThreadOptions?>(null)
 
     @Throws(IllegalStateException::class, IOException::class)
     actual override fun torRunMain(args: Array<String>) {
         synchronized(lock) {
+            check(!isClosed) { "KmpTorApi is closed" }
             if (bundle.isLoaded()) {
                 check(bundle.unload()) { "Failed to unload $bundle" }
             }
         }
 
+        val options = threadOptions
         val error: String = memScoped {
-            val result = __kmp_tor_run_main(
+            val result = __kmp_tor_run_main_with_options(
                 __ctx = ctx,
                 lib_tor = "$FRAMEWORK_NAME/$EXECUTABLE_NAME",
                 argc = args.size,
                 argv = args.toCStringArray(autofreeScope = this),
+                options = allocThreadOptions(options),
             )
 
             result?.toKString()
@@ -63,9 +88,64 @@ internal actual class KmpTorApi private constructor(): TorApi() {
         throw IllegalArgumentException(error)
     }
 
-    actual override fun state(): State = State.entries.elementAt(__kmp_tor_state(ctx))
+    actual override fun state(): State = __kmp_tor_state(ctx).toState()
+    actual override fun awaitState(state: State, timeoutNanos: Long): State {
+        return __kmp_tor_await_state(ctx, state.ordinal, timeoutNanos).toState()
+    }
+    actual override fun stateListener(listener: ((State) -> Unit)?) {
+        synchronized(lock) {
+            if (isClosed) return
+            stateListener.value = ctx.stateListener(stateListener.value, listener)
+        }
+    }
+    // See kmp_tor_state_fd
+    internal fun stateFd(): Int = __kmp_tor_state_fd(ctx)
     actual override fun terminateAndAwaitResult(): Int = __kmp_tor_terminate_and_await_result(ctx)
 
+    @Throws(IllegalArgumentException::class, IOException::class)
+    actual override fun ctrlRead(dst: ByteArray, offset: Int, len: Int): Int {
+        dst.requireCtrlRegion(offset, len)
+        if (len == 0) return 0
+
+        val read = dst.usePinned { pinned -> __kmp_tor_ctrl_read(ctx, pinned.addressOf(offset), len) }
+        if (read < 0) throw IOException("Failed to read from tor's controller connection")
+        return if (read == 0) -1 else read
+    }
+
+    @Throws(IllegalArgumentException::class, IOException::class)
+    actual override fun ctrlWrite(src: ByteArray, offset: Int, len: Int): Int {
+        src.requireCtrlRegion(offset, len)
+        if (len == 0) return 0
+
+        return src.usePinned { pinned -> __kmp_tor_ctrl_write(ctx, pinned.addressOf(offset), len) }.checkCtrlWritten()
+    }
+
+    actual override fun warmRestart(enable: Boolean) { __kmp_tor_warm_restart(ctx, if (enable) 1 else 0) }
+    actual override fun warmRestartSavedNanos(): Long = __kmp_tor_warm_restart_saved_ns(ctx).toLong()
+    @Throws(IllegalStateException::class)
+    actual override fun stats(): Stats = ctx.stats()
+
+    /**
+     * Terminates tor (if running) and frees this instance's `kmp_tor_context_t`.
+     * Afterward, [torRunMain] fails and everything else behaves as though tor
+     * is not running. If not called explicitly, the [cleaner] does so when this
+     * instance is garbage collected. A listener set via [stateListener] is held
+     * until then, so if it references this instance (directly or not), it
+     * never is.
+     * */
+    actual override fun close() {
+        synchronized(lock) {
+            if (isClosed) return
+            isClosed = true
+        }
+
+        // Returns once nothing is executing within ctx, see __kmp_tor_close
+        __kmp_tor_close(ctx)
+        synchronized(lock) {
+            stateListener.getAndSet(null)?.dispose()
+        }
+    }
+
     init {
         val path = NSBundle.mainBundle.bundlePath.toFile()
             .resolve("Frameworks")
@@ -82,6 +162,13 @@ internal actual class KmpTorApi private constructor(): TorApi() {
         this.bundle = bundle
         this.ctx = __kmp_tor_init() ?: throw IllegalStateException("Failed to initialized kmp_tor_context_t")
         this.lock = synchronizedObject()
+
+        @OptIn(ExperimentalNativeApi::class)
+        this.cleaner = createCleaner(ctx to stateListener) { (ctx, stateListener) ->
+            __kmp_tor_deinit(ctx)
+            // Nothing is executing the listener once ctx is freed
+            stateListener.getAndSet(null)?.dispose()
+        }
     }
 
     internal actual companion object {
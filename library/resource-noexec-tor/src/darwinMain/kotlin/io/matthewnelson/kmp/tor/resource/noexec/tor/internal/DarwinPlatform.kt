@@ -16,7 +16,21 @@
 package io.matthewnelson.kmp.tor.resource.noexec.tor.internal
 
 import io.matthewnelson.kmp.file.File
+import io.matthewnelson.kmp.file.path
+import kotlinx.cinterop.ExperimentalForeignApi
+import kotlinx.cinterop.alloc
+import kotlinx.cinterop.convert
+import kotlinx.cinterop.memScoped
+import kotlinx.cinterop.ptr
+import platform.posix.stat
 
 @Suppress("NOTHING_TO_INLINE")
 @Throws(IllegalStateException::class)
 internal actual inline fun Map<String, File>.findLibs(): Map<String, File> = this
+
+@OptIn(ExperimentalForeignApi::class)
+internal actual fun File.lastModifiedSeconds(): Long = memScoped {
+    val st = alloc<stat>()
+    if (stat(path, st.ptr) != 0) return -1L
+    st.st_mtimespec.tv_sec.convert()
+}
@@ -19,27 +19,71 @@ package io.matthewnelson.kmp.tor.resource.noexec.tor.internal
 
 import io.matthewnelson.kmp.file.File
 import io.matthewnelson.kmp.file.IOException
+import io.matthewnelson.kmp.file.resolve
 import io.matthewnelson.kmp.tor.common.api.InternalKmpTorApi
-import io.matthewnelson.kmp.tor.common.api.TorApi
+import io.matthewnelson.kmp.tor.resource.noexec.tor.TorApiNoExec
+import java.nio.ByteBuffer
+import java.util.zip.ZipFile
 
 // jvmAndroid
 @OptIn(InternalKmpTorApi::class)
 internal actual class KmpTorApi private constructor(
     private val resourceDir: File,
     registerShutdownHook: Boolean,
-): TorApi() {
+): TorApiNoExec() {
+
+    // kmp_tor_context_t *
+    private val ctx: Long
+    @Suppress("PLATFORM_CLASS_MAPPED_TO_KOTLIN")
+    private val lock = Object()
+    // See libTor
+    private val slot: Int
+    // Guarded by lock. Calls which are not synchronized on lock (they
+    // block, or may run while tor starts/stops) are counted via withCtx
+    // so that close can wait them out before freeing ctx.
+    private var isClosed = false
+    private var inFlight = 0
+
+    @Volatile
+    actual override var threadOptions: ThreadOptions? = null
+
+    @Volatile
+    private var stateListener: ((State) -> Unit)? = null
 
     @Throws(IllegalStateException::class, IOException::class)
     actual override fun torRunMain(args: Array<String>) {
-        val cLibTor = synchronized(Companion) { extractLibTor(isInit = false) }.path.encodeToByteArray()
-        val cArgs = Array(args.size) { i -> args[i].encodeToByteArray() }
+        check(args.isNotEmpty()) { "args cannot be empty" }
+        args.forEach { arg -> check(!arg.contains('\u0000')) { "args cannot contain NUL characters" } }
+
+        val cLibTor = synchronized(Companion) { libTor(extractLibTor(isInit = false)) }.path.encodeToByteArray()
+        // Packed as NUL terminated strings so that kmp_tor can parse them in place
+        val cArgs = args.joinToString(separator = "\u0000", postfix = "\u0000").encodeToByteArray()
         val errBuf = ByteArray(ERR_BUF_LEN)
 
-        val errLen = kmpTorRunMain(cLibTor, cArgs, errBuf)
+        val options = threadOptions
+        val cThreadName = options?.name?.encodeToByteArray()
+
+        val errLen = synchronized(lock) {
+            check(!isClosed) { "KmpTorApi is closed" }
+            kmpTorRunMain(
+                ctx,
+                cLibTor,
+                args.size,
+                cArgs,
+                options?.cpuSet,
+                options?.stackSize ?: 0L,
+                options?.schedPolicy?.ordinal ?: 0,
+                options?.nice != null,
+                options?.nice ?: 0,
+                cThreadName,
+                errBuf,
+            )
+        }
 
         // Ensure Java won't GC them until after kmpTorRunMain returns from JNI layer
         cLibTor.size
         cArgs.size
+        cThreadName?.size
         errBuf.size
 
         if (errLen <= 0) return
@@ -48,8 +92,186 @@ internal actual class KmpTorApi private constructor(
         throw IllegalStateException(msg)
     }
 
-    actual override fun state(): State = State.entries.elementAt(kmpTorState())
-    actual override fun terminateAndAwaitResult(): Int = kmpTorTerminateAndAwaitResult()
+    actual override fun state(): State = synchronized(lock) {
+        if (isClosed) State.OFF else State.entries.elementAt(kmpTorState(ctx))
+    }
+
+    actual override fun awaitState(state: State, timeoutNanos: Long): State {
+        // Waits in slices so that close is never held up by a caller
+        // blocked on a state which may never come.
+        val start = System.nanoTime()
+        while (true) {
+            val remaining = if (timeoutNanos < 0L) Long.MAX_VALUE else timeoutNanos - (System.nanoTime() - start)
+            val slice = remaining.coerceIn(0L, AWAIT_SLICE_NANOS)
+            val current = withCtx(closed = -1) { ctx -> kmpTorAwaitState(ctx, state.ordinal, slice) }
+            if (current < 0) return State.OFF
+            if (current == state.ordinal || slice >= remaining) return State.entries.elementAt(current)
+        }
+    }
+
+    /**
+     * Sets (or clears, if `null`) the [listener] to be notified of state
+     * transitions (see [TorApiNoExec.stateListener]).
+     *
+     * The state fd (see `kmp_tor_state_fd`) is not exposed on Jvm/Android, as
+     * Java has no means of polling a raw descriptor.
+     * */
+    actual override fun stateListener(listener: ((State) -> Unit)?) {
+        // Not synchronized on lock, as kmpTorStateListener waits out a
+        // notification in progress (whose listener may call state).
+        withCtx(closed = -1) { ctx ->
+            stateListener = listener
+            kmpTorStateListener(ctx, if (listener == null) null else this)
+        }
+    }
+
+    // Called from kmp_tor-jni.c
+    @Suppress("unused")
+    private fun kmpTorOnState(state: Int) {
+        val listener = stateListener ?: return
+        try {
+            listener(State.entries.elementAt(state))
+        } catch (_: Throwable) {}
+    }
+
+    // Not synchronized on lock, as tor's thread (which this joins) may be
+    // notifying a listener which calls state.
+    actual override fun terminateAndAwaitResult(): Int = withCtx(closed = -1) { ctx ->
+        kmpTorTerminateAndAwaitResult(ctx)
+    }
+    actual override fun warmRestart(enable: Boolean) {
+        synchronized(lock) { if (!isClosed) kmpTorWarmRestart(ctx, enable) }
+    }
+    actual override fun warmRestartSavedNanos(): Long = withCtx(closed = 0L) { ctx -> kmpTorWarmRestartSavedNanos(ctx) }
+
+    /**
+     * Terminates tor (if running) and frees this instance's `kmp_tor_context_t`
+     * and libtor copy (if any). Afterward, [torRunMain] fails and everything
+     * else behaves as though tor is not running.
+     *
+     * MUST be called once this instance is no longer needed. It is not called
+     * upon garbage collection, as the native listener reference (see
+     * [stateListener]) and shutdown hook (if registered) keep this instance
+     * reachable, and finalization cannot be relied upon.
+     * */
+    actual override fun close() {
+        synchronized(lock) {
+            if (isClosed) return
+            isClosed = true
+            stateListener = null
+        }
+        // init failed
+        if (ctx == 0L) return
+
+        // Shutting down tor's controller connection returns any blocked
+        // ctrlRead, and awaitState returns within AWAIT_SLICE_NANOS, so
+        // whatever is in flight drains promptly.
+        kmpTorTerminateAndAwaitResult(ctx)
+        synchronized(lock) {
+            while (inFlight > 0) lock.wait()
+        }
+
+        kmpTorDeinit(ctx)
+        synchronized(Companion) { releaseSlot(slot) }
+    }
+
+    private inline fun <T> withCtx(closed: T, block: (ctx: Long) -> T): T {
+        synchronized(lock) {
+            if (isClosed) return closed
+            inFlight++
+        }
+        try {
+            return block(ctx)
+        } finally {
+            synchronized(lock) {
+                inFlight--
+                if (inFlight == 0 && isClosed) lock.notifyAll()
+            }
+        }
+    }
+
+    @Throws(IllegalStateException::class)
+    actual override fun stats(): Stats {
+        val values = LongArray(Stats.LEN)
+        val errBuf = ByteArray(ERR_BUF_LEN)
+        // Not synchronized on lock, so it may be called while tor is starting or stopping
+        val errLen = withCtx(closed = -1) { ctx -> kmpTorStats(ctx, values, errBuf) }
+        check(errLen != -2) { "Stats.LEN[${Stats.LEN}] does not match STATS_LEN of libtorjni" }
+        check(errLen >= 0) { "Failed to retrieve kmp_tor_stats_t" }
+        val lastError = if (errLen == 0) null else errBuf.decodeToString(endIndex = errLen)
+        return Stats(values, lastError)
+    }
+
+    /**
+     * Reads control-protocol output from tor's owning controller connection
+     * into [dst], which must be a direct [ByteBuffer]. The connection is
+     * already authenticated.
+     *
+     * @return The number of bytes read, or -1 if the connection has reached EOF.
+     * */
+    @Throws(IllegalArgumentException::class, IOException::class)
+    internal fun ctrlRead(dst: ByteBuffer): Int {
+        require(dst.isDirect) { "dst must be a direct ByteBuffer" }
+        val remaining = dst.remaining()
+        if (remaining == 0) return 0
+
+        val position = dst.position()
+        val read = withCtx(closed = -1) { ctx -> kmpTorCtrlRead(ctx, dst, position, remaining) }
+        if (read < 0) throw IOException("Failed to read from tor's controller connection")
+        if (read == 0) return -1
+        dst.position(position + read)
+        return read
+    }
+
+    /**
+     * Writes control-protocol input from [src], which must be a direct
+     * [ByteBuffer], to tor's owning controller connection.
+     *
+     * @return The number of bytes written.
+     * */
+    @Throws(IllegalArgumentException::class, IOException::class)
+    internal fun ctrlWrite(src: ByteBuffer): Int {
+        require(src.isDirect) { "src must be a direct ByteBuffer" }
+        val remaining = src.remaining()
+        if (remaining == 0) return 0
+
+        val position = src.position()
+        val written = withCtx(closed = -1) { ctx -> kmpTorCtrlWrite(ctx, src, position, remaining) }.checkCtrlWritten()
+        src.position(position + written)
+        return written
+    }
+
+    /**
+     * Reads control-protocol output from tor's owning controller connection
+     * into [dst]. At most 8192 bytes are read per call (see
+     * external/native/kmp_tor-jni.c); prefer the direct [ByteBuffer] variant
+     * for larger transfers.
+     *
+     * @return The number of bytes read, or -1 if the connection has reached EOF.
+     * */
+    @Throws(IllegalArgumentException::class, IOException::class)
+    actual override fun ctrlRead(dst: ByteArray, offset: Int, len: Int): Int {
+        dst.requireCtrlRegion(offset, len)
+        if (len == 0) return 0
+
+        val read = withCtx(closed = -1) { ctx -> kmpTorCtrlRead(ctx, dst, offset, len) }
+        if (read < 0) throw IOException("Failed to read from tor's controller connection")
+        return if (read == 0) -1 else read
+    }
+
+    /**
+     * Writes control-protocol input from [src] to tor's owning controller
+     * connection. At most 8192 bytes are written per call.
+     *
+     * @return The number of bytes written.
+     * */
+    @Throws(IllegalArgumentException::class, IOException::class)
+    actual override fun ctrlWrite(src: ByteArray, offset: Int, len: Int): Int {
+        src.requireCtrlRegion(offset, len)
+        if (len == 0) return 0
+
+        return withCtx(closed = -1) { ctx -> kmpTorCtrlWrite(ctx, src, offset, len) }.checkCtrlWritten()
+    }
 
     @Throws(IllegalStateException::class, IOException::class)
     private fun extractLibTor(isInit: Boolean): File = try {
@@ -75,8 +297,58 @@ internal actual class KmpTorApi private constructor(
         throw IllegalStateException("Failed to load torjni", t)
     }
 
+    /**
+     * tor keeps its state in globals, so instances running concurrently each
+     * need their own library image (see `kmp_tor_run_main`). The instance in
+     * slot 0 loads the extracted libtor, all others a copy of it which lives
+     * in [resourceDir] until [close].
+     * */
+    @Throws(IOException::class)
+    private fun libTor(lib: File): File {
+        if (slot == 0) return lib
+        val copy = resourceDir.resolve("libtor_ctx$slot").resolve(lib.name)
+        copy.parentFile?.mkdirs()
+
+        val path = lib.path
+        val i = path.indexOf("!/")
+        if (i == -1) {
+            if (copy.exists() && copy.length() == lib.length() && copy.lastModified() >= lib.lastModified()) return copy
+            // Replaces (rather than overwrites) the file, so an image of the
+            // old copy retained for a warm restart is left intact.
+            lib.copyTo(copy, overwrite = true)
+            return copy
+        }
+
+        // Android API 23+ may load libtor uncompressed from within the APK
+        val apk = File(path.substring(0, i))
+        ZipFile(apk).use { zip ->
+            val entry = zip.getEntry(path.substring(i + 2)) ?: throw IOException("$path not found")
+            if (copy.exists() && copy.length() == entry.size && copy.lastModified() >= apk.lastModified()) return copy
+            copy.delete()
+            zip.getInputStream(entry).use { input ->
+                copy.outputStream().use { output -> input.copyTo(output) }
+            }
+        }
+        return copy
+    }
+
+    private fun releaseSlot(slot: Int) {
+        SLOTS.remove(slot)
+        if (slot == 0) return
+        val dir = resourceDir.resolve("libtor_ctx$slot")
+        dir.listFiles()?.forEach { it.delete() }
+        dir.delete()
+    }
+
     init {
         extractLibTor(isInit = true)
+        ctx = kmpTorInit()
+        check(ctx != 0L) { "Failed to initialize kmp_tor_context_t" }
+        slot = synchronized(Companion) {
+            var i = 0
+            while (!SLOTS.add(i)) i++
+            i
+        }
 
         if (registerShutdownHook) {
             val t = Thread { terminateAndAwaitResult() }
@@ -90,6 +362,10 @@ internal actual class KmpTorApi private constructor(
 
         // Defined in external/native/kmp_tor-jni.c
         private const val ERR_BUF_LEN = 1024
+        private const val AWAIT_SLICE_NANOS = 100_000_000L
+
+        // Slots held by live instances, see libTor. Guarded by Companion.
+        private val SLOTS = HashSet<Int>(1, 1.0f)
 
         internal const val ALIAS_LIBTORJNI: String = "libtorjni"
 
@@ -100,14 +376,50 @@ internal actual class KmpTorApi private constructor(
             registerShutdownHook: Boolean,
         ): KmpTorApi = KmpTorApi(resourceDir, registerShutdownHook)
 
+        // Each KmpTorApi instance holds its own kmp_tor_context_t, so
+        // calls are synchronized per-instance (not on the companion)
+        // allowing separate instances to run concurrently.
+        @JvmStatic
+        private external fun kmpTorInit(): Long
+        @JvmStatic
+        private external fun kmpTorDeinit(ctx: Long): Int
+        @JvmStatic
+        private external fun kmpTorRunMain(
+            ctx: Long,
+            libTor: ByteArray,
+            argc: Int,
+            args: ByteArray,
+            cpuSet: IntArray?,
+            stackSize: Long,
+            schedPolicy: Int,
+            setNice: Boolean,
+            nice: Int,
+            threadName: ByteArray?,
+            errBuf: ByteArray,
+        ): Int
+        @JvmStatic
+        private external fun kmpTorState(ctx: Long): Int
+        // Not synchronized, as it blocks until the state transitions.
+        @JvmStatic
+        private external fun kmpTorAwaitState(ctx: Long, state: Int, timeoutNanos: Long): Int
+        @JvmStatic
+        private external fun kmpTorStateListener(ctx: Long, listener: Any?): Int
+        // Not synchronized, as they block on socket I/O.
+        @JvmStatic
+        private external fun kmpTorCtrlRead(ctx: Long, dst: ByteBuffer, position: Int, len: Int): Int
+        @JvmStatic
+        private external fun kmpTorCtrlWrite(ctx: Long, src: ByteBuffer, position: Int, len: Int): Int
+        @JvmStatic
+        private external fun kmpTorCtrlRead(ctx: Long, dst: ByteArray, offset: Int, len: Int): Int
+        @JvmStatic
+        private external fun kmpTorCtrlWrite(ctx: Long, src: ByteArray, offset: Int, len: Int): Int
+        @JvmStatic
+        private external fun kmpTorWarmRestart(ctx: Long, enable: Boolean): Int
         @JvmStatic
-        @Synchronized
-        private external fun kmpTorRunMain(libTor: ByteArray, args: Array<ByteArray>, errBuf: ByteArray): Int
+        private external fun kmpTorWarmRestartSavedNanos(ctx: Long): Long
         @JvmStatic
-        @Synchronized
-        private external fun kmpTorState(): Int
+        private external fun kmpTorStats(ctx: Long, stats: LongArray, errBuf: ByteArray): Int
         @JvmStatic
-        @Synchronized
-        private external fun kmpTorTerminateAndAwaitResult(): Int
+        private external fun kmpTorTerminateAndAwaitResult(ctx: Long): Int
     }
 }
@@ -88,6 +88,39 @@ public actual class ResourceLoaderTorNoExec: ResourceLoader.Tor.NoExec {
             create = { dir -> KmpTorApi.of(dir, registerShutdownHook) },
             toString = ::noExecToString,
         )
+
+        /**
+         * DEPRECATED
+         *
+         * Creates a new, independent [TorApiNoExec] with provided [resourceDir]. Unlike the
+         * [TorApi] of [getOrCreate], a new instance is returned upon every call, each of
+         * which is able to run tor concurrently with the others.
+         *
+         * The returned instance MUST be closed via [TorApiNoExec.close] once it is no longer
+         * needed.
+         *
+         * @param [resourceDir] The directory to extract resources to.
+         *
+         * @throws [IllegalStateException] If native resources could not be allocated.
+         * @throws [IOException] If [absoluteFile2] has to reference the filesystem to construct
+         *   an absolute path and fails due to a filesystem security exception.
+         * */
+        @JvmStatic
+        @Deprecated(
+            message = """
+
+                libjvm has major thread/memory management issues in the JNI layer. Also, JPE 472
+                is phasing out JNI all together. Use the resource-exec-tor{-gpl} dependency instead.
+                See: https://github.com/05nelsonm/kmp-tor-resource/issues/156
+            """,
+            level = DeprecationLevel.WARNING,
+        )
+        public final override fun newTorApi(
+            resourceDir: File,
+        ): TorApiNoExec = KmpTorApi.of(
+            resourceDir = resourceDir.absoluteFile2(),
+            registerShutdownHook = false,
+        )
     }
 
     @Throws(IllegalStateException::class)
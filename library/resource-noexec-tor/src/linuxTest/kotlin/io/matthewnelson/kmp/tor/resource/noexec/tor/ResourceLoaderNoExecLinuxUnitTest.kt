@@ -17,19 +17,122 @@ package io.matthewnelson.kmp.tor.resource.noexec.tor
 
 import io.ktor.client.engine.HttpClientEngineFactory
 import io.ktor.client.engine.curl.Curl
+import io.matthewnelson.kmp.tor.common.api.TorApi
 import io.matthewnelson.kmp.tor.resource.noexec.tor.TestRuntimeBinder.LOADER
+import io.matthewnelson.kmp.tor.resource.noexec.tor.internal.KmpTorApi
+import io.matthewnelson.kmp.tor.resource.noexec.tor.internal.__kmp_tor_deinit
 import io.matthewnelson.kmp.tor.resource.noexec.tor.internal.__kmp_tor_init
+import kotlinx.cinterop.ByteVar
 import kotlinx.cinterop.ExperimentalForeignApi
+import kotlinx.cinterop.alloc
+import kotlinx.cinterop.allocArray
+import kotlinx.cinterop.convert
+import kotlinx.cinterop.memScoped
+import kotlinx.cinterop.ptr
+import kotlinx.cinterop.toKString
+import platform.posix.POLLIN
+import platform.posix.fclose
+import platform.posix.fgets
+import platform.posix.fopen
+import platform.posix.poll
+import platform.posix.pollfd
+import platform.posix.read
+import kotlin.concurrent.AtomicReference
 import kotlin.test.Test
-import kotlin.test.assertNull
+import kotlin.test.assertEquals
+import kotlin.test.assertFalse
+import kotlin.test.assertNotEquals
+import kotlin.test.assertNotNull
+import kotlin.test.assertTrue
+import kotlin.time.Duration.Companion.seconds
 
 class ResourceLoaderNoExecLinuxUnitTest: ResourceLoaderNoExecBaseTest() {
     override val factory: HttpClientEngineFactory<*>? = Curl
 
     @Test
-    fun givenKmpTorContext_whenAlreadyLoaded_thenReturnsNull() {
+    @OptIn(ExperimentalForeignApi::class)
+    fun givenKmpTorContext_whenAlreadyLoaded_thenReturnsNewContext() {
         LOADER.withApi(TestRuntimeBinder) {}
-        @OptIn(ExperimentalForeignApi::class)
-        assertNull(__kmp_tor_init())
+        val ctx = __kmp_tor_init()
+        assertNotNull(ctx)
+        assertEquals(0, __kmp_tor_deinit(ctx))
+    }
+
+    @Test
+    @OptIn(ExperimentalForeignApi::class)
+    fun givenStateFd_whenStateTransitions_thenBecomesReadable() {
+        if (!CAN_RUN_FULL_TESTS) {
+            println("Skipping...")
+            return
+        }
+
+        val api = LOADER.withApi(TestRuntimeBinder) { this } as KmpTorApi
+        val fd = api.stateFd()
+        assertNotEquals(-1, fd)
+
+        fun isReadable(): Boolean = memScoped {
+            val pfd = alloc<pollfd>()
+            pfd.fd = fd
+            pfd.events = POLLIN.convert()
+            poll(pfd.ptr, 1.convert(), 0) == 1
+        }
+
+        fun drain() = memScoped {
+            val buf = allocArray<ByteVar>(8)
+            while (read(fd, buf, 8.convert()) > 0) {}
+        }
+
+        drain()
+        assertFalse(isReadable())
+
+        api.torRunMain(listOf("--SocksPort", "-1", "--verify-config", "--quiet"))
+        assertEquals(TorApi.State.STOPPED, api.awaitState(TorApi.State.STOPPED, 10.seconds.inWholeNanoseconds))
+        assertTrue(isReadable())
+
+        drain()
+        assertFalse(isReadable())
+
+        assertEquals(1, api.terminateAndAwaitResult())
+        assertTrue(isReadable())
+        drain()
+    }
+
+    @Test
+    @OptIn(ExperimentalForeignApi::class)
+    fun givenThreadName_whenTorRunMain_thenIsAppliedToTorThread() {
+        if (!CAN_RUN_FULL_TESTS) {
+            println("Skipping...")
+            return
+        }
+
+        val api = LOADER.withApi(TestRuntimeBinder) { this } as TorApiNoExec
+        val comm = AtomicReference<String?>(null)
+
+        // STARTED is published from tor's thread, after its options are applied
+        api.stateListener { state ->
+            if (state != TorApi.State.STARTED) return@stateListener
+            comm.value = memScoped {
+                val file = fopen("/proc/thread-self/comm", "r") ?: return@memScoped null
+                try {
+                    val buf = allocArray<ByteVar>(32)
+                    fgets(buf, 32, file)?.toKString()?.trimEnd('\n')
+                } finally {
+                    fclose(file)
+                }
+            }
+        }
+
+        api.threadOptions = TorApiNoExec.ThreadOptions(name = "kmp_tor_test_thread")
+        try {
+            api.torRunMain(listOf("--SocksPort", "-1", "--verify-config", "--quiet"))
+            assertEquals(TorApi.State.STOPPED, api.awaitState(TorApi.State.STOPPED, 10.seconds.inWholeNanoseconds))
+        } finally {
+            api.threadOptions = null
+            api.stateListener(null)
+            api.terminateAndAwaitResult()
+        }
+
+        // Linux truncates to 15 bytes
+        assertEquals("kmp_tor_test_th", comm.value)
     }
 }
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2025 Matthew Nelson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+package io.matthewnelson.kmp.tor.resource.noexec.tor.internal
+
+import io.matthewnelson.kmp.file.File
+import io.matthewnelson.kmp.tor.common.api.TorApi
+import io.matthewnelson.kmp.tor.resource.noexec.tor.TorApiNoExec
+import kotlinx.cinterop.COpaquePointer
+import kotlinx.cinterop.CPointer
+import kotlinx.cinterop.ExperimentalForeignApi
+import kotlinx.cinterop.IntVar
+import kotlinx.cinterop.MemScope
+import kotlinx.cinterop.StableRef
+import kotlinx.cinterop.alloc
+import kotlinx.cinterop.allocArray
+import kotlinx.cinterop.asStableRef
+import kotlinx.cinterop.convert
+import kotlinx.cinterop.cstr
+import kotlinx.cinterop.memScoped
+import kotlinx.cinterop.ptr
+import kotlinx.cinterop.staticCFunction
+import kotlinx.cinterop.toKString
+
+/**
+ * Maps a `kmp_tor_state_t` to its [TorApi.State]. The wrappers return -1
+ * once the context is closed, which is reported as [TorApi.State.OFF].
+ * */
+internal fun Int.toState(): TorApi.State = TorApi.State.entries.getOrNull(this) ?: TorApi.State.OFF
+
+/**
+ * Replaces the state listener for [this] context, returning the reference
+ * which must be held until it is replaced again (or the context is freed).
+ * The [current] reference is disposed of.
+ *
+ * Listeners are invoked one transition at a time, possibly from tor's
+ * thread, without the `kmp_tor_context_t` lock held (see
+ * [KmpTorApi.stateListener]).
+ * */
+@OptIn(ExperimentalForeignApi::class)
+internal fun CPointer<__kmp_tor_context_t>.stateListener(
+    current: StableRef<(TorApi.State) -> Unit>?,
+    listener: ((TorApi.State) -> Unit)?,
+): StableRef<(TorApi.State) -> Unit>? {
+    val ref = listener?.let { StableRef.create(it) }
+    val result = __kmp_tor_state_listener(
+        __ctx = this,
+        listener = if (ref == null) null else ON_STATE,
+        arg = ref?.asCPointer(),
+    )
+    if (result != 0) {
+        ref?.dispose()
+        throw IllegalStateException("Failed to set kmp_tor state listener")
+    }
+
+    // Nothing is executing the old listener once replaced, so it is safe to release
+    current?.dispose()
+    return ref
+}
+
+@OptIn(ExperimentalForeignApi::class)
+private val ON_STATE = staticCFunction<Int, COpaquePointer?, Unit> { state, arg ->
+    val listener = arg?.asStableRef<(TorApi.State) -> Unit>()?.get() ?: return@staticCFunction
+    try {
+        listener(TorApi.State.entries.elementAt(state))
+    } catch (_: Throwable) {}
+}
+
+/**
+ * Allocates the `kmp_tor_thread_options_t` for [options] within [this] scope,
+ * or returns `null` if [options] is `null`.
+ * */
+@OptIn(ExperimentalForeignApi::class)
+internal fun MemScope.allocThreadOptions(
+    options: TorApiNoExec.ThreadOptions?,
+): CPointer<kmp_tor_thread_options_t>? {
+    if (options == null) return null
+    val cpus = options.cpuSet ?: IntArray(0)
+    return alloc<kmp_tor_thread_options_t> {
+        stack_size = options.stackSize.convert()
+        cpu_set = if (cpus.isEmpty()) null else allocArray<IntVar>(cpus.size) { i -> value = cpus[i] }
+        cpu_set_len = cpus.size
+        sched_policy = options.schedPolicy.ordinal
+        set_nice = if (options.nice != null) 1 else 0
+        nice = options.nice ?: 0
+        name = options.name?.cstr?.getPointer(this@allocThreadOptions)
+    }.ptr
+}
+
+/**
+ * Copies the `kmp_tor_stats_t` for [this] context.
+ *
+ * @throws [IllegalStateException] If it could not be retrieved.
+ * */
+@OptIn(ExperimentalForeignApi::class)
+internal fun CPointer<__kmp_tor_context_t>.stats(): TorApiNoExec.Stats = memScoped {
+    val stats = alloc<kmp_tor_stats_t>()
+    if (__kmp_tor_stats(__ctx = this@stats, stats = stats.ptr) != 0) {
+        throw IllegalStateException("Failed to retrieve kmp_tor_stats_t")
+    }
+
+    // Struct order
+    val values = longArrayOf(
+        stats.run_count.toLong(),
+        stats.started_at_ns.toLong(),
+        stats.stopped_at_ns.toLong(),
+        stats.lib_open_ns.toLong(),
+        stats.lib_resolve_ns.toLong(),
+        stats.configure_ns.toLong(),
+        stats.thread_start_ns.toLong(),
+        stats.run_main_ns.toLong(),
+        stats.cleanup_ns.toLong(),
+        stats.lib_close_ns.toLong(),
+        stats.warm_lib_close_ns.toLong(),
+        stats.lib_close_failures.toLong(),
+        stats.lib_close_retries.toLong(),
+    )
+    TorApiNoExec.Stats(values, stats.last_error.toKString().ifEmpty { null })
+}
+
+/**
+ * Returns the last modification time of [this] in seconds since the epoch,
+ * or -1 if it cannot be stat'd.
+ * */
+internal expect fun File.lastModifiedSeconds(): Long
@@ -42,6 +42,24 @@ public actual abstract class GetOrCreate internal actual constructor() {
         resourceDir: File
     ): ResourceLoader.Tor
 
+    /**
+     * Creates a new, independent [TorApiNoExec] with provided [resourceDir]. Unlike the
+     * [TorApi] of [getOrCreate], a new instance is returned upon every call, each of
+     * which is able to run tor concurrently with the others.
+     *
+     * The returned instance MUST be closed via [TorApiNoExec.close] once it is no longer
+     * needed.
+     *
+     * @param [resourceDir] The directory to extract resources to.
+     *
+     * @throws [IllegalStateException] If native resources could not be allocated.
+     * @throws [IOException] If [absoluteFile2] has to reference the filesystem to construct
+     *   an absolute path and fails due to a filesystem security exception.
+     * */
+    public abstract fun newTorApi(
+        resourceDir: File
+    ): TorApiNoExec
+
     /**
      * DEPRECATED
      *
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2025 Matthew Nelson
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+package io.matthewnelson.kmp.tor.resource.noexec.tor
+
+import io.matthewnelson.kmp.file.IOException
+import io.matthewnelson.kmp.tor.common.api.InternalKmpTorApi
+import io.matthewnelson.kmp.tor.common.api.ResourceLoader
+import io.matthewnelson.kmp.tor.common.api.TorApi
+import kotlin.jvm.JvmField
+
+// noExecMain
+/**
+ * The [TorApi] which runs tor in-process via `external/native/kmp_tor.c`.
+ *
+ * The [TorApi] of the [ResourceLoader.Tor] returned by [GetOrCreate.getOrCreate]
+ * is an instance of this, and [GetOrCreate.newTorApi] creates additional ones
+ * which are able to run tor concurrently (each with its own copy of libtor).
+ * */
+@OptIn(InternalKmpTorApi::class)
+public abstract class TorApiNoExec internal constructor(): TorApi() {
+
+    /**
+     * Attributes for the thread which runs tor's main loop, applied upon the
+     * next call to [torRunMain]. If `null` (the default), platform defaults
+     * are used.
+     * */
+    public abstract var threadOptions: ThreadOptions?
+
+    /**
+     * Blocks until tor reaches [state], or [timeoutNanos] elapses (negative to
+     * wait indefinitely, 0 to not wait at all).
+     *
+     * @return The state at the time of returning.
+     * */
+    public abstract fun awaitState(state: State, timeoutNanos: Long): State
+
+    /**
+     * Sets (or clears, if `null`) the [listener] to be notified of state
+     * transitions. It is invoked one transition at a time and in order,
+     * possibly from tor's thread, without any lock held (see
+     * `kmp_tor_state_listener_t`). It should return quickly, and MUST NOT
+     * call [torRunMain], [terminateAndAwaitResult], [stateListener] or [close].
+     * */
+    public abstract fun stateListener(listener: ((State) -> Unit)?)
+
+    /**
+     * Reads control-protocol output from tor's owning controller connection
+     * into [dst]. The connection is already authenticated.
+     *
+     * @return The number of bytes read, or -1 if the connection has reached EOF.
+     * @throws [IllegalArgumentException] If [offset] and [len] are not within [dst].
+     * @throws [IOException] If tor is not running, or the read failed.
+     * */
+    @Throws(IllegalArgumentException::class, IOException::class)
+    public abstract fun ctrlRead(dst: ByteArray, offset: Int, len: Int): Int
+
+    /**
+     * Writes control-protocol input from [src] to tor's owning controller
+     * connection. At most 8192 bytes are written per call. tor's
+     * `DROPOWNERSHIP` command is refused, as [terminateAndAwaitResult] relies
+     * upon tor owning the connection.
+     *
+     * @return The number of bytes written.
+     * @throws [IllegalArgumentException] If [offset] and [len] are not within [src].
+     * @throws [IOException] If tor is not running, the write failed, or it
+     *   would have completed a `DROPOWNERSHIP` command.
+     * */
+    @Throws(IllegalArgumentException::class, IOException::class)
+    public abstract fun ctrlWrite(src: ByteArray, offset: Int, len: Int): Int
+
+    /**
+     * Enables (or disables) retaining the loaded libtor between runs, such
+     * that it need not be loaded again upon the next call to [torRunMain]
+     * (see `kmp_tor_warm_restart`). Disabling it releases a retained libtor.
+     * */
+    public abstract fun warmRestart(enable: Boolean)
+
+    /**
+     * Returns the cumulative time, in nanoseconds, saved by [warmRestart]
+     * (see `kmp_tor_warm_restart_saved_ns`).
+     * */
+    public abstract fun warmRestartSavedNanos(): Long
+
+    /**
+     * Returns lifecycle instrumentation for this instance (see `kmp_tor_stats_t`).
+     * May be called while tor is starting or stopping.
+     *
+     * @throws [IllegalStateException] If it could not be retrieved.
+     * */
+    @Throws(IllegalStateException::class)
+    public abstract fun stats(): Stats
+
+    /**
+     * Terminates tor (if running) and releases this instance's native
+     * resources (and copy of libtor, if any). Afterward, [torRunMain] fails
+     * and everything else behaves as though tor is not running.
+     *
+     * MUST be called once the instance is no longer needed, as Jvm/Android
+     * never releases them otherwise (Native does so upon garbage collection,
+     * but only if no [stateListener] references the instance).
+     * */
+    public abstract fun close()
+
+    /**
+     * Attributes for the thread which runs tor's main loop (see
+     * `kmp_tor_thread_options_t`). Failure to apply anything other than
+     * [stackSize] does not fail startup, but is reported via [Stats.lastError].
+     *
+     * @param [cpuSet] Indices of the CPUs to pin the thread to. Linux/Android only.
+     * @param [stackSize] Stack size in bytes, or 0 for the platform default.
+     * @param [schedPolicy] Scheduling policy (Darwin maps it to a QoS class).
+     * @param [nice] Nice value for the thread, or `null` to inherit. Linux/Android only.
+     * @param [name] Thread name (truncated to 15 bytes on Linux/Android). Not
+     *   supported on Windows.
+     * */
+    public class ThreadOptions(
+        @JvmField public val cpuSet: IntArray? = null,
+        @JvmField public val stackSize: Long = 0L,
+        @JvmField public val schedPolicy: SchedPolicy = SchedPolicy.Default,
+        @JvmField public val nice: Int? = null,
+        @JvmField public val name: String? = null,
+    ) {
+
+        init {
+            require(stackSize >= 0L) { "stackSize cannot be negative" }
+        }
+
+        // Ordinals MUST match KMP_TOR_THREAD_SCHED values
+        public enum class SchedPolicy {
+            Default,
+            Batch,
+            Idle,
+        }
+    }
+
+    /**
+     * A snapshot of `kmp_tor_stats_t`. All values are in nanoseconds of a
+     * monotonic clock, and phase durations are for the most recent run
+     * ([warmLibCloseNanos] is for the most recently released warm restart
+     * image).
+     * */
+    public class Stats internal constructor(values: LongArray, @JvmField public val lastError: String?) {
+        @JvmField public val runCount: Long = values[0]
+        @JvmField public val startedAtNanos: Long = values[1]
+        @JvmField public val stoppedAtNanos: Long = values[2]
+        @JvmField public val libOpenNanos: Long = values[3]
+        @JvmField public val libResolveNanos: Long = values[4]
+        @JvmField public val configureNanos: Long = values[5]
+        @JvmField public val threadStartNanos: Long = values[6]
+        @JvmField public val runMainNanos: Long = values[7]
+        @JvmField public val cleanupNanos: Long = values[8]
+        @JvmField public val libCloseNanos: Long = values[9]
+        @JvmField public val warmLibCloseNanos: Long = values[10]
+        @JvmField public val libCloseFailures: Long = values[11]
+        @JvmField public val libCloseRetries: Long = values[12]
+
+        /** @suppress */
+        public override fun toString(): String = "TorApiNoExec.Stats[" +
+            "runCount=$runCount, " +
+            "startedAtNanos=$startedAtNanos, " +
+            "stoppedAtNanos=$stoppedAtNanos, " +
+            "libOpenNanos=$libOpenNanos, " +
+            "libResolveNanos=$libResolveNanos, " +
+            "configureNanos=$configureNanos, " +
+            "threadStartNanos=$threadStartNanos, " +
+            "runMainNanos=$runMainNanos, " +
+            "cleanupNanos=$cleanupNanos, " +
+            "libCloseNanos=$libCloseNanos, " +
+            "warmLibCloseNanos=$warmLibCloseNanos, " +
+            "libCloseFailures=$libCloseFailures, " +
+            "libCloseRetries=$libCloseRetries, " +
+            "lastError=$lastError]"
+
+        internal companion object {
+
+            // Number of uint64_t fields preceding last_error in kmp_tor_stats_t.
+            // MUST match STATS_LEN in external/native/kmp_tor-jni.c
+            internal const val LEN: Int = 13
+        }
+    }
+}
@@ -19,15 +19,28 @@ package io.matthewnelson.kmp.tor.resource.noexec.tor.internal
 
 import io.matthewnelson.kmp.file.File
 import io.matthewnelson.kmp.file.IOException
-import io.matthewnelson.kmp.tor.common.api.TorApi
+import io.matthewnelson.kmp.tor.resource.noexec.tor.TorApiNoExec
 
 // noExec
-internal expect class KmpTorApi: TorApi {
+internal expect class KmpTorApi: TorApiNoExec {
+
+    override var threadOptions: ThreadOptions?
 
     @Throws(IllegalStateException::class, IOException::class)
     override fun torRunMain(args: Array<String>)
     override fun state(): State
+    override fun awaitState(state: State, timeoutNanos: Long): State
+    override fun stateListener(listener: ((State) -> Unit)?)
+    @Throws(IllegalArgumentException::class, IOException::class)
+    override fun ctrlRead(dst: ByteArray, offset: Int, len: Int): Int
+    @Throws(IllegalArgumentException::class, IOException::class)
+    override fun ctrlWrite(src: ByteArray, offset: Int, len: Int): Int
+    override fun warmRestart(enable: Boolean)
+    override fun warmRestartSavedNanos(): Long
+    @Throws(IllegalStateException::class)
+    override fun stats(): Stats
     override fun terminateAndAwaitResult(): Int
+    override fun close()
 
     internal companion object {
 
@@ -38,3 +51,26 @@ internal expect class KmpTorApi: TorApi {
         ): KmpTorApi
     }
 }
+
+/**
+ * Checks the region for [KmpTorApi.ctrlRead] and [KmpTorApi.ctrlWrite].
+ * */
+@Throws(IllegalArgumentException::class)
+internal fun ByteArray.requireCtrlRegion(offset: Int, len: Int) {
+    require(offset >= 0) { "offset[$offset] < 0" }
+    require(len >= 0) { "len[$len] < 0" }
+    require(size - offset >= len) { "offset[$offset] + len[$len] > size[$size]" }
+}
+
+/**
+ * Checks the result of `kmp_tor_ctrl_write` for [KmpTorApi.ctrlWrite].
+ *
+ * tor's `DROPOWNERSHIP` command is refused (-2), as [KmpTorApi.terminateAndAwaitResult]
+ * relies upon tor owning the controller connection in order to stop it.
+ * */
+@Throws(IOException::class)
+internal fun Int.checkCtrlWritten(): Int {
+    if (this == -2) throw IOException("tor's DROPOWNERSHIP command is not permitted")
+    if (this < 0) throw IOException("Failed to write to tor's controller connection")
+    return this
+}
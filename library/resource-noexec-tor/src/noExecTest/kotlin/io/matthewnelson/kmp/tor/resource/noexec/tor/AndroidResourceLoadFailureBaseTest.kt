@@ -20,6 +20,7 @@ import io.matthewnelson.kmp.tor.resource.noexec.tor.TestRuntimeBinder.LOADER
 import kotlin.test.Test
 import kotlin.test.assertEquals
 import kotlin.test.assertNotNull
+import kotlin.test.assertTrue
 import kotlin.test.fail
 
 /**
@@ -51,7 +52,10 @@ abstract class AndroidResourceLoadFailureBaseTest {
                 torRunMain(listOf("--version"))
                 fail("torRunMain did not throw exception")
             } catch (t: IllegalStateException) {
-                assertEquals("Failed to load tor", t.message)
+                // Carries the reason dlopen gave
+                val message = t.message ?: ""
+                assertTrue(message.startsWith("Failed to load tor: "), message)
+                assertTrue(message.contains("libtor_fail.so"), message)
                 assertEquals(TorApi.State.OFF, state())
                 // pass
             } finally {
@@ -41,6 +41,7 @@ import kotlinx.coroutines.test.TestResult
 import kotlinx.coroutines.test.TestScope
 import kotlinx.coroutines.test.runTest
 import kotlin.test.*
+import kotlin.time.Duration.Companion.milliseconds
 import kotlin.time.Duration.Companion.minutes
 import kotlin.time.Duration.Companion.seconds
 
@@ -208,6 +209,202 @@ abstract class ResourceLoaderNoExecBaseTest protected constructor(
         }
     }
 
+    @Test
+    open fun givenStateListener_whenTorStartsAndStops_thenObservesEachTransition() = runTest(timeout = 1.minutes) {
+        if (skipTorRunMain) return@runTest
+
+        val helper = TorApiHelper(scope = this)
+        if (helper == null) {
+            println("Skipping...")
+            return@runTest
+        }
+
+        val api = LOADER.withApi(TestRuntimeBinder) { this } as TorApiNoExec
+        val states = ArrayList<TorApi.State>(4)
+        api.stateListener { state ->
+            // Invoked one at a time without any lock held, so may call back in
+            api.state()
+            states.add(state)
+        }
+        helper.job.invokeOnCompletion {
+            api.stateListener(null)
+            api.terminateAndAwaitResult()
+        }
+
+        // Does not wait
+        assertEquals(TorApi.State.OFF, api.awaitState(TorApi.State.STARTED, timeoutNanos = 0L))
+
+        api.torRunMain(helper.args)
+        assertEquals(TorApi.State.STARTED, api.awaitState(TorApi.State.STARTED, 5.seconds.inWholeNanoseconds))
+
+        // Times out
+        assertEquals(TorApi.State.STARTED, api.awaitState(TorApi.State.OFF, 250.milliseconds.inWholeNanoseconds))
+
+        withContext(helper.bgDispatcher) {
+            delay(1.seconds)
+            assertEquals(0, api.terminateAndAwaitResult())
+        }
+
+        assertEquals(TorApi.State.OFF, api.awaitState(TorApi.State.OFF, timeoutNanos = 0L))
+        api.stateListener(null)
+
+        val expected = listOf(
+            TorApi.State.STARTING,
+            TorApi.State.STARTED,
+            TorApi.State.STOPPED,
+            TorApi.State.OFF,
+        )
+        assertEquals(expected, states)
+    }
+
+    @Test
+    open fun givenCtrlChannel_whenProtocolInfo_thenRoundTrips() = runTest(timeout = 1.minutes) {
+        if (skipTorRunMain) return@runTest
+
+        val helper = TorApiHelper(scope = this)
+        if (helper == null) {
+            println("Skipping...")
+            return@runTest
+        }
+
+        val api = LOADER.withApi(TestRuntimeBinder) { this } as TorApiNoExec
+        helper.job.invokeOnCompletion { api.terminateAndAwaitResult() }
+
+        // Not running
+        assertFailsWith<IOException> { api.ctrlWrite(ByteArray(1), 0, 1) }
+
+        api.torRunMain(helper.args)
+        assertEquals(TorApi.State.STARTED, api.awaitState(TorApi.State.STARTED, 5.seconds.inWholeNanoseconds))
+
+        // The owning controller connection is already authenticated
+        val request = "PROTOCOLINFO 1\r\n".encodeToByteArray()
+        var written = 0
+        while (written < request.size) {
+            written += api.ctrlWrite(request, written, request.size - written)
+        }
+
+        val response = withContext(helper.bgDispatcher) {
+            val buf = ByteArray(256)
+            val sb = StringBuilder()
+            while (!sb.endsWith("250 OK\r\n")) {
+                val read = api.ctrlRead(buf, 0, buf.size)
+                if (read == -1) break
+                sb.append(buf.decodeToString(endIndex = read))
+            }
+            sb.toString()
+        }
+
+        assertTrue(response.startsWith("250-PROTOCOLINFO 1\r\n"), response)
+        assertTrue(response.contains("250-VERSION Tor="), response)
+        assertTrue(response.endsWith("250 OK\r\n"), response)
+
+        // A blocked read holds a reference to the connection, which
+        // terminateAndAwaitResult shuts down and then waits out.
+        val blocked = async(Dispatchers.Default) { api.ctrlRead(ByteArray(64), 0, 64) }
+        withContext(helper.bgDispatcher) {
+            delay(500.milliseconds)
+            assertEquals(0, api.terminateAndAwaitResult())
+        }
+        assertEquals(-1, blocked.await())
+
+        assertFailsWith<IOException> { api.ctrlRead(ByteArray(1), 0, 1) }
+        assertFailsWith<IOException> { api.ctrlWrite(ByteArray(1), 0, 1) }
+    }
+
+    @Test
+    open fun givenCtrlChannel_whenDropOwnership_thenIsRefusedAndTerminateStillStopsTor() = runTest(timeout = 1.minutes) {
+        if (skipTorRunMain) return@runTest
+
+        val helper = TorApiHelper(scope = this)
+        if (helper == null) {
+            println("Skipping...")
+            return@runTest
+        }
+
+        val api = LOADER.withApi(TestRuntimeBinder) { this } as TorApiNoExec
+        helper.job.invokeOnCompletion { api.terminateAndAwaitResult() }
+
+        api.torRunMain(helper.args)
+        assertEquals(TorApi.State.STARTED, api.awaitState(TorApi.State.STARTED, 5.seconds.inWholeNanoseconds))
+
+        // Were tor to drop ownership of the connection, shutting it
+        // down would no longer stop tor and terminate would hang.
+        val request = "DROPOWNERSHIP\r\n".encodeToByteArray()
+        assertFailsWith<IOException> { api.ctrlWrite(request, 0, request.size) }
+
+        // Split across writes
+        assertEquals(7, api.ctrlWrite(request, 0, 7))
+        assertFailsWith<IOException> { api.ctrlWrite(request, 7, request.size - 7) }
+
+        withContext(helper.bgDispatcher) {
+            assertEquals(0, api.terminateAndAwaitResult())
+        }
+        assertEquals(TorApi.State.OFF, api.state())
+    }
+
+    @Test
+    open fun givenMultipleInstances_whenRunConcurrently_thenEachLoadsItsOwnLibTor() = runTest(timeout = 1.minutes) {
+        if (skipTorRunMain) return@runTest
+
+        val helper = TorApiHelper(scope = this)
+        if (helper == null) {
+            println("Skipping...")
+            return@runTest
+        }
+
+        val primary = LOADER.withApi(TestRuntimeBinder) { this } as TorApiNoExec
+        val secondary = ResourceLoaderTorNoExec.newTorApi(LOADER.resourceDir)
+        helper.job.invokeOnCompletion {
+            primary.terminateAndAwaitResult()
+            secondary.close()
+        }
+
+        // tor locks its DataDirectory, so the second instance needs its own
+        val cacheDir2 = LOADER.resourceDir.resolve("cache2")
+        val dataDir2 = LOADER.resourceDir.resolve("data2")
+        val logFile2 = LOADER.resourceDir.resolve("test2.log")
+        cacheDir2.mkdirs2(mode = null)
+        dataDir2.mkdirs2(mode = null)
+        helper.job.invokeOnCompletion {
+            helper.deleteTestFiles(
+                logFile2,
+                cacheDir2.resolve("cached-certs"),
+                cacheDir2,
+                dataDir2.resolve("lock"),
+                dataDir2.resolve("state"),
+                dataDir2.resolve("keys"),
+                dataDir2,
+            )
+        }
+        val args2 = helper.args.map { arg ->
+            when (arg) {
+                helper.cacheDir.path -> cacheDir2.path
+                helper.dataDir.path -> dataDir2.path
+                "debug file ${helper.logFile}" -> "debug file $logFile2"
+                else -> arg
+            }
+        }
+
+        primary.torRunMain(helper.args)
+        secondary.torRunMain(args2)
+        assertEquals(TorApi.State.STARTED, primary.awaitState(TorApi.State.STARTED, 5.seconds.inWholeNanoseconds))
+        assertEquals(TorApi.State.STARTED, secondary.awaitState(TorApi.State.STARTED, 5.seconds.inWholeNanoseconds))
+
+        withContext(helper.bgDispatcher) {
+            delay(1.seconds)
+            assertEquals(0, secondary.terminateAndAwaitResult())
+            assertEquals(TorApi.State.STARTED, primary.state())
+            assertEquals(0, primary.terminateAndAwaitResult())
+        }
+
+        assertEquals(1L, secondary.stats().runCount)
+
+        secondary.close()
+        assertEquals(TorApi.State.OFF, secondary.state())
+        assertEquals(-1, secondary.terminateAndAwaitResult())
+        assertFailsWith<IllegalStateException> { secondary.torRunMain(args2) }
+    }
+
     @Test
     open fun givenTor_whenQueryCheckTorProject_thenConnectionIsUsingTor() = runTest(timeout = 10.minutes) {
         val factory = factory
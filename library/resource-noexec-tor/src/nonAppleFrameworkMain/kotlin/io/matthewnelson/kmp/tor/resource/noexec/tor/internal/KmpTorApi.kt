@@ -19,34 +19,79 @@ package io.matthewnelson.kmp.tor.resource.noexec.tor.internal
 
 import io.matthewnelson.kmp.file.File
 import io.matthewnelson.kmp.file.IOException
+import io.matthewnelson.kmp.file.delete2
+import io.matthewnelson.kmp.file.exists2
+import io.matthewnelson.kmp.file.mkdirs2
+import io.matthewnelson.kmp.file.name
+import io.matthewnelson.kmp.file.parentFile
 import io.matthewnelson.kmp.file.path
+import io.matthewnelson.kmp.file.resolve
 import io.matthewnelson.kmp.tor.common.api.InternalKmpTorApi
-import io.matthewnelson.kmp.tor.common.api.TorApi
 import io.matthewnelson.kmp.tor.common.core.SynchronizedObject
 import io.matthewnelson.kmp.tor.common.core.synchronized
 import io.matthewnelson.kmp.tor.common.core.synchronizedObject
+import io.matthewnelson.kmp.tor.resource.noexec.tor.TorApiNoExec
+import kotlinx.cinterop.ByteVar
 import kotlinx.cinterop.CPointer
 import kotlinx.cinterop.ExperimentalForeignApi
+import kotlinx.cinterop.StableRef
+import kotlinx.cinterop.addressOf
+import kotlinx.cinterop.allocArray
+import kotlinx.cinterop.convert
 import kotlinx.cinterop.memScoped
 import kotlinx.cinterop.toCStringArray
 import kotlinx.cinterop.toKString
+import kotlinx.cinterop.usePinned
+import platform.posix.FILE
+import platform.posix.SEEK_END
+import platform.posix.SEEK_SET
+import platform.posix.fclose
+import platform.posix.ferror
+import platform.posix.fopen
+import platform.posix.fread
+import platform.posix.fseek
+import platform.posix.ftell
+import platform.posix.fwrite
+import platform.posix.remove
+import kotlin.concurrent.AtomicInt
+import kotlin.concurrent.AtomicReference
+import kotlin.experimental.ExperimentalNativeApi
+import kotlin.native.ref.Cleaner
+import kotlin.native.ref.createCleaner
 
 // nonAppleFramework
 @OptIn(ExperimentalForeignApi::class, InternalKmpTorApi::class)
-internal actual class KmpTorApi private constructor(private val resourceDir: File): TorApi() {
+internal actual class KmpTorApi private constructor(private val resourceDir: File): TorApiNoExec() {
 
     private val ctx: CPointer<__kmp_tor_context_t>
     private val lock: SynchronizedObject
+    // Referenced by cleaner, which disposes of it if close is never called
+    private val stateListener = AtomicReference<StableRef<(State) -> Unit>?>(null)
+    private var isClosed: Boolean = false
+    private val slot: Slot
+    @Suppress("unused")
+    @OptIn(ExperimentalNativeApi::class)
+    private val cleaner: Cleaner
+
+    actual override var threadOptions: ThreadOptions?
+        get() = _threadOptions.value
+        set(value) { _threadOptions.value = value }
+    private val _threadOptions = AtomicReference<ThreadOptions?>(null)
 
     @Throws(IllegalStateException::class, IOException::class)
     actual override fun torRunMain(args: Array<String>) {
-        val libTor = synchronized(lock) { extractLibTor(isInit = false) }.path
+        val libTor = synchronized(lock) {
+            check(!isClosed) { "KmpTorApi is closed" }
+            slot.libTor(extractLibTor(isInit = false))
+        }.path
+        val options = threadOptions
         val error: String = memScoped {
-            val result = __kmp_tor_run_main(
+            val result = __kmp_tor_run_main_with_options(
                 __ctx = ctx,
                 lib_tor = libTor,
                 argc = args.size,
                 argv = args.toCStringArray(autofreeScope = this),
+                options = allocThreadOptions(options),
             )
 
             result?.toKString()
@@ -54,23 +99,132 @@ internal actual class KmpTorApi private constructor(private val resourceDir: Fil
         throw IllegalStateException(error)
     }
 
-    actual override fun state(): State = State.entries.elementAt(__kmp_tor_state(ctx))
+    actual override fun state(): State = __kmp_tor_state(ctx).toState()
+    actual override fun awaitState(state: State, timeoutNanos: Long): State {
+        return __kmp_tor_await_state(ctx, state.ordinal, timeoutNanos).toState()
+    }
+    actual override fun stateListener(listener: ((State) -> Unit)?) {
+        synchronized(lock) {
+            if (isClosed) return
+            stateListener.value = ctx.stateListener(stateListener.value, listener)
+        }
+    }
+    // See kmp_tor_state_fd. Returns -1 on Windows.
+    internal fun stateFd(): Int = __kmp_tor_state_fd(ctx)
     actual override fun terminateAndAwaitResult(): Int = __kmp_tor_terminate_and_await_result(ctx)
 
+    @Throws(IllegalArgumentException::class, IOException::class)
+    actual override fun ctrlRead(dst: ByteArray, offset: Int, len: Int): Int {
+        dst.requireCtrlRegion(offset, len)
+        if (len == 0) return 0
+
+        val read = dst.usePinned { pinned -> __kmp_tor_ctrl_read(ctx, pinned.addressOf(offset), len) }
+        if (read < 0) throw IOException("Failed to read from tor's controller connection")
+        return if (read == 0) -1 else read
+    }
+
+    @Throws(IllegalArgumentException::class, IOException::class)
+    actual override fun ctrlWrite(src: ByteArray, offset: Int, len: Int): Int {
+        src.requireCtrlRegion(offset, len)
+        if (len == 0) return 0
+
+        return src.usePinned { pinned -> __kmp_tor_ctrl_write(ctx, pinned.addressOf(offset), len) }.checkCtrlWritten()
+    }
+
+    actual override fun warmRestart(enable: Boolean) { __kmp_tor_warm_restart(ctx, if (enable) 1 else 0) }
+    actual override fun warmRestartSavedNanos(): Long = __kmp_tor_warm_restart_saved_ns(ctx).toLong()
+    @Throws(IllegalStateException::class)
+    actual override fun stats(): Stats = ctx.stats()
+
+    /**
+     * Terminates tor (if running) and frees this instance's `kmp_tor_context_t`
+     * and libtor copy (if any). Afterward, [torRunMain] fails and everything
+     * else behaves as though tor is not running. If not called explicitly, the
+     * [cleaner] does so when this instance is garbage collected. A listener set
+     * via [stateListener] is held until then, so if it references this instance
+     * (directly or not), it never is.
+     * */
+    actual override fun close() {
+        synchronized(lock) {
+            if (isClosed) return
+            isClosed = true
+        }
+
+        // Returns once nothing is executing within ctx, see __kmp_tor_close
+        __kmp_tor_close(ctx)
+        synchronized(lock) {
+            stateListener.getAndSet(null)?.dispose()
+        }
+        slot.release()
+    }
+
     @Throws(IllegalStateException::class, IOException::class)
     private fun extractLibTor(isInit: Boolean): File = RESOURCE_CONFIG_LIB_TOR
         .extractTo(resourceDir, onlyIfDoesNotExist = !isInit)
         .findLibs()
         .getValue(ALIAS_LIBTOR)
 
+    /**
+     * tor keeps its state in globals, so instances running concurrently each
+     * need their own library image (see `kmp_tor_run_main`). The instance in
+     * slot 0 loads the extracted libtor, all others a copy of it which lives
+     * in [resourceDir] until [release].
+     *
+     * Referenced by [cleaner], so MUST NOT reference the [KmpTorApi].
+     * */
+    private class Slot(private val resourceDir: File) {
+
+        private val index: Int = synchronized(SLOTS_LOCK) {
+            var i = 0
+            while (!SLOTS.add(i)) i++
+            i
+        }
+        private val isReleased = AtomicInt(0)
+        private val copy = AtomicReference<File?>(null)
+
+        @Throws(IOException::class)
+        fun libTor(lib: File): File {
+            if (index == 0) return lib
+            val dir = resourceDir.resolve("libtor_ctx$index")
+            dir.mkdirs2(mode = null)
+            val copy = dir.resolve(lib.name)
+            lib.copyLibTo(copy)
+            this.copy.value = copy
+            return copy
+        }
+
+        fun release() {
+            if (!isReleased.compareAndSet(0, 1)) return
+            synchronized(SLOTS_LOCK) { SLOTS.remove(index) }
+            val copy = copy.value ?: return
+            try {
+                copy.delete2(ignoreReadOnly = true)
+                copy.parentFile?.delete2(ignoreReadOnly = true)
+            } catch (_: IOException) {}
+        }
+    }
+
     init {
         extractLibTor(isInit = true)
         ctx = __kmp_tor_init() ?: throw IllegalStateException("Failed to initialized kmp_tor_context_t")
         lock = synchronizedObject()
+        slot = Slot(resourceDir)
+
+        @OptIn(ExperimentalNativeApi::class)
+        cleaner = createCleaner(Triple(ctx, slot, stateListener)) { (ctx, slot, stateListener) ->
+            __kmp_tor_deinit(ctx)
+            // Nothing is executing the listener once ctx is freed
+            stateListener.getAndSet(null)?.dispose()
+            slot.release()
+        }
     }
 
     internal actual companion object {
 
+        // Slots held by live instances, see Slot. Guarded by SLOTS_LOCK.
+        private val SLOTS = HashSet<Int>(1, 1.0f)
+        private val SLOTS_LOCK = synchronizedObject()
+
         @Throws(IllegalStateException::class, IOException::class)
         internal actual fun of(
             resourceDir: File,
@@ -78,3 +232,60 @@ internal actual class KmpTorApi private constructor(private val resourceDir: Fil
         ): KmpTorApi = KmpTorApi(resourceDir)
     }
 }
+
+/**
+ * Copies libtor to [dest], unless [dest] already has the same size and is
+ * no older than libtor (i.e. libtor was not re-extracted since). A stale
+ * [dest] is removed (rather than overwritten) first, so an image of it still
+ * retained for a warm restart is left intact.
+ * */
+@OptIn(ExperimentalForeignApi::class)
+@Throws(IOException::class)
+private fun File.copyLibTo(dest: File) {
+    val src = fopen(path, "rb") ?: throw IOException("Failed to open $this")
+    try {
+        val size = src.size()
+        if (dest.exists2()) {
+            val existing = fopen(dest.path, "rb")
+            if (existing != null) {
+                val existingSize = try { existing.size() } finally { fclose(existing) }
+                val lastModified = lastModifiedSeconds()
+                if (existingSize == size && lastModified != -1L && dest.lastModifiedSeconds() >= lastModified) return
+            }
+            if (remove(dest.path) != 0) throw IOException("Failed to remove stale $dest")
+        }
+
+        val dst = fopen(dest.path, "wb") ?: throw IOException("Failed to open $dest")
+        var written = 0L
+        try {
+            memScoped {
+                val buf = allocArray<ByteVar>(COPY_BUF_LEN)
+                while (true) {
+                    val read = fread(buf, 1.convert(), COPY_BUF_LEN.convert(), src).toLong()
+                    if (read <= 0L) break
+                    if (fwrite(buf, 1.convert(), read.convert(), dst).toLong() != read) break
+                    written += read
+                }
+            }
+        } finally {
+            if (fclose(dst) != 0) written = -1L
+        }
+
+        if (written != size || ferror(src) != 0) {
+            remove(dest.path)
+            throw IOException("Failed to copy $this to $dest")
+        }
+    } finally {
+        fclose(src)
+    }
+}
+
+@OptIn(ExperimentalForeignApi::class)
+private fun CPointer<FILE>.size(): Long {
+    if (fseek(this, 0.convert(), SEEK_END) != 0) return -1L
+    val size = ftell(this).toLong()
+    fseek(this, 0.convert(), SEEK_SET)
+    return size
+}
+
+private const val COPY_BUF_LEN = 8192